@@ -0,0 +1,79 @@
+#include "Stream/MemoryStream.h"
+#include <chrono>
+#include <print>
+#include <random>
+
+// Same bytes without exposing the buffer, so every read takes the byte by byte path
+class ByteStream : public Stream
+{
+public:
+    ByteStream(std::span<const uint8_t> bytes)
+        : m_bytes(bytes)
+    {
+    }
+
+    virtual void read(void* buffer, size_t size) override
+    {
+        if (m_offset + size > m_bytes.size())
+            throw StreamReadException();
+        memcpy(buffer, m_bytes.data() + m_offset, size);
+        m_offset += size;
+    }
+
+    virtual void move_to(size_t offset) override { m_offset = offset; }
+    virtual size_t offset() const override { return m_offset; }
+    virtual size_t size() const override { return m_bytes.size(); }
+
+private:
+    std::span<const uint8_t> m_bytes;
+    size_t m_offset { 0 };
+};
+
+static void encode_leb(std::vector<uint8_t>& bytes, uint32_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            byte |= 0x80;
+        bytes.push_back(byte);
+    } while (value != 0);
+}
+
+template <typename StreamType>
+static void run(const char* name, std::span<const uint8_t> bytes, size_t count)
+{
+    constexpr size_t ITERATIONS = 20;
+
+    uint64_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        StreamType stream(bytes);
+        for (size_t j = 0; j < count; j++)
+            checksum += stream.template read_leb<uint32_t>();
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const double valuesPerSecond = static_cast<double>(count * ITERATIONS) / elapsed.count();
+    std::println("{:<12} {:>8.1f} M values/s (checksum {:x})", name, valuesPerSecond / 1e6, checksum);
+}
+
+int main()
+{
+    constexpr size_t COUNT = 4'000'000;
+
+    // Mostly short immediates like in real code sections, with some large indices and constants
+    std::mt19937 random(0);
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        const uint32_t bits = (random() % 8 == 0) ? 32 : 1 + random() % 14;
+        encode_leb(bytes, static_cast<uint32_t>(random()) >> (32 - bits));
+    }
+
+    run<ByteStream>("byte stream", bytes, COUNT);
+    run<MemoryStream>("memory", bytes, COUNT);
+}
@@ -0,0 +1,186 @@
+#include "Server.h"
+#include "Util/LineReader.h"
+#include "Util/UnixSocket.h"
+#include "VM/Trap.h"
+#include "VM/VM.h"
+#include <cerrno>
+#include <cmath>
+#include <nlohmann/json.hpp>
+#include <unistd.h>
+
+class RequestException
+{
+public:
+    RequestException(std::string_view reason)
+        : m_reason(reason)
+    {
+    }
+
+    std::string reason() const { return m_reason; }
+
+private:
+    std::string m_reason;
+};
+
+static Value parse_argument(const nlohmann::json& json, Type parameterType)
+{
+    const auto& value = json.is_object() ? json.at("value") : json;
+
+    if (json.is_object() && json.contains("type") && json["type"].get<std::string>() != get_type_name(parameterType))
+        throw RequestException(std::format("Expected an argument of type {}", get_type_name(parameterType)));
+
+    if (parameterType != Type::i32 && parameterType != Type::i64 && parameterType != Type::f32 && parameterType != Type::f64)
+        throw RequestException(std::format("Arguments of type {} aren't supported", get_type_name(parameterType)));
+    if (!value.is_string() && !value.is_number())
+        throw RequestException("Arguments have to be numbers or strings");
+
+    // Strings are for values JSON numbers can't hold exactly, like hexadecimal bit patterns, nan and inf. Numbers go
+    // through the same parsing, so they're range checked the same way.
+    return value_from_string(value.is_string() ? value.get<std::string>() : value.dump(), parameterType);
+}
+
+static nlohmann::json result_to_json(const Value& value, Type type)
+{
+    nlohmann::json result;
+    result["type"] = get_type_name(type);
+
+    switch (type)
+    {
+        case Type::i32:
+            result["value"] = static_cast<int32_t>(value.get<uint32_t>());
+            break;
+        case Type::i64:
+            result["value"] = static_cast<int64_t>(value.get<uint64_t>());
+            break;
+        case Type::f32:
+        case Type::f64:
+            // JSON has no nan or inf
+            if (const double number = type == Type::f32 ? value.get<float>() : value.get<double>(); std::isfinite(number))
+                result["value"] = number;
+            else
+                result["value"] = std::format("{}", number);
+            break;
+        default:
+            result["value"] = std::format("{}", value);
+            break;
+    }
+
+    return result;
+}
+
+static void write_all(int fd, std::string_view bytes)
+{
+    while (!bytes.empty())
+    {
+        const ssize_t written = write(fd, bytes.data(), bytes.size());
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        bytes.remove_prefix(written);
+    }
+}
+
+Server::Server(Ref<RealModule> instance)
+    : m_instance(instance)
+    , m_fresh_instances(instance->wasm_file(), 1)
+{
+}
+
+void Server::serve(int input, int output)
+{
+    LineReader reader(input);
+    while (const auto line = reader.read_line())
+    {
+        if (line->empty())
+            continue;
+        write_all(output, handle_request(*line) + '\n');
+    }
+}
+
+void Server::serve_socket(const std::string& path)
+{
+    const int server = listen_on_unix_socket(path);
+
+    while (true)
+    {
+        const int connection = accept_connection(server);
+        serve(connection, connection);
+        close(connection);
+    }
+}
+
+std::string Server::handle_request(std::string_view request)
+{
+    nlohmann::json response;
+
+    try
+    {
+        const auto json = nlohmann::json::parse(request);
+        if (json.contains("id"))
+            response["id"] = json["id"];
+
+        const auto instancePolicy = json.value("instance", std::string("reuse"));
+        if (instancePolicy != "reset" && instancePolicy != "reuse")
+            throw RequestException(std::format("Unknown instance policy: {}", instancePolicy));
+
+        const auto function = json.at("function").get<std::string>();
+        const auto exported = m_instance->try_import(function, WasmFile::ImportType::Function);
+        if (!exported)
+            throw RequestException(std::format("Unknown function: {}", function));
+
+        const auto& type = std::get<Ref<Function>>(*exported)->type();
+
+        const auto arguments = json.value("args", nlohmann::json::array());
+        if (arguments.size() != type.params.size())
+            throw RequestException(std::format("Expected {} arguments", type.params.size()));
+
+        std::vector<Value> args;
+        for (size_t i = 0; i < arguments.size(); i++)
+            args.push_back(parse_argument(arguments[i], type.params[i]));
+
+        std::vector<Value> values;
+        if (instancePolicy == "reset")
+        {
+            // Given back even if the call traps, the pool resets it before handing it out again
+            const auto instance = m_fresh_instances.acquire();
+            try
+            {
+                values = VM::run_function(instance, function, args);
+            }
+            catch (...)
+            {
+                m_fresh_instances.release(instance);
+                throw;
+            }
+            m_fresh_instances.release(instance);
+        }
+        else
+        {
+            values = VM::run_function(m_instance, function, args);
+        }
+
+        auto results = nlohmann::json::array();
+        for (size_t i = 0; i < values.size(); i++)
+            results.push_back(result_to_json(values[i], type.returns[i]));
+        response["results"] = results;
+    }
+    catch (const Trap& trap)
+    {
+        response["error"] = std::format("Trapped ({})", trap.reason());
+    }
+    catch (const RequestException& e)
+    {
+        response["error"] = e.reason();
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        response["error"] = std::format("Invalid request ({})", e.what());
+    }
+    catch (const std::logic_error&)
+    {
+        response["error"] = "Invalid argument";
+    }
+
+    return response.dump();
+}
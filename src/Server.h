@@ -0,0 +1,32 @@
+#pragma once
+
+#include "VM/InstancePool.h"
+#include "VM/Module.h"
+#include <string>
+#include <string_view>
+
+// Long-lived mode that keeps one instance of a module and runs requests against it, so loading, validating and
+// initializing the module is only paid for once. Requests and responses are newline delimited JSON:
+//   {"id": 1, "function": "add", "args": [{"type": "i32", "value": 1}, 2], "instance": "reset"}
+//   {"id": 1, "results": [{"type": "i32", "value": 3}]} or {"id": 1, "error": "..."}
+// Arguments without a type get the type of the parameter. "instance" is "reuse" to run in whatever state the previous
+// requests left behind, which is the default, or "reset" to run in a freshly initialized instance of its own, which
+// leaves the state of the reused instance alone. When requests come from stdin, whatever the guest writes to stdout
+// goes to stderr, so it can't end up between the responses.
+class Server
+{
+public:
+    Server(Ref<RealModule> instance);
+
+    // Answers requests until the input ends
+    void serve(int input, int output);
+    // Connections are served one after the other
+    void serve_socket(const std::string& path);
+
+private:
+    std::string handle_request(std::string_view request);
+
+    Ref<RealModule> m_instance;
+    // Requests are answered one at a time, so a single fresh instance is enough
+    InstancePool m_fresh_instances;
+};
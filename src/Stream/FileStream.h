@@ -28,14 +28,17 @@ public:
         size_t count = fread(buffer, size, 1, m_file);
         if (count == 0)
             throw StreamReadException();
+        m_offset += size;
     }
 
     virtual void move_to(size_t offset) override
     {
         fseek(m_file, offset, SEEK_SET);
+        m_offset = offset;
     }
 
-    virtual size_t offset() const override { return ftell(m_file); }
+    // Tracked here, ftell is a libc call on every eof check
+    virtual size_t offset() const override { return m_offset; }
     virtual size_t size() const override { return m_size; }
 
     // Make noncopyable and nonmovable
@@ -48,4 +51,5 @@ public:
 private:
     FILE* m_file;
     size_t m_size;
+    size_t m_offset { 0 };
 };
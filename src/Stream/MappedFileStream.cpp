@@ -0,0 +1,55 @@
+#include "MappedFileStream.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileMapping::FileMapping(const std::string& filename)
+{
+    m_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+        throw StreamReadException();
+
+    struct stat status;
+    if (fstat(m_fd, &status) < 0 || !S_ISREG(status.st_mode))
+    {
+        close(m_fd);
+        throw StreamReadException();
+    }
+
+    // Mapping zero bytes fails, an empty file is just an empty stream
+    m_size = status.st_size;
+    if (m_size > 0)
+    {
+        m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (m_data == MAP_FAILED)
+        {
+            close(m_fd);
+            throw StreamReadException();
+        }
+
+        // Modules are read front to back once
+        madvise(m_data, m_size, MADV_SEQUENTIAL);
+    }
+}
+
+FileMapping::~FileMapping()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+    close(m_fd);
+}
+
+std::optional<size_t> FileMapping::file_offset(std::span<const uint8_t> bytes) const
+{
+    const auto all = this->bytes();
+    if (bytes.data() < all.data() || bytes.data() + bytes.size() > all.data() + all.size())
+        return {};
+    return bytes.data() - all.data();
+}
+
+MappedFileStream::MappedFileStream(const std::string& filename)
+    : m_mapping(MakeRef<FileMapping>(filename))
+{
+    set_buffer(m_mapping->bytes());
+}
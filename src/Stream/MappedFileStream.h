@@ -0,0 +1,52 @@
+#pragma once
+
+#include "MemoryStream.h"
+#include <optional>
+#include <string>
+
+// Read-only mapping of a whole file. Shared, so whatever still points into the bytes after loading can keep it alive.
+class FileMapping
+{
+public:
+    FileMapping(const std::string& filename);
+    ~FileMapping();
+
+    std::span<const uint8_t> bytes() const { return std::span(static_cast<const uint8_t*>(m_data), m_size); }
+
+    // Stays open, so pages of the file can be mapped somewhere else too
+    int fd() const { return m_fd; }
+
+    // Where the given bytes start in the file, if they are part of this mapping
+    std::optional<size_t> file_offset(std::span<const uint8_t> bytes) const;
+
+    // Make noncopyable and nonmovable
+    FileMapping(const FileMapping& other) = delete;
+    FileMapping& operator=(const FileMapping& other) = delete;
+
+    FileMapping(FileMapping&& other) = delete;
+    FileMapping& operator=(FileMapping&& other) = delete;
+
+private:
+    int m_fd { -1 };
+    void* m_data { nullptr };
+    size_t m_size { 0 };
+};
+
+// Maps the whole file into memory, so parsing reads the bytes in place instead of going through stdio
+class MappedFileStream final : public MemoryStream
+{
+public:
+    MappedFileStream(const std::string& filename);
+
+    virtual Ref<FileMapping> mapping() const override { return m_mapping; }
+
+    // Make noncopyable and nonmovable
+    MappedFileStream(const MappedFileStream& other) = delete;
+    MappedFileStream& operator=(const MappedFileStream& other) = delete;
+
+    MappedFileStream(MappedFileStream&& other) = delete;
+    MappedFileStream& operator=(MappedFileStream&& other) = delete;
+
+private:
+    Ref<FileMapping> m_mapping;
+};
@@ -6,33 +6,36 @@
 class MemoryStream : public Stream
 {
 public:
-    MemoryStream(char* base, size_t size)
-        : m_begin(base)
-        , m_end(m_begin + size)
-        , m_current(m_begin)
+    MemoryStream(const char* base, size_t size)
+        : MemoryStream(std::span(reinterpret_cast<const uint8_t*>(base), size))
     {
     }
 
+    MemoryStream(std::span<const uint8_t> bytes)
+    {
+        set_buffer(bytes);
+    }
+
     virtual void read(void* buffer, size_t size) override
     {
         if (offset() + size > this->size())
             throw StreamReadException();
-        memcpy(buffer, m_current, size);
-        m_current += size;
+        if (size == 0)
+            return;
+        memcpy(buffer, m_buffer_current, size);
+        m_buffer_current += size;
     }
 
     virtual void move_to(size_t offset) override
     {
         if (offset > size())
             throw StreamReadException();
-        m_current = m_begin + offset;
+        m_buffer_current = m_buffer_begin + offset;
     }
 
-    virtual size_t offset() const override { return m_current - m_begin; }
-    virtual size_t size() const override { return m_end - m_begin; }
+    virtual size_t offset() const override { return m_buffer_current - m_buffer_begin; }
+    virtual size_t size() const override { return m_buffer_end - m_buffer_begin; }
 
-private:
-    char* m_begin;
-    char* m_end;
-    char* m_current;
+protected:
+    MemoryStream() = default;
 };
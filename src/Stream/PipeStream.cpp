@@ -0,0 +1,123 @@
+#include "PipeStream.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <unistd.h>
+
+PipeStream::PipeStream(const std::string& filename)
+{
+    if (filename == "-")
+    {
+        m_fd = STDIN_FILENO;
+        return;
+    }
+
+    m_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+        throw StreamReadException();
+    m_owns_fd = true;
+}
+
+PipeStream::~PipeStream()
+{
+    if (m_owns_fd)
+        close(m_fd);
+}
+
+void PipeStream::read(void* buffer, size_t size)
+{
+    auto* destination = static_cast<uint8_t*>(buffer);
+
+    while (size > 0)
+    {
+        if (m_offset == buffered_end())
+        {
+            // Large reads like whole sections go straight into the destination instead of through the chunk
+            if (size >= CHUNK_SIZE)
+            {
+                const size_t count = read_some(destination, size);
+                if (count == 0)
+                {
+                    m_reached_end = true;
+                    throw StreamReadException();
+                }
+
+                destination += count;
+                size -= count;
+                m_offset += count;
+                m_chunk_offset = m_offset;
+                m_chunk.clear();
+                continue;
+            }
+
+            if (!read_chunk())
+                throw StreamReadException();
+        }
+
+        const size_t count = std::min(size, buffered_end() - m_offset);
+        memcpy(destination, m_chunk.data() + (m_offset - m_chunk_offset), count);
+        destination += count;
+        size -= count;
+        m_offset += count;
+    }
+}
+
+void PipeStream::move_to(size_t offset)
+{
+    if (offset < m_chunk_offset)
+        throw StreamReadException();
+
+    while (offset > buffered_end())
+    {
+        m_offset = buffered_end();
+        if (!read_chunk())
+            throw StreamReadException();
+    }
+
+    m_offset = offset;
+}
+
+size_t PipeStream::size() const
+{
+    if (!m_reached_end)
+        return std::numeric_limits<size_t>::max();
+    return buffered_end();
+}
+
+bool PipeStream::is_at_end() const
+{
+    if (m_offset < buffered_end())
+        return false;
+    return !read_chunk();
+}
+
+bool PipeStream::read_chunk() const
+{
+    if (m_reached_end)
+        return false;
+
+    m_chunk_offset = buffered_end();
+    m_chunk.resize(CHUNK_SIZE);
+
+    const size_t count = read_some(m_chunk.data(), m_chunk.size());
+    m_chunk.resize(count);
+
+    if (count == 0)
+        m_reached_end = true;
+
+    return count > 0;
+}
+
+size_t PipeStream::read_some(void* buffer, size_t size) const
+{
+    while (true)
+    {
+        const ssize_t count = ::read(m_fd, buffer, size);
+        if (count >= 0)
+            return count;
+        if (errno != EINTR)
+            throw StreamReadException();
+    }
+}
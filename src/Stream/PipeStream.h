@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Stream.h"
+#include <string>
+#include <vector>
+
+// Reads from a file descriptor that can neither seek nor report its size, like stdin or a pipe. Bytes are
+// buffered one chunk at a time, so moving backwards only works within the chunk that is currently buffered.
+class PipeStream final : public Stream
+{
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    // "-" reads from stdin
+    PipeStream(const std::string& filename);
+    ~PipeStream();
+
+    virtual void read(void* buffer, size_t size) override;
+    virtual void move_to(size_t offset) override;
+
+    virtual size_t offset() const override { return m_offset; }
+    // Only known once the writer has closed its end
+    virtual size_t size() const override;
+
+    // Make noncopyable and nonmovable
+    PipeStream(const PipeStream& other) = delete;
+    PipeStream& operator=(const PipeStream& other) = delete;
+
+    PipeStream(PipeStream&& other) = delete;
+    PipeStream& operator=(PipeStream&& other) = delete;
+
+protected:
+    virtual bool is_at_end() const override;
+
+private:
+    size_t buffered_end() const { return m_chunk_offset + m_chunk.size(); }
+    // Replaces the buffered chunk with the next one, returns false once the writer has closed its end
+    bool read_chunk() const;
+    size_t read_some(void* buffer, size_t size) const;
+
+    int m_fd { -1 };
+    bool m_owns_fd { false };
+
+    // Filled lazily, even checking for the end has to block until more bytes arrive
+    mutable std::vector<uint8_t> m_chunk;
+    mutable size_t m_chunk_offset { 0 };
+    mutable bool m_reached_end { false };
+
+    size_t m_offset { 0 };
+};
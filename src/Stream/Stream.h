@@ -1,12 +1,16 @@
 #pragma once
 
 #include "Util/Util.h"
+#include <bit>
 #include <concepts>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <span>
 #include <string>
 #include <vector>
 
+class FileMapping;
 class Stream;
 
 template <typename T>
@@ -32,6 +36,9 @@ public:
     virtual size_t offset() const = 0;
     virtual size_t size() const = 0;
 
+    // Set for streams over a mapped file, bytes read in place can be kept around as long as the mapping is
+    virtual Ref<FileMapping> mapping() const { return nullptr; }
+
     void skip(int64_t bytes)
     {
         move_to(offset() + bytes);
@@ -39,34 +46,68 @@ public:
 
     bool eof() const
     {
-        return offset() == size();
+        if (m_buffer_begin)
+            return m_buffer_current == m_buffer_end;
+        return is_at_end();
+    }
+
+    bool is_contiguous() const { return m_buffer_begin != nullptr; }
+    // Every byte of a contiguous stream, no matter how much of it was read already
+    std::span<const uint8_t> buffer() const { return std::span(m_buffer_begin, m_buffer_end); }
+
+    // Hands out the next bytes without copying them, only valid for contiguous streams
+    std::span<const uint8_t> read_span(size_t size)
+    {
+        if (static_cast<size_t>(m_buffer_end - m_buffer_current) < size)
+            throw StreamReadException();
+        std::span<const uint8_t> bytes(m_buffer_current, size);
+        m_buffer_current += size;
+        return bytes;
     }
 
     template <typename T>
     T read_little_endian()
     {
         T value;
+        if (m_buffer_begin) [[likely]]
+        {
+            if (static_cast<size_t>(m_buffer_end - m_buffer_current) < sizeof(T))
+                throw StreamReadException();
+            memcpy(&value, m_buffer_current, sizeof(T));
+            m_buffer_current += sizeof(T);
+            return value;
+        }
+
         read((void*)&value, sizeof(T));
         // return HostToLittleEndian(value);
         return value;
     }
 
-    std::vector<uint8_t> read_leb_as_bytes()
-    {
-        std::vector<uint8_t> bytes;
-        uint8_t byte;
-        do
-        {
-            byte = read_little_endian<uint8_t>();
-            bytes.push_back(byte);
-        } while (byte & 0x80);
-
-        return bytes;
-    }
-
     template <std::unsigned_integral T>
     T read_leb()
     {
+        if constexpr (sizeof(T) >= sizeof(uint32_t))
+        {
+            if (const auto [value, length] = peek_leb_fast(); length != 0) [[likely]]
+            {
+                // Longer values can still be valid, but only the byte by byte path below decides that
+                constexpr uint32_t BITS = sizeof(T) * 8;
+                if constexpr (BITS < 64)
+                {
+                    if ((length - 1) * 7 <= BITS && (value >> BITS) == 0)
+                    {
+                        m_buffer_current += length;
+                        return static_cast<T>(value);
+                    }
+                }
+                else
+                {
+                    m_buffer_current += length;
+                    return static_cast<T>(value);
+                }
+            }
+        }
+
         T result {};
         size_t num_bytes = 0;
 
@@ -100,6 +141,17 @@ public:
     {
         constexpr auto BITS = sizeof(T) * 8;
 
+        if constexpr (sizeof(T) >= sizeof(int32_t))
+        {
+            // Values that reach the last byte of T need the checks of the slow path
+            if (const auto [value, length] = peek_leb_fast(); length != 0 && length * 7 < BITS) [[likely]]
+            {
+                const uint32_t shift = length * 7;
+                m_buffer_current += length;
+                return static_cast<T>(static_cast<int64_t>(value << (64 - shift)) >> (64 - shift));
+            }
+        }
+
         T result = 0;
         uint32_t shift = 0;
         uint8_t byte = 0;
@@ -192,4 +244,54 @@ public:
         }
         return vec;
     }
+
+private:
+    struct FastLeb
+    {
+        uint64_t value;
+        // Zero if the fast path doesn't apply
+        uint32_t length;
+    };
+
+    // Decodes a LEB128 value of at most 8 bytes from a single load, without consuming it
+    FastLeb peek_leb_fast() const
+    {
+        if (static_cast<size_t>(m_buffer_end - m_buffer_current) < sizeof(uint64_t))
+            return {};
+
+        uint64_t word;
+        memcpy(&word, m_buffer_current, sizeof(word));
+
+        const uint64_t terminators = ~word & 0x8080808080808080ull;
+        if (terminators == 0)
+            return {};
+
+        const uint32_t length = std::countr_zero(terminators) / 8 + 1;
+        if (length < sizeof(uint64_t))
+            word &= (1ull << (length * 8)) - 1;
+
+        // Squeeze out the continuation bits, pairs of bytes first, then pairs of those
+        uint64_t value = word & 0x7f7f7f7f7f7f7f7full;
+        value = ((value & 0x7f007f007f007f00ull) >> 1) | (value & 0x007f007f007f007full);
+        value = ((value & 0x3fff00003fff0000ull) >> 2) | (value & 0x00003fff00003fffull);
+        value = ((value & 0x0fffffff00000000ull) >> 4) | (value & 0x000000000fffffffull);
+
+        return FastLeb { .value = value, .length = length };
+    }
+
+protected:
+    // Streams that don't know their size up front have to look ahead instead
+    virtual bool is_at_end() const { return offset() == size(); }
+
+    // Streams backed by memory set this, so the hot read paths work on the bytes directly instead of going through the virtual calls
+    void set_buffer(std::span<const uint8_t> bytes)
+    {
+        m_buffer_begin = bytes.data();
+        m_buffer_current = bytes.data();
+        m_buffer_end = bytes.data() + bytes.size();
+    }
+
+    const uint8_t* m_buffer_begin { nullptr };
+    const uint8_t* m_buffer_current { nullptr };
+    const uint8_t* m_buffer_end { nullptr };
 };
@@ -1,6 +1,6 @@
 #include "TestRunner.h"
 #include "SpecTestModule.h"
-#include "Stream/FileStream.h"
+#include "Stream/MappedFileStream.h"
 #include "VM/Module.h"
 #include "VM/VM.h"
 #include "VM/Value.h"
@@ -412,7 +412,7 @@ TestStats run_tests(std::string_view path)
             stats.total++;
 
             std::string binary_module_path = command.contains("binary_filename") ? command["binary_filename"] : command["filename"];
-            FileStream fileStream(binary_module_path);
+            MappedFileStream fileStream(binary_module_path);
 
             try
             {
@@ -442,7 +442,7 @@ TestStats run_tests(std::string_view path)
             stats.total++;
 
             std::string binary_module_path = command.contains("binary_filename") ? command["binary_filename"] : command["filename"];
-            FileStream fileStream(binary_module_path);
+            MappedFileStream fileStream(binary_module_path);
 
             try
             {
@@ -624,7 +624,7 @@ TestStats run_tests(std::string_view path)
 
             stats.total++;
 
-            FileStream fileStream(command["filename"].get<std::string>());
+            MappedFileStream fileStream(command["filename"].get<std::string>());
             try
             {
                 auto file = WasmFile::WasmFile::read_from_stream(fileStream);
@@ -648,7 +648,7 @@ TestStats run_tests(std::string_view path)
 
             stats.total++;
 
-            FileStream fileStream(command["filename"].get<std::string>());
+            MappedFileStream fileStream(command["filename"].get<std::string>());
             try
             {
                 auto file = WasmFile::WasmFile::read_from_stream(fileStream);
@@ -0,0 +1,34 @@
+#include "Arena.h"
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+    std::lock_guard lock(m_mutex);
+
+    m_allocated_bytes += size;
+
+    const auto aligned = [&]() {
+        return reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(m_current) + alignment - 1) & ~(alignment - 1));
+    };
+
+    if (m_current && aligned() + size <= m_end)
+    {
+        auto* allocation = aligned();
+        m_current = allocation + size;
+        return allocation;
+    }
+
+    // Large allocations get a chunk of their own, so the rest of the current chunk isn't wasted
+    if (size + alignment > CHUNK_SIZE / 4)
+    {
+        auto& chunk = m_chunks.emplace_back(std::make_unique_for_overwrite<uint8_t[]>(size + alignment));
+        return reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(chunk.get()) + alignment - 1) & ~(alignment - 1));
+    }
+
+    auto& chunk = m_chunks.emplace_back(std::make_unique_for_overwrite<uint8_t[]>(CHUNK_SIZE));
+    m_current = chunk.get();
+    m_end = chunk.get() + CHUNK_SIZE;
+
+    auto* allocation = aligned();
+    m_current = allocation + size;
+    return allocation;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for data that lives exactly as long as its owner. Nothing is freed on its own, all chunks
+// go away together with the arena. Allocations are locked, since lazily decoded code allocates at runtime.
+class Arena
+{
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    Arena() = default;
+
+    void* allocate(size_t size, size_t alignment);
+
+    // Only for types that don't need destructors, those would never run
+    template <typename T>
+        requires std::is_trivially_copyable_v<T>
+    std::span<T> allocate_array(size_t count)
+    {
+        if (count == 0)
+            return {};
+        return std::span(static_cast<T*>(allocate(count * sizeof(T), alignof(T))), count);
+    }
+
+    template <typename T>
+        requires std::is_trivially_copyable_v<T>
+    std::span<const T> copy(std::span<const T> values)
+    {
+        const auto copied = allocate_array<T>(values.size());
+        if (!values.empty())
+            memcpy(copied.data(), values.data(), values.size_bytes());
+        return copied;
+    }
+
+    std::string_view copy(std::string_view string)
+    {
+        const auto copied = copy(std::span<const char>(string));
+        return std::string_view(copied.data(), copied.size());
+    }
+
+    size_t allocated_bytes() const { return m_allocated_bytes; }
+
+    // Make noncopyable and nonmovable
+    Arena(const Arena& other) = delete;
+    Arena& operator=(const Arena& other) = delete;
+
+    Arena(Arena&& other) = delete;
+    Arena& operator=(Arena&& other) = delete;
+
+private:
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<uint8_t[]>> m_chunks;
+    uint8_t* m_current { nullptr };
+    uint8_t* m_end { nullptr };
+    size_t m_allocated_bytes { 0 };
+};
@@ -0,0 +1,43 @@
+#include "LineReader.h"
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+
+std::optional<std::string> LineReader::read_line()
+{
+    while (true)
+    {
+        const size_t newline = m_buffer.find('\n', m_offset);
+        if (newline != std::string::npos)
+        {
+            std::string line = m_buffer.substr(m_offset, newline - m_offset);
+            m_offset = newline + 1;
+            return line;
+        }
+
+        if (m_reached_end)
+        {
+            if (m_offset == m_buffer.size())
+                return {};
+
+            std::string line = m_buffer.substr(m_offset);
+            m_offset = m_buffer.size();
+            return line;
+        }
+
+        m_buffer.erase(0, m_offset);
+        m_offset = 0;
+
+        const size_t size = m_buffer.size();
+        m_buffer.resize(size + CHUNK_SIZE);
+
+        ssize_t result;
+        do
+            result = read(m_fd, m_buffer.data() + size, CHUNK_SIZE);
+        while (result < 0 && errno == EINTR);
+
+        m_buffer.resize(size + std::max<ssize_t>(result, 0));
+        if (result <= 0)
+            m_reached_end = true;
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+
+// Reads lines from a file descriptor through a buffer of its own. The descriptor isn't owned.
+class LineReader
+{
+public:
+    static constexpr size_t CHUNK_SIZE = 4096;
+
+    LineReader(int fd)
+        : m_fd(fd)
+    {
+    }
+
+    // Without the newline, a last line without one is returned too
+    std::optional<std::string> read_line();
+
+private:
+    int m_fd;
+    std::string m_buffer;
+    size_t m_offset { 0 };
+    bool m_reached_end { false };
+};
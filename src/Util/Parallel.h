@@ -0,0 +1,27 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Calls function(i) for every i below count, spread over all cores with the calling thread helping out.
+// Exceptions must not escape function, there is no thread to report them to.
+template <typename Function>
+void parallel_for(size_t count, Function function)
+{
+    const size_t threadCount = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+
+    std::atomic<size_t> next = 0;
+    const auto worker = [&]() {
+        for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed))
+            function(i);
+    };
+
+    std::vector<std::jthread> threads;
+    for (size_t i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+
+    worker();
+}
@@ -0,0 +1,68 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threadCount)
+{
+    threadCount = std::max<size_t>(threadCount, 1);
+    for (size_t i = 0; i < threadCount; i++)
+        m_threads.emplace_back([this]() { run_worker(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+        m_tasks.clear();
+    }
+
+    m_task_available.notify_all();
+
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+
+    m_task_available.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock lock(m_mutex);
+    m_idle.wait(lock, [this]() { return m_tasks.empty() && m_running_tasks == 0; });
+}
+
+void ThreadPool::run_worker()
+{
+    while (true)
+    {
+        std::function<void()> task;
+
+        {
+            std::unique_lock lock(m_mutex);
+            m_task_available.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+
+            if (m_stopping)
+                return;
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            m_running_tasks++;
+        }
+
+        task();
+
+        {
+            std::lock_guard lock(m_mutex);
+            m_running_tasks--;
+            if (m_tasks.empty() && m_running_tasks == 0)
+                m_idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers running submitted tasks in order of submission. Exceptions must not escape a task.
+// Destroying the pool drops tasks that haven't started yet and waits for the running ones.
+class ThreadPool
+{
+public:
+    ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    // Blocks until every submitted task has finished
+    void wait();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+private:
+    void run_worker();
+
+    std::mutex m_mutex;
+    std::condition_variable m_task_available;
+    std::condition_variable m_idle;
+
+    std::deque<std::function<void()>> m_tasks;
+    size_t m_running_tasks { 0 };
+    bool m_stopping { false };
+
+    std::vector<std::thread> m_threads;
+};
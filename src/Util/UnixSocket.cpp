@@ -0,0 +1,41 @@
+#include "UnixSocket.h"
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+
+int listen_on_unix_socket(const std::string& path)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw std::system_error(ENAMETOOLONG, std::generic_category(), path);
+    path.copy(address.sun_path, path.size());
+
+    const int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0)
+        throw std::system_error(errno, std::generic_category(), "socket");
+
+    unlink(path.c_str());
+    if (bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(server, SOMAXCONN) < 0)
+    {
+        const int error = errno;
+        close(server);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    return server;
+}
+
+int accept_connection(int server)
+{
+    while (true)
+    {
+        const int connection = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection >= 0)
+            return connection;
+        if (errno != EINTR && errno != ECONNABORTED)
+            throw std::system_error(errno, std::generic_category(), "accept");
+    }
+}
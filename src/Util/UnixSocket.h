@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+
+// Listening socket at the given path, whatever was there before is replaced. Throws std::system_error.
+int listen_on_unix_socket(const std::string& path);
+
+// Waits for the next connection, retrying on interruptions and connections that were aborted before they were accepted
+int accept_connection(int server);
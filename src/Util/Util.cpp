@@ -18,7 +18,21 @@ void fill_buffer_with_random_data(uint8_t* data, size_t size)
 #endif
 }
 
-bool is_valid_utf8(const std::string& string)
+bool is_valid_utf8(std::string_view string)
 {
-    return simdutf::validate_utf8_with_errors(string.c_str(), string.size()).error == simdutf::SUCCESS;
+    return simdutf::validate_utf8_with_errors(string.data(), string.size()).error == simdutf::SUCCESS;
+}
+
+uint64_t fnv1a_hash(const void* data, size_t size, uint64_t hash)
+{
+    constexpr uint64_t FNV1A_PRIME = 0x100000001b3;
+
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV1A_PRIME;
+    }
+
+    return hash;
 }
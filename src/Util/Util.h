@@ -96,7 +96,10 @@ bool vector_contains(const std::vector<T>& v, T x)
     return std::find(v.begin(), v.end(), x) != v.end();
 }
 
-bool is_valid_utf8(const std::string& string);
+bool is_valid_utf8(std::string_view string);
+
+constexpr uint64_t FNV1A_OFFSET_BASIS = 0xcbf29ce484222325;
+uint64_t fnv1a_hash(const void* data, size_t size, uint64_t hash = FNV1A_OFFSET_BASIS);
 
 template <typename T, typename U>
     requires std::is_arithmetic_v<T> && std::is_arithmetic_v<U>
@@ -0,0 +1,71 @@
+#include "AsyncFunction.h"
+#include "Scheduler.h"
+#include "Trap.h"
+#include <utility>
+
+void PendingCall::complete(std::vector<Value> values)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_values = std::move(values);
+    }
+
+    finish();
+}
+
+void PendingCall::fail(std::string_view reason)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_trap = std::string(reason);
+    }
+
+    finish();
+}
+
+void PendingCall::finish()
+{
+    std::function<void()> resume;
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_done = true;
+        resume = std::exchange(m_resume, nullptr);
+    }
+
+    m_completed.notify_all();
+
+    if (resume)
+        resume();
+}
+
+std::vector<Value> PendingCall::wait()
+{
+    if (Scheduler::can_suspend())
+        Scheduler::suspend(*this);
+
+    std::unique_lock lock(m_mutex);
+    m_completed.wait(lock, [this]() { return m_done; });
+
+    if (m_trap)
+        throw Trap(*m_trap);
+
+    return std::move(m_values);
+}
+
+AsyncFunction::AsyncFunction(Implementation implementation, const std::vector<Type>& params, std::optional<Type> returnType)
+    : m_implementation(std::move(implementation))
+    , m_type(WasmFile::FunctionType {
+          .params = params,
+          .returns = returnType ? std::vector<Type> { returnType.value() } : std::vector<Type> {} })
+{
+}
+
+std::vector<Value> AsyncFunction::run(std::span<const Value> args) const
+{
+    auto result = m_implementation(args);
+    if (auto* values = std::get_if<std::vector<Value>>(&result))
+        return std::move(*values);
+
+    return std::get<Ref<PendingCall>>(result)->wait();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Module.h"
+#include "Util/Util.h"
+#include "Value.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// The result of a host call that finishes later. Whoever does the work completes it, from any thread.
+class PendingCall
+{
+public:
+    PendingCall() = default;
+
+    void complete(std::vector<Value> values);
+    // The guest traps with the reason once it resumes
+    void fail(std::string_view reason);
+
+    // On a scheduler worker the call is suspended and the thread runs other calls meanwhile, anywhere else it blocks
+    std::vector<Value> wait();
+
+    // Make noncopyable and nonmovable
+    PendingCall(const PendingCall& other) = delete;
+    PendingCall& operator=(const PendingCall& other) = delete;
+
+    PendingCall(PendingCall&& other) = delete;
+    PendingCall& operator=(PendingCall&& other) = delete;
+
+private:
+    friend class Scheduler;
+
+    void finish();
+
+    std::mutex m_mutex;
+    std::condition_variable m_completed;
+    bool m_done { false };
+    std::vector<Value> m_values;
+    std::optional<std::string> m_trap;
+    // Set by the scheduler while a suspended call waits for this
+    std::function<void()> m_resume;
+};
+
+// Host function that either returns its values right away or a PendingCall the calling wasm code waits for
+class AsyncFunction : public Function
+{
+public:
+    using Result = std::variant<std::vector<Value>, Ref<PendingCall>>;
+    using Implementation = std::function<Result(std::span<const Value>)>;
+
+    AsyncFunction(Implementation implementation, const std::vector<Type>& params, std::optional<Type> returnType);
+
+    virtual const WasmFile::FunctionType& type() const override { return m_type; }
+    [[nodiscard]] virtual std::vector<Value> run(std::span<const Value> args) const override;
+
+private:
+    Implementation m_implementation;
+    WasmFile::FunctionType m_type;
+};
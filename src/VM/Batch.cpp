@@ -0,0 +1,74 @@
+#include "Batch.h"
+#include "Trap.h"
+#include "VM.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+
+std::vector<BatchResult> run_batch(Ref<WasmFile::WasmFile> file, const std::string& function, std::span<const std::vector<Value>> arguments, size_t threadCount)
+{
+    std::vector<BatchResult> results(arguments.size());
+    if (arguments.empty())
+        return results;
+
+    threadCount = std::clamp<size_t>(threadCount, 1, arguments.size());
+
+    auto& callerContext = VM::context();
+
+    // Calls take very different amounts of time, so threads take the next tuple whenever they're done instead of a fixed share
+    std::atomic<size_t> nextTuple { 0 };
+
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    const auto run_worker = [&]() {
+        VM::Context context;
+        context.share_registered_modules(callerContext);
+        VM::set_context(&context);
+
+        try
+        {
+            const auto instance = VM::load_module(file, true);
+
+            for (size_t tuple = nextTuple++; tuple < arguments.size(); tuple = nextTuple++)
+            {
+                try
+                {
+                    results[tuple].values = VM::run_function(instance, function, arguments[tuple]);
+                }
+                catch (const Trap& trap)
+                {
+                    results[tuple].trap = std::string(trap.reason());
+                }
+            }
+        }
+        catch (...)
+        {
+            // No other thread gets to run the rest of the batch either
+            nextTuple = arguments.size();
+
+            std::lock_guard lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+        }
+
+        VM::set_context(nullptr);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++)
+        threads.emplace_back(run_worker);
+
+    // The calling thread works on the batch too, in a context of its own
+    run_worker();
+    VM::set_context(&callerContext);
+
+    for (auto& thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    return results;
+}
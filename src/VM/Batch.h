@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Util/Util.h"
+#include "Value.h"
+#include "WasmFile/WasmFile.h"
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BatchResult
+{
+    std::vector<Value> values;
+    // Set if this call trapped, the other calls of the batch still run
+    std::optional<std::string> trap;
+};
+
+// Calls one export once per argument tuple, spread over several threads. Every thread runs in a context of its own
+// with its own instance of the module, so calls on the same thread see the state earlier ones left behind and the
+// export should only depend on its arguments. Modules registered in the calling context can be imported. Results are
+// in the order of the tuples. Failing to instantiate the module throws. Can't be called from a running function.
+std::vector<BatchResult> run_batch(Ref<WasmFile::WasmFile> file, const std::string& function, std::span<const std::vector<Value>> arguments, size_t threadCount = std::thread::hardware_concurrency());
@@ -0,0 +1,56 @@
+#include "InstancePool.h"
+#include "Trap.h"
+#include "VM.h"
+
+InstancePool::InstancePool(Ref<WasmFile::WasmFile> wasmFile, size_t capacity)
+    : m_wasm_file(wasmFile)
+    , m_capacity(capacity)
+{
+    m_instances.reserve(capacity);
+    for (size_t i = 0; i < capacity; i++)
+        m_instances.push_back(VM::load_module(m_wasm_file, true));
+}
+
+Ref<RealModule> InstancePool::acquire()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        if (!m_instances.empty())
+        {
+            auto instance = std::move(m_instances.back());
+            m_instances.pop_back();
+            return instance;
+        }
+    }
+
+    return VM::load_module(m_wasm_file, true);
+}
+
+void InstancePool::release(Ref<RealModule> instance)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_instances.size() >= m_capacity)
+            return;
+    }
+
+    // Resetting runs the start function again, which can trap
+    try
+    {
+        VM::reset_module(instance);
+    }
+    catch (const Trap&)
+    {
+        return;
+    }
+
+    std::lock_guard lock(m_mutex);
+    if (m_instances.size() < m_capacity)
+        m_instances.push_back(std::move(instance));
+}
+
+size_t InstancePool::available() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_instances.size();
+}
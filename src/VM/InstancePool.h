@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Module.h"
+#include "Util/Util.h"
+#include "WasmFile/WasmFile.h"
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Hands out fresh instances of one module, for running every request in an instance of its own. Instances that are
+// given back are reset with VM::reset_module and handed out again, so their memories, tables and globals are only
+// allocated once. Instances are loaded in the context of the thread that needs them. Resets reapply the data segments,
+// so a module that is read from a file that may change should be loaded with LoadOptions::mapData turned off.
+class InstancePool
+{
+public:
+    // Loads the given number of instances up front
+    InstancePool(Ref<WasmFile::WasmFile> wasmFile, size_t capacity);
+
+    // A new instance is loaded if every pooled one is in use
+    Ref<RealModule> acquire();
+    // The instance mustn't be used by the caller anymore. It's dropped if it can't be reset or the pool is full.
+    void release(Ref<RealModule> instance);
+
+    size_t available() const;
+
+    // Make noncopyable and nonmovable
+    InstancePool(const InstancePool& other) = delete;
+    InstancePool& operator=(const InstancePool& other) = delete;
+
+    InstancePool(InstancePool&& other) = delete;
+    InstancePool& operator=(InstancePool&& other) = delete;
+
+private:
+    Ref<WasmFile::WasmFile> m_wasm_file;
+    size_t m_capacity;
+
+    mutable std::mutex m_mutex;
+    std::vector<Ref<RealModule>> m_instances;
+};
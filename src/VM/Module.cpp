@@ -1,9 +1,16 @@
 #include "Module.h"
+#include "Stream/MappedFileStream.h"
 #include "Trap.h"
 #include "Util/Util.h"
 #include "VM.h"
+#include "WasmFile/Opcode.h"
+#include "WasmFile/Parser.h"
 #include "WasmFile/WasmFile.h"
 #include <cstring>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
 
 const WasmFile::FunctionType& RealFunction::type() const
 {
@@ -15,18 +22,43 @@ std::vector<Value> RealFunction::run(std::span<const Value> args) const
     return VM::run_function(m_parent.lock(), this, args);
 }
 
+void RealFunction::decode() const
+{
+    const auto wasmFile = parent()->wasm_file();
+
+    std::lock_guard lock(wasmFile->lazyCodeMutex);
+    if (m_code->lazyBody)
+        wasmFile->decode_lazy_code(*m_type, *m_code);
+
+    m_needs_decode = false;
+}
+
 Memory::Memory(const WasmFile::Memory& memory)
     : m_size(memory.limits.min)
+    , m_initial_size(memory.limits.min)
     , m_max(memory.limits.max)
     , m_address_type(memory.limits.address_type)
 {
-    m_data = new uint8_t[m_size * WASM_PAGE_SIZE];
-    memset(m_data, 0, m_size * WASM_PAGE_SIZE);
+    m_reserved = m_size * WASM_PAGE_SIZE;
+    m_data = allocate_pages(m_reserved);
 }
 
 Memory::~Memory()
 {
-    delete[] m_data;
+    if (m_data)
+        munmap(m_data, m_reserved);
+}
+
+// Anonymous mappings start out zeroed and only take up memory once they are touched
+uint8_t* Memory::allocate_pages(uint64_t size)
+{
+    if (size == 0)
+        return nullptr;
+
+    void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pages == MAP_FAILED)
+        throw std::bad_alloc();
+    return static_cast<uint8_t*>(pages);
 }
 
 WasmFile::Limits Memory::limits() const
@@ -36,18 +68,94 @@ WasmFile::Limits Memory::limits() const
 
 void Memory::grow(uint64_t pages)
 {
-    uint64_t newSize = (m_size + pages) * WASM_PAGE_SIZE;
+    const uint64_t oldSize = m_size * WASM_PAGE_SIZE;
+    const uint64_t newSize = (m_size + pages) * WASM_PAGE_SIZE;
+    if (newSize == oldSize)
+        return;
 
-    uint8_t* newMemory = new uint8_t[newSize];
-    memset(newMemory, 0, newSize);
+    // Pages left over from before a reset are already zeroed
+    if (newSize <= m_reserved)
+    {
+        m_size += pages;
+        return;
+    }
+
+    if (!m_data)
+    {
+        m_data = allocate_pages(newSize);
+        m_reserved = newSize;
+        m_size += pages;
+        return;
+    }
 
-    memcpy(newMemory, m_data, m_size * WASM_PAGE_SIZE);
+    void* moved = mremap(m_data, m_reserved, newSize, MREMAP_MAYMOVE);
 
-    delete[] m_data;
-    m_data = newMemory;
+    // Pages mapped from a file split the memory into several mappings, which can't be remapped in one go
+    if (moved == MAP_FAILED)
+    {
+        uint8_t* newMemory = allocate_pages(newSize);
+        memcpy(newMemory, m_data, oldSize);
+        munmap(m_data, m_reserved);
+        moved = newMemory;
+        m_has_file_pages = false;
+    }
+
+    m_data = static_cast<uint8_t*>(moved);
+    m_reserved = newSize;
     m_size += pages;
 }
 
+void Memory::reset()
+{
+    const uint64_t size = m_size * WASM_PAGE_SIZE;
+
+    // Dropping private copies of pages mapped from a file would bring back the file contents instead of zeroes
+    if (m_has_file_pages)
+    {
+        if (mmap(m_data, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+            throw std::bad_alloc();
+        m_has_file_pages = false;
+    }
+    else if (size > 0)
+    {
+        madvise(m_data, size, MADV_DONTNEED);
+    }
+
+    m_size = m_initial_size;
+}
+
+void Memory::initialize(uint64_t offset, std::span<const uint8_t> bytes, const FileMapping* mapping)
+{
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+    uint64_t mappedBegin = 0;
+    uint64_t mappedEnd = 0;
+
+    if (const auto fileOffset = mapping ? mapping->file_offset(bytes) : std::nullopt; fileOffset && bytes.size() >= pageSize)
+    {
+        // Memory starts on a page boundary, so file and memory pages line up when the offsets do
+        if ((offset - *fileOffset) % pageSize == 0)
+        {
+            mappedBegin = (offset + pageSize - 1) / pageSize * pageSize;
+            mappedEnd = (offset + bytes.size()) / pageSize * pageSize;
+        }
+    }
+
+    if (mappedBegin < mappedEnd)
+    {
+        const uint64_t fileBegin = *mapping->file_offset(bytes) + (mappedBegin - offset);
+        if (mmap(m_data + mappedBegin, mappedEnd - mappedBegin, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, mapping->fd(), fileBegin) != MAP_FAILED)
+        {
+            m_has_file_pages = true;
+            memcpy(m_data + offset, bytes.data(), mappedBegin - offset);
+            memcpy(m_data + mappedEnd, bytes.data() + (mappedEnd - offset), offset + bytes.size() - mappedEnd);
+            return;
+        }
+    }
+
+    memcpy(m_data + offset, bytes.data(), bytes.size());
+}
+
 bool Memory::check_outside_bounds(uint64_t offset, uint64_t count) const
 {
     if (offset > std::numeric_limits<uint64_t>::max() - count)
@@ -61,6 +169,7 @@ Table::Table(const WasmFile::Table& table, Reference initialValue)
     , m_address_type(table.limits.address_type)
 {
     m_max = table.limits.max;
+    m_initial_size = table.limits.min;
     m_elements.reserve(table.limits.min);
     for (uint32_t i = 0; i < table.limits.min; i++)
         m_elements.push_back(initialValue);
@@ -79,6 +188,11 @@ void Table::grow(uint64_t elements, Reference value)
         m_elements.push_back(value);
 }
 
+void Table::reset(Reference value)
+{
+    m_elements.assign(m_initial_size, value);
+}
+
 Reference Table::get(uint64_t index) const
 {
     if (index >= m_elements.size())
@@ -114,9 +228,19 @@ Global::Global(Type type, WasmFile::GlobalMutability mutability, Value defaultVa
         throw Trap("Invalid default value for global");
 }
 
+// Other instances may be decoding lazily loaded bodies, which take new cache indexes under the lock
+static uint32_t indirect_call_site_count(WasmFile::WasmFile& wasmFile)
+{
+    std::lock_guard lock(wasmFile.lazyCodeMutex);
+    return wasmFile.indirectCallSiteCount;
+}
+
 RealModule::RealModule(size_t id, Ref<WasmFile::WasmFile> wasmFile)
     : m_id(id)
     , m_wasm_file(wasmFile)
+    , m_dropped_elements(wasmFile->elements.size(), false)
+    , m_dropped_data(wasmFile->dataBlocks.size(), false)
+    , m_indirect_call_caches(indirect_call_site_count(*wasmFile))
 {
 }
 
@@ -165,6 +289,12 @@ Ref<Function> RealModule::get_function(uint32_t index) const
     return m_functions[index];
 }
 
+void RealModule::restore_segments()
+{
+    m_dropped_elements.assign(m_dropped_elements.size(), false);
+    m_dropped_data.assign(m_dropped_data.size(), false);
+}
+
 std::optional<Ref<Function>> RealModule::start_function() const
 {
     if (m_wasm_file->startFunction.has_value())
@@ -172,6 +302,33 @@ std::optional<Ref<Function>> RealModule::start_function() const
     return {};
 }
 
+void RealModule::seed_indirect_call_caches()
+{
+    if (m_wasm_file->indirectCallTargetHints.empty())
+        return;
+
+    // Other instances may be decoding lazily loaded bodies at the same time
+    std::lock_guard lock(m_wasm_file->lazyCodeMutex);
+
+    for (const auto& code : m_wasm_file->codeBlocks)
+    {
+        for (const auto& instruction : code.instructions)
+        {
+            if (instruction.opcode != Opcode::call_indirect && instruction.opcode != Opcode::return_call_indirect)
+                continue;
+
+            const auto& arguments = instruction.get_arguments<CallIndirectArguments>();
+            const auto hint = m_wasm_file->indirectCallTargetHints.find(arguments.cacheIndex);
+            if (hint == m_wasm_file->indirectCallTargetHints.end() || hint->second >= m_functions.size())
+                continue;
+
+            // The hint only says which function is likely, the type still has to match the call site
+            if (m_functions[hint->second]->type() == m_wasm_file->functionTypes[arguments.typeIndex])
+                indirect_call_cache(arguments.cacheIndex) = IndirectCallCache { .moduleId = m_id, .functionIndex = hint->second };
+        }
+    }
+}
+
 std::optional<ImportedObject> RealModule::try_import(std::string_view name, WasmFile::ImportType type) const
 {
     const auto maybeExported = m_wasm_file->find_export_by_name(name);
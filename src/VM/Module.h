@@ -5,6 +5,9 @@
 #include "Value.h"
 #include "WasmFile/WasmFile.h"
 #include <concepts>
+#include <limits>
+
+struct ModuleProfile;
 
 class Function
 {
@@ -20,23 +23,37 @@ class RealModule;
 class RealFunction final : public Function
 {
 public:
-    constexpr RealFunction(WasmFile::FunctionType* type, WasmFile::Code* code, Ref<RealModule> parent)
+    constexpr RealFunction(WasmFile::FunctionType* type, WasmFile::Code* code, Ref<RealModule> parent, uint32_t index, bool lazy)
         : m_type(type)
         , m_code(code)
         , m_parent(parent)
+        , m_index(index)
+        , m_needs_decode(lazy)
     {
     }
 
     virtual const WasmFile::FunctionType& type() const override;
     const WasmFile::Code& code() const { return *m_code; }
+    // Has to be called before the code is used, lazily loaded bodies are decoded here. The body is shared with the
+    // other instances of the module, which may run on other threads, so it's only looked at under the lock in decode().
+    void ensure_decoded() const
+    {
+        if (m_needs_decode) [[unlikely]]
+            decode();
+    }
     Ref<RealModule> parent() const { return m_parent.lock(); }
+    uint32_t index() const { return m_index; }
 
     [[nodiscard]] virtual std::vector<Value> run(std::span<const Value> args) const override;
 
 private:
+    void decode() const;
+
     WasmFile::FunctionType* m_type;
     WasmFile::Code* m_code;
     Weak<RealModule> m_parent;
+    uint32_t m_index;
+    mutable bool m_needs_decode;
 };
 
 class Memory
@@ -50,15 +67,28 @@ public:
     void grow(uint64_t pages);
     bool check_outside_bounds(uint64_t offset, uint64_t count) const;
 
+    // Copies an active data segment into memory. Whole pages that line up with the file the bytes come from are
+    // mapped copy-on-write instead, so they are only read in once they are touched.
+    void initialize(uint64_t offset, std::span<const uint8_t> bytes, const FileMapping* mapping);
+    // Shrinks the memory back to its initial size with every byte zeroed. The pages stay reserved, so growing
+    // into them again doesn't have to map anything.
+    void reset();
+
     uint8_t* data() const { return m_data; }
     uint64_t size() const { return m_size; }
     std::optional<uint64_t> max() const { return m_max; }
     AddressType address_type() const { return m_address_type; }
 
 private:
+    static uint8_t* allocate_pages(uint64_t size);
+
     uint8_t* m_data;
+    // In bytes, can be more than the current size after a reset
+    uint64_t m_reserved { 0 };
+    bool m_has_file_pages { false };
 
     uint64_t m_size;
+    uint64_t m_initial_size;
     std::optional<uint64_t> m_max;
     AddressType m_address_type;
 };
@@ -71,6 +101,8 @@ public:
     WasmFile::Limits limits() const;
 
     void grow(uint64_t elements, Reference value);
+    // Back to the initial size with every element set to the given value, without giving up the storage
+    void reset(Reference value);
 
     Reference get(uint64_t index) const;
     void set(uint64_t index, Reference element);
@@ -85,6 +117,7 @@ public:
 
 private:
     std::vector<Reference> m_elements;
+    uint64_t m_initial_size;
 
     Type m_type;
     std::optional<uint64_t> m_max;
@@ -155,6 +188,34 @@ public:
 
     std::optional<Ref<Function>> start_function() const;
 
+    // Segments belong to the module, which can be instantiated any number of times, so dropping one is per instance.
+    // A dropped segment behaves like an empty one.
+    void drop_element(uint32_t index) { m_dropped_elements[index] = true; }
+    bool is_element_dropped(uint32_t index) const { return m_dropped_elements[index]; }
+    void drop_data(uint32_t index) { m_dropped_data[index] = true; }
+    bool is_data_dropped(uint32_t index) const { return m_dropped_data[index]; }
+    void restore_segments();
+
+    struct IndirectCallCache
+    {
+        // Ids are never reused, unlike the address of a freed instance
+        size_t moduleId { std::numeric_limits<size_t>::max() };
+        uint32_t functionIndex { 0 };
+    };
+
+    // Remembers the last target of a call_indirect site whose type already matched
+    RELEASE_INLINE IndirectCallCache& indirect_call_cache(uint32_t cacheIndex)
+    {
+        // Lazily decoded bodies add call sites after instantiation
+        if (cacheIndex >= m_indirect_call_caches.size()) [[unlikely]]
+            m_indirect_call_caches.resize(cacheIndex + 1);
+        return m_indirect_call_caches[cacheIndex];
+    }
+    void seed_indirect_call_caches();
+
+    ModuleProfile* profile() const { return m_profile; }
+    void set_profile(ModuleProfile* profile) { m_profile = profile; }
+
     virtual std::optional<ImportedObject> try_import(std::string_view name, WasmFile::ImportType type) const override;
 
 private:
@@ -165,4 +226,10 @@ private:
     std::vector<Ref<Table>> m_tables;
     std::vector<Ref<Memory>> m_memories;
     std::vector<Ref<Global>> m_globals;
+
+    std::vector<bool> m_dropped_elements;
+    std::vector<bool> m_dropped_data;
+
+    std::vector<IndirectCallCache> m_indirect_call_caches;
+    ModuleProfile* m_profile { nullptr };
 };
@@ -0,0 +1,456 @@
+#include "Preinitializer.h"
+#include "Snapshot.h"
+#include "Stream/MemoryStream.h"
+#include "VM.h"
+#include "WasmFile/Encoder.h"
+#include "WasmFile/Opcode.h"
+#include <algorithm>
+#include <array>
+#include <map>
+
+enum class SectionId : uint8_t
+{
+    Custom = 0,
+    Type = 1,
+    Import = 2,
+    Function = 3,
+    Table = 4,
+    Memory = 5,
+    Global = 6,
+    Export = 7,
+    Start = 8,
+    Element = 9,
+    Code = 10,
+    Data = 11,
+    DataCount = 12,
+    Tag = 13,
+};
+
+// The order sections have to appear in, custom sections can go anywhere
+static constexpr std::array SECTION_ORDER {
+    SectionId::Type,
+    SectionId::Import,
+    SectionId::Function,
+    SectionId::Table,
+    SectionId::Memory,
+    SectionId::Tag,
+    SectionId::Global,
+    SectionId::Export,
+    SectionId::Start,
+    SectionId::Element,
+    SectionId::DataCount,
+    SectionId::Code,
+    SectionId::Data,
+};
+
+// Zeroes within a data segment are cheaper than starting another segment, which costs a few bytes of header
+static constexpr uint64_t MAX_ZERO_GAP = 16;
+
+struct OriginalSection
+{
+    std::span<const uint8_t> contents;
+    // Custom sections stay in front of the section that followed them
+    std::vector<std::span<const uint8_t>> customSectionsBefore;
+};
+
+struct OriginalModule
+{
+    std::map<SectionId, OriginalSection> sections;
+    std::vector<std::span<const uint8_t>> trailingCustomSections;
+};
+
+// Custom sections are kept with their id and size, the other sections only with their contents
+static OriginalModule split_sections(std::span<const uint8_t> module)
+{
+    OriginalModule original;
+    std::vector<std::span<const uint8_t>> customSections;
+
+    try
+    {
+        MemoryStream stream(module);
+        stream.skip(8);
+
+        while (!stream.eof())
+        {
+            const size_t begin = stream.offset();
+            const auto id = static_cast<SectionId>(stream.read_little_endian<uint8_t>());
+            const uint32_t size = stream.read_leb<uint32_t>();
+            if (size > stream.size() - stream.offset())
+                throw StreamReadException();
+
+            if (id == SectionId::Custom)
+                customSections.push_back(module.subspan(begin, stream.offset() + size - begin));
+            else
+                original.sections[id] = OriginalSection { .contents = module.subspan(stream.offset(), size), .customSectionsBefore = std::exchange(customSections, {}) };
+
+            stream.skip(size);
+        }
+    }
+    catch (const StreamReadException&)
+    {
+        throw WasmFile::InvalidWASMException("Failed to read the sections of the module");
+    }
+
+    original.trailingCustomSections = std::move(customSections);
+    return original;
+}
+
+static void write_offset_expression(Encoder& encoder, uint64_t offset, AddressType addressType)
+{
+    if (addressType == AddressType::i64)
+    {
+        encoder.write_byte(static_cast<uint8_t>(Opcode::i64_const));
+        encoder.write_s64(static_cast<int64_t>(offset));
+    }
+    else
+    {
+        encoder.write_byte(static_cast<uint8_t>(Opcode::i32_const));
+        encoder.write_s32(static_cast<int32_t>(offset));
+    }
+    encoder.write_byte(static_cast<uint8_t>(Opcode::end));
+}
+
+static bool is_own_function(const Reference& reference, const RealModule& instance)
+{
+    return reference.type == ReferenceType::Function && reference.index && reference.module == &instance;
+}
+
+static void write_value_expression(Encoder& encoder, const Value& value, Type type, const RealModule& instance)
+{
+    switch (type)
+    {
+        case Type::i32:
+            encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::i32_const, .arguments = value.get<uint32_t>() } });
+            break;
+        case Type::i64:
+            encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::i64_const, .arguments = value.get<uint64_t>() } });
+            break;
+        case Type::f32:
+            encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::f32_const, .arguments = value.get<float>() } });
+            break;
+        case Type::f64:
+            encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::f64_const, .arguments = value.get<double>() } });
+            break;
+        case Type::v128:
+            encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::v128_const, .arguments = value.get<uint128_t>() } });
+            break;
+        case Type::funcref:
+        case Type::externref: {
+            const auto& reference = value.get<Reference>();
+            if (!reference.index)
+                encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::ref_null, .arguments = type } });
+            else if (is_own_function(reference, instance))
+                encoder.write_constant_expression(std::array { Instruction { .opcode = Opcode::ref_func, .arguments = *reference.index } });
+            else
+                throw SnapshotException("References to host objects or other modules can't be written to a module");
+            break;
+        }
+        default:
+            std::unreachable();
+    }
+}
+
+static std::vector<uint32_t> referenced_functions(const WasmFile::Element& element)
+{
+    if (!element.functionIndexes.empty())
+        return element.functionIndexes;
+
+    std::vector<uint32_t> functions;
+    for (const auto& instruction : element.referencesCode)
+        if (instruction.opcode == Opcode::ref_func)
+            functions.push_back(instruction.get_arguments<uint32_t>());
+    return functions;
+}
+
+static Encoder encode_tables(WasmFile::WasmFile& file, const RealModule& instance)
+{
+    const uint32_t importedCount = file.get_import_count_of_type(WasmFile::ImportType::Table);
+
+    Encoder encoder;
+    encoder.write_u32(file.tables.size());
+    for (size_t i = 0; i < file.tables.size(); i++)
+    {
+        const auto* table = instance.get_table(importedCount + i);
+        encoder.write_type(file.tables[i].refType);
+        encoder.write_limits(table->limits());
+    }
+    return encoder;
+}
+
+static Encoder encode_memories(WasmFile::WasmFile& file, const RealModule& instance)
+{
+    const uint32_t importedCount = file.get_import_count_of_type(WasmFile::ImportType::Memory);
+
+    Encoder encoder;
+    encoder.write_u32(file.memories.size());
+    for (size_t i = 0; i < file.memories.size(); i++)
+        encoder.write_limits(instance.get_memory(importedCount + i)->limits());
+    return encoder;
+}
+
+static Encoder encode_globals(WasmFile::WasmFile& file, const RealModule& instance)
+{
+    const uint32_t importedCount = file.get_import_count_of_type(WasmFile::ImportType::Global);
+
+    Encoder encoder;
+    encoder.write_u32(file.globals.size());
+    for (size_t i = 0; i < file.globals.size(); i++)
+    {
+        const auto global = instance.get_global(importedCount + i);
+        encoder.write_type(global->type());
+        encoder.write_byte(static_cast<uint8_t>(global->mutability()));
+        write_value_expression(encoder, global->get(), global->type(), instance);
+    }
+    return encoder;
+}
+
+static Encoder encode_exports(const WasmFile::WasmFile& file, std::optional<std::string_view> initExport)
+{
+    std::vector<const WasmFile::Export*> exports;
+    for (const auto& exported : file.exports)
+        if (!(initExport && exported.name == *initExport && exported.type == WasmFile::ImportType::Function))
+            exports.push_back(&exported);
+
+    Encoder encoder;
+    encoder.write_u32(exports.size());
+    for (const auto* exported : exports)
+    {
+        encoder.write_name(exported->name);
+        encoder.write_byte(static_cast<uint8_t>(exported->type));
+        encoder.write_u32(exported->index);
+    }
+    return encoder;
+}
+
+// Segments keep their indexes. The ones that were dropped or already applied become declarative segments, which are
+// dropped right away too. Every non-null entry of the tables is written by new active segments after them.
+static Encoder encode_elements(WasmFile::WasmFile& file, const RealModule& instance, std::optional<std::string_view> initExport)
+{
+    std::vector<Encoder> segments;
+
+    for (uint32_t index = 0; index < file.elements.size(); index++)
+    {
+        const auto& element = file.elements[index];
+        auto& segment = segments.emplace_back();
+
+        if (element.mode == WasmFile::ElementMode::Passive && !instance.is_element_dropped(index))
+        {
+            if (!element.functionIndexes.empty())
+            {
+                segment.write_u32(1);
+                segment.write_byte(0x00);
+                segment.write_u32(element.functionIndexes.size());
+                for (const auto function : element.functionIndexes)
+                    segment.write_u32(function);
+            }
+            else
+            {
+                segment.write_u32(5);
+                segment.write_type(element.valueType);
+                segment.write_u32(element.reference_count());
+                for (size_t i = 0; i < element.reference_count(); i++)
+                    segment.write_constant_expression(element.reference_expression(i));
+            }
+            continue;
+        }
+
+        // The functions still have to be declared for ref.func in the code
+        const auto functions = referenced_functions(element);
+        segment.write_u32(7);
+        segment.write_type(element.valueType);
+        segment.write_u32(functions.size());
+        for (const auto function : functions)
+            segment.write_constant_expression(std::array { Instruction { .opcode = Opcode::ref_func, .arguments = function } });
+    }
+
+    // The globals no longer have their original initializers and the init export is gone, which may have been the only
+    // declarations of some functions
+    std::vector<uint32_t> declarations;
+    for (const auto& global : file.globals)
+        for (const auto& instruction : global.initCode)
+            if (instruction.opcode == Opcode::ref_func)
+                declarations.push_back(instruction.get_arguments<uint32_t>());
+
+    if (initExport)
+        if (const auto exported = file.find_export_by_name(*initExport); exported && exported->type == WasmFile::ImportType::Function)
+            declarations.push_back(exported->index);
+
+    if (!declarations.empty())
+    {
+        auto& segment = segments.emplace_back();
+        segment.write_u32(3);
+        segment.write_byte(0x00);
+        segment.write_u32(declarations.size());
+        for (const auto function : declarations)
+            segment.write_u32(function);
+    }
+
+    const uint32_t importedTableCount = file.get_import_count_of_type(WasmFile::ImportType::Table);
+    for (uint32_t tableIndex = importedTableCount; tableIndex < importedTableCount + file.tables.size(); tableIndex++)
+    {
+        const auto* table = instance.get_table(tableIndex);
+
+        uint64_t begin = 0;
+        while (begin < table->size())
+        {
+            const auto reference = table->unsafe_get(begin);
+            if (!reference.index)
+            {
+                begin++;
+                continue;
+            }
+
+            if (!is_own_function(reference, instance))
+                throw SnapshotException("References to host objects or other modules can't be written to a module");
+
+            uint64_t end = begin + 1;
+            while (end < table->size() && is_own_function(table->unsafe_get(end), instance))
+                end++;
+
+            auto& segment = segments.emplace_back();
+            segment.write_u32(2);
+            segment.write_u32(tableIndex);
+            write_offset_expression(segment, begin, table->address_type());
+            segment.write_byte(0x00);
+            segment.write_u32(end - begin);
+            for (uint64_t i = begin; i < end; i++)
+                segment.write_u32(*table->unsafe_get(i).index);
+
+            begin = end;
+        }
+    }
+
+    Encoder encoder;
+    encoder.write_u32(segments.size());
+    for (const auto& segment : segments)
+        encoder.write_bytes(segment.bytes());
+    return encoder;
+}
+
+// Segments keep their indexes, but all of them become passive. The ones that were dropped or already applied are
+// empty, which is the same as dropped. The memory contents are written by new active segments after them.
+static Encoder encode_data(WasmFile::WasmFile& file, const RealModule& instance, uint32_t& segmentCount)
+{
+    std::vector<Encoder> segments;
+
+    for (uint32_t index = 0; index < file.dataBlocks.size(); index++)
+    {
+        const auto& data = file.dataBlocks[index];
+        const bool keep = data.mode == WasmFile::ElementMode::Passive && !instance.is_data_dropped(index);
+
+        auto& segment = segments.emplace_back();
+        segment.write_u32(1);
+        segment.write_u32(keep ? data.data.size() : 0);
+        if (keep)
+            segment.write_bytes(data.data);
+    }
+
+    const uint32_t importedMemoryCount = file.get_import_count_of_type(WasmFile::ImportType::Memory);
+    for (uint32_t memoryIndex = importedMemoryCount; memoryIndex < importedMemoryCount + file.memories.size(); memoryIndex++)
+    {
+        const auto* memory = instance.get_memory(memoryIndex);
+        const std::span<const uint8_t> bytes(memory->data(), memory->size() * WASM_PAGE_SIZE);
+
+        const auto is_nonzero = [](uint8_t byte) { return byte != 0; };
+
+        auto begin = std::ranges::find_if(bytes, is_nonzero);
+        while (begin != bytes.end())
+        {
+            // Extend the segment over short runs of zeroes
+            auto end = std::find(begin, bytes.end(), 0);
+            while (end != bytes.end())
+            {
+                const auto next = std::find_if(end, bytes.end(), is_nonzero);
+                if (next == bytes.end() || static_cast<uint64_t>(next - end) > MAX_ZERO_GAP)
+                    break;
+                end = std::find(next, bytes.end(), 0);
+            }
+
+            auto& segment = segments.emplace_back();
+            if (memoryIndex == 0)
+            {
+                segment.write_u32(0);
+            }
+            else
+            {
+                segment.write_u32(2);
+                segment.write_u32(memoryIndex);
+            }
+            write_offset_expression(segment, begin - bytes.begin(), memory->address_type());
+            segment.write_u32(end - begin);
+            segment.write_bytes(std::span(begin, end));
+
+            begin = std::find_if(end, bytes.end(), is_nonzero);
+        }
+    }
+
+    segmentCount = segments.size();
+
+    Encoder encoder;
+    encoder.write_u32(segments.size());
+    for (const auto& segment : segments)
+        encoder.write_bytes(segment.bytes());
+    return encoder;
+}
+
+std::vector<uint8_t> preinitialize(std::span<const uint8_t> module, RealModule& instance, std::optional<std::string_view> initExport)
+{
+    auto& file = *instance.wasm_file();
+
+    // Their state lives outside of the module, changes the initialization made to it would be lost
+    for (const auto& import : file.imports)
+    {
+        if (import.type == WasmFile::ImportType::Memory)
+            throw SnapshotException("Imported memories can't be written to a module");
+        if (import.type == WasmFile::ImportType::Table)
+            throw SnapshotException("Imported tables can't be written to a module");
+        if (import.type == WasmFile::ImportType::Global && import.globalMutability == WasmFile::GlobalMutability::Variable)
+            throw SnapshotException("Imported mutable globals can't be written to a module");
+    }
+
+    const auto original = split_sections(module);
+
+    uint32_t dataCount = 0;
+    std::map<SectionId, std::optional<Encoder>> replaced;
+    replaced[SectionId::Table] = encode_tables(file, instance);
+    replaced[SectionId::Memory] = encode_memories(file, instance);
+    replaced[SectionId::Global] = encode_globals(file, instance);
+    replaced[SectionId::Export] = encode_exports(file, initExport);
+    replaced[SectionId::Start] = std::nullopt;
+    replaced[SectionId::Element] = encode_elements(file, instance, initExport);
+    replaced[SectionId::Data] = encode_data(file, instance, dataCount);
+
+    Encoder dataCountSection;
+    dataCountSection.write_u32(dataCount);
+    replaced[SectionId::DataCount] = dataCountSection;
+
+    Encoder output;
+    output.write_bytes(module.first(8));
+
+    for (const auto id : SECTION_ORDER)
+    {
+        const auto originalSection = original.sections.find(id);
+        if (originalSection != original.sections.end())
+            for (const auto customSection : originalSection->second.customSectionsBefore)
+                output.write_bytes(customSection);
+
+        if (const auto replacement = replaced.find(id); replacement != replaced.end())
+        {
+            // Sections the module didn't have are only added if there is something in them
+            const auto& contents = replacement->second;
+            if (contents && (originalSection != original.sections.end() || contents->bytes() != std::vector<uint8_t> { 0 }))
+                output.write_section(static_cast<uint8_t>(id), *contents);
+        }
+        else if (originalSection != original.sections.end())
+        {
+            Encoder contents;
+            contents.write_bytes(originalSection->second.contents);
+            output.write_section(static_cast<uint8_t>(id), contents);
+        }
+    }
+
+    for (const auto customSection : original.trailingCustomSections)
+        output.write_bytes(customSection);
+
+    return output.bytes();
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Module.h"
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// Turns an initialized instance back into a module, the way Wizer does. Memory contents become active data segments,
+// globals get their current values as initializers, tables are filled by active element segments and the start
+// function is removed, so none of the initialization runs again when the new module is loaded. The code and the
+// indexes of everything stay the same. State that can't be expressed in a module, like references to host objects or
+// imported memories, tables and mutable globals, fails with a SnapshotException.
+std::vector<uint8_t> preinitialize(std::span<const uint8_t> module, RealModule& instance, std::optional<std::string_view> initExport = {});
@@ -0,0 +1,205 @@
+#include "Profile.h"
+#include "WasmFile/Opcode.h"
+#include "WasmFile/Parser.h"
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <nlohmann/json.hpp>
+
+// Branches with fewer samples than this are left alone, the bias isn't meaningful yet
+static constexpr uint64_t MIN_BRANCH_SAMPLES = 64;
+static constexpr double MIN_BRANCH_BIAS = 0.9;
+
+FunctionProfile& ModuleProfile::function(uint64_t index)
+{
+    if (index >= MAX_FUNCTION_COUNT)
+        throw ProfileException(std::format("Invalid function index {}", index));
+
+    if (index >= functions.size())
+        functions.resize(index + 1);
+    return functions[index];
+}
+
+void ModuleProfile::ensure_function_count(size_t count)
+{
+    if (functions.size() < count)
+        functions.resize(count);
+}
+
+void ModuleProfile::apply_to(WasmFile::WasmFile& wasmFile) const
+{
+    const uint32_t importedFunctionCount = wasmFile.get_import_count_of_type(WasmFile::ImportType::Function);
+
+    for (uint32_t index = importedFunctionCount; index < functions.size(); index++)
+    {
+        if (index - importedFunctionCount >= wasmFile.codeBlocks.size())
+            break;
+
+        const auto& profile = functions[index];
+        auto& instructions = wasmFile.codeBlocks[index - importedFunctionCount].instructions;
+
+        // A profile recorded with different load options can point at other instructions, so every site is checked
+        for (const auto& [ip, counts] : profile.branches)
+        {
+            const uint64_t samples = counts.taken + counts.notTaken;
+            if (ip >= instructions.size() || samples < MIN_BRANCH_SAMPLES)
+                continue;
+
+            const double bias = static_cast<double>(counts.taken) / static_cast<double>(samples);
+            if (bias < MIN_BRANCH_BIAS && bias > 1.0 - MIN_BRANCH_BIAS)
+                continue;
+
+            // Measured bias wins over a hint from the branch hint section
+            auto& instruction = instructions[ip];
+            instruction.opcode = hinted_branch_opcode(instruction.opcode, bias >= MIN_BRANCH_BIAS);
+        }
+
+        for (const auto& [ip, targets] : profile.indirectCallTargets)
+        {
+            if (ip >= instructions.size() || targets.empty())
+                continue;
+
+            const auto& instruction = instructions[ip];
+            if (instruction.opcode != Opcode::call_indirect && instruction.opcode != Opcode::return_call_indirect)
+                continue;
+
+            const auto hottest = std::ranges::max_element(targets, {}, [](const auto& target) { return target.second; });
+            wasmFile.indirectCallTargetHints[instruction.get_arguments<CallIndirectArguments>().cacheIndex] = hottest->first;
+        }
+    }
+}
+
+static std::unordered_map<uint32_t, uint64_t> read_counters(const nlohmann::json& json)
+{
+    std::unordered_map<uint32_t, uint64_t> counters;
+    for (const auto& [key, value] : json.items())
+        counters[std::stoul(key)] = value.get<uint64_t>();
+    return counters;
+}
+
+static nlohmann::json write_counters(const std::unordered_map<uint32_t, uint64_t>& counters)
+{
+    nlohmann::json json = nlohmann::json::object();
+    for (const auto& [key, value] : counters)
+        json[std::to_string(key)] = value;
+    return json;
+}
+
+Ref<Profile> Profile::load(const std::string& path)
+{
+    auto profile = MakeRef<Profile>();
+    if (!std::filesystem::exists(path))
+        return profile;
+
+    try
+    {
+        std::ifstream file(path);
+        const auto json = nlohmann::json::parse(file);
+
+        if (json.at("version").get<uint32_t>() != VERSION)
+            throw ProfileException("Unsupported profile version");
+
+        for (const auto& [hash, moduleJson] : json.at("modules").items())
+        {
+            auto& mod = profile->module(std::stoull(hash, nullptr, 16));
+
+            for (const auto& [index, functionJson] : moduleJson.items())
+            {
+                auto& function = mod.function(std::stoull(index));
+
+                function.calls = functionJson.value("calls", 0ull);
+
+                if (functionJson.contains("loops"))
+                    function.loopIterations = read_counters(functionJson["loops"]);
+
+                if (functionJson.contains("branches"))
+                    for (const auto& [ip, counts] : functionJson["branches"].items())
+                        function.branches[std::stoul(ip)] = BranchCounts { .taken = counts.at(0).get<uint64_t>(), .notTaken = counts.at(1).get<uint64_t>() };
+
+                if (functionJson.contains("indirect_calls"))
+                    for (const auto& [ip, targets] : functionJson["indirect_calls"].items())
+                        function.indirectCallTargets[std::stoul(ip)] = read_counters(targets);
+            }
+        }
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        throw ProfileException(std::format("Malformed profile {}: {}", path, e.what()));
+    }
+    catch (const std::logic_error& e)
+    {
+        throw ProfileException(std::format("Malformed profile {}: {}", path, e.what()));
+    }
+
+    return profile;
+}
+
+void Profile::save(const std::string& path) const
+{
+    nlohmann::json modules = nlohmann::json::object();
+
+    for (const auto& [hash, mod] : m_modules)
+    {
+        nlohmann::json moduleJson = nlohmann::json::object();
+
+        for (uint32_t index = 0; index < mod.functions.size(); index++)
+        {
+            const auto& function = mod.functions[index];
+            if (function.empty())
+                continue;
+
+            nlohmann::json functionJson;
+            functionJson["calls"] = function.calls;
+
+            if (!function.loopIterations.empty())
+                functionJson["loops"] = write_counters(function.loopIterations);
+
+            if (!function.branches.empty())
+            {
+                nlohmann::json branches = nlohmann::json::object();
+                for (const auto& [ip, counts] : function.branches)
+                    branches[std::to_string(ip)] = { counts.taken, counts.notTaken };
+                functionJson["branches"] = branches;
+            }
+
+            if (!function.indirectCallTargets.empty())
+            {
+                nlohmann::json indirectCalls = nlohmann::json::object();
+                for (const auto& [ip, targets] : function.indirectCallTargets)
+                    indirectCalls[std::to_string(ip)] = write_counters(targets);
+                functionJson["indirect_calls"] = indirectCalls;
+            }
+
+            moduleJson[std::to_string(index)] = functionJson;
+        }
+
+        modules[std::format("{:016x}", hash)] = moduleJson;
+    }
+
+    nlohmann::json json;
+    json["version"] = VERSION;
+    json["modules"] = modules;
+
+    // Write to a temporary file first so a crash can't leave a truncated profile behind
+    const std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream file(temporaryPath);
+        if (!file)
+            throw ProfileException(std::format("Failed to open {} for writing", temporaryPath));
+        file << json.dump();
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+        throw ProfileException(std::format("Failed to replace {}: {}", path, error.message()));
+}
+
+const ModuleProfile* Profile::find_module(uint64_t contentHash) const
+{
+    const auto it = m_modules.find(contentHash);
+    if (it == m_modules.end())
+        return nullptr;
+    return &it->second;
+}
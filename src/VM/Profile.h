@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Util/Util.h"
+#include "WasmFile/WasmFile.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct BranchCounts
+{
+    uint64_t taken { 0 };
+    uint64_t notTaken { 0 };
+};
+
+// All per-instruction counters are keyed by the index of the instruction in the lowered function body
+struct FunctionProfile
+{
+    uint64_t calls { 0 };
+
+    // Executions of the loop instruction itself, which is every iteration including the first one
+    std::unordered_map<uint32_t, uint64_t> loopIterations;
+    // For if, taken means the condition was true
+    std::unordered_map<uint32_t, BranchCounts> branches;
+    // Function index to call count, per call_indirect site
+    std::unordered_map<uint32_t, std::unordered_map<uint32_t, uint64_t>> indirectCallTargets;
+
+    bool empty() const { return calls == 0 && loopIterations.empty() && branches.empty() && indirectCallTargets.empty(); }
+};
+
+struct ModuleProfile
+{
+    // Same as the limit of the JS API, profiles are read before the module they belong to is known
+    static constexpr uint64_t MAX_FUNCTION_COUNT = 1000000;
+
+    // Indexed by function index, imported functions stay empty
+    std::vector<FunctionProfile> functions;
+
+    // Throws a ProfileException for indexes no module can have
+    FunctionProfile& function(uint64_t index);
+    void ensure_function_count(size_t count);
+
+    // Rewrites strongly biased branches into hinted opcodes and records the hottest indirect call targets
+    void apply_to(WasmFile::WasmFile& wasmFile) const;
+};
+
+class Profile
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    // A missing file gives an empty profile
+    static Ref<Profile> load(const std::string& path);
+    void save(const std::string& path) const;
+
+    ModuleProfile& module(uint64_t contentHash) { return m_modules[contentHash]; }
+    const ModuleProfile* find_module(uint64_t contentHash) const;
+
+private:
+    std::unordered_map<uint64_t, ModuleProfile> m_modules;
+};
+
+class ProfileException
+{
+public:
+    ProfileException(std::string_view reason)
+        : m_reason(reason)
+    {
+    }
+
+    std::string reason() const { return m_reason; }
+
+private:
+    std::string m_reason;
+};
@@ -0,0 +1,306 @@
+#include "Scheduler.h"
+#include "AsyncFunction.h"
+#include "Trap.h"
+#include "VM.h"
+#include <algorithm>
+#include <deque>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <utility>
+
+struct Scheduler::Task
+{
+    Ref<Module> instance;
+    std::string function;
+    std::vector<Value> args;
+    std::promise<std::vector<Value>> result;
+
+    VM::Context context;
+    ucontext_t machineContext {};
+    void* stack { nullptr };
+    // The frame of the call while it's suspended
+    VM::Frame* frame { nullptr };
+    // The worker it started on, nothing else may resume it
+    Worker* owner { nullptr };
+    // Waiting for a pending call, whoever completes that queues it again
+    bool blocked { false };
+    bool finished { false };
+
+    ~Task()
+    {
+        if (stack)
+            munmap(stack, STACK_SIZE);
+    }
+};
+
+struct Scheduler::Worker
+{
+    Scheduler* scheduler { nullptr };
+    size_t index { 0 };
+
+    std::mutex mutex;
+    // Calls that haven't started yet, the worker takes the oldest one and thieves take the newest
+    std::deque<Task*> queued;
+    // A started call can only be resumed on the thread it started on, the interpreter keeps its frame in a thread_local.
+    // Calls are queued here by completed pending calls too, so it's guarded by the mutex as well.
+    std::deque<Task*> suspended;
+    bool preferQueued { false };
+
+    ucontext_t machineContext {};
+    Task* current { nullptr };
+    std::thread thread;
+};
+
+Scheduler::Scheduler(size_t workerCount, int64_t timeSlice)
+    : m_time_slice(std::max<int64_t>(timeSlice, 1))
+{
+    workerCount = std::max<size_t>(workerCount, 1);
+    for (size_t i = 0; i < workerCount; i++)
+    {
+        m_workers.push_back(MakeOwn<Worker>());
+        m_workers.back()->scheduler = this;
+        m_workers.back()->index = i;
+    }
+
+    for (auto& worker : m_workers)
+        worker->thread = std::thread([this, &worker = *worker]() { run_worker(worker); });
+}
+
+Scheduler::~Scheduler()
+{
+    wait();
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_work_available.notify_all();
+
+    for (auto& worker : m_workers)
+        worker->thread.join();
+}
+
+std::future<std::vector<Value>> Scheduler::spawn(Ref<Module> instance, std::string function, std::vector<Value> args)
+{
+    auto* task = new Task();
+    task->instance = instance;
+    task->function = std::move(function);
+    task->args = std::move(args);
+
+    auto future = task->result.get_future();
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_unfinished_tasks++;
+        m_queued_tasks++;
+
+        auto& worker = *m_workers[m_next_worker++ % m_workers.size()];
+        std::lock_guard workerLock(worker.mutex);
+        worker.queued.push_back(task);
+    }
+
+    m_work_available.notify_one();
+    return future;
+}
+
+void Scheduler::wait()
+{
+    std::unique_lock lock(m_mutex);
+    m_idle.wait(lock, [this]() { return m_unfinished_tasks == 0; });
+}
+
+void Scheduler::run_worker(Worker& worker)
+{
+    m_current_worker = &worker;
+    VM::m_preemption_handler = yield;
+
+    while (true)
+    {
+        if (auto* task = next_task(worker))
+        {
+            resume(worker, task);
+            continue;
+        }
+
+        // Calls that are woken up are queued while m_mutex is held as well, so none of them is missed
+        std::unique_lock lock(m_mutex);
+        m_work_available.wait(lock, [&]() {
+            std::lock_guard workerLock(worker.mutex);
+            return m_stopping || m_queued_tasks > 0 || !worker.suspended.empty();
+        });
+
+        if (m_stopping)
+            return;
+    }
+}
+
+Scheduler::Task* Scheduler::next_task(Worker& worker)
+{
+    const auto take_suspended = [&]() -> Task* {
+        std::lock_guard lock(worker.mutex);
+        if (worker.suspended.empty())
+            return nullptr;
+
+        auto* task = worker.suspended.front();
+        worker.suspended.pop_front();
+        return task;
+    };
+
+    // Alternating keeps new calls from waiting behind busy ones and the other way around
+    worker.preferQueued = !worker.preferQueued;
+    if (!worker.preferQueued)
+        if (auto* task = take_suspended())
+            return task;
+
+    if (auto* task = take_queued_task(worker, false))
+        return task;
+
+    for (size_t i = 1; i < m_workers.size(); i++)
+        if (auto* task = take_queued_task(*m_workers[(worker.index + i) % m_workers.size()], true))
+            return task;
+
+    return take_suspended();
+}
+
+Scheduler::Task* Scheduler::take_queued_task(Worker& from, bool steal)
+{
+    std::lock_guard lock(from.mutex);
+    if (from.queued.empty())
+        return nullptr;
+
+    Task* task;
+    if (steal)
+    {
+        task = from.queued.back();
+        from.queued.pop_back();
+    }
+    else
+    {
+        task = from.queued.front();
+        from.queued.pop_front();
+    }
+
+    m_queued_tasks--;
+    return task;
+}
+
+void Scheduler::resume(Worker& worker, Task* task)
+{
+    if (!task->stack)
+    {
+        void* stack = mmap(nullptr, STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED)
+        {
+            task->result.set_exception(std::make_exception_ptr(Trap("Failed to allocate a stack")));
+            finish(task);
+            return;
+        }
+
+        task->stack = stack;
+        task->owner = &worker;
+
+        // Overflowing the stack faults instead of running into whatever is mapped below it
+        const size_t guardSize = getpagesize();
+        mprotect(stack, guardSize, PROT_NONE);
+
+        getcontext(&task->machineContext);
+        task->machineContext.uc_stack.ss_sp = static_cast<uint8_t*>(stack) + guardSize;
+        task->machineContext.uc_stack.ss_size = STACK_SIZE - guardSize;
+        task->machineContext.uc_link = &worker.machineContext;
+        makecontext(&task->machineContext, run_task, 0);
+    }
+
+    VM::m_context = &task->context;
+    VM::m_frame = task->frame;
+    VM::m_budget = m_time_slice;
+    worker.current = task;
+
+    swapcontext(&worker.machineContext, &task->machineContext);
+
+    worker.current = nullptr;
+    task->frame = std::exchange(VM::m_frame, nullptr);
+    VM::m_context = nullptr;
+
+    if (task->finished)
+    {
+        finish(task);
+        return;
+    }
+
+    if (task->blocked)
+        return;
+
+    std::lock_guard lock(worker.mutex);
+    worker.suspended.push_back(task);
+}
+
+void Scheduler::finish(Task* task)
+{
+    delete task;
+
+    std::lock_guard lock(m_mutex);
+    if (--m_unfinished_tasks == 0)
+        m_idle.notify_all();
+}
+
+void Scheduler::wake(Task* task)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        std::lock_guard workerLock(task->owner->mutex);
+        task->owner->suspended.push_back(task);
+    }
+
+    // The owner has to be the one to wake up
+    m_work_available.notify_all();
+}
+
+bool Scheduler::can_suspend()
+{
+    return m_current_worker && m_current_worker->current;
+}
+
+void Scheduler::run_task()
+{
+    // Exceptions can't leave the stack of the call, so they go into the future here
+    auto* task = m_current_worker->current;
+    try
+    {
+        task->result.set_value(VM::run_function(task->instance, task->function, task->args));
+    }
+    catch (...)
+    {
+        task->result.set_exception(std::current_exception());
+    }
+
+    // Returning continues at uc_link, in resume() on the worker
+    task->finished = true;
+}
+
+void Scheduler::yield()
+{
+    auto* worker = m_current_worker;
+    swapcontext(&worker->current->machineContext, &worker->machineContext);
+}
+
+void Scheduler::suspend(PendingCall& call)
+{
+    auto* worker = m_current_worker;
+    auto* task = worker->current;
+
+    {
+        std::lock_guard lock(call.m_mutex);
+        if (call.m_done)
+            return;
+
+        // Completing the call can queue the task again before it's switched out here, but only its own worker resumes
+        // it and that one is busy running it until then
+        call.m_resume = [scheduler = worker->scheduler, task]() { scheduler->wake(task); };
+        task->blocked = true;
+    }
+
+    swapcontext(&task->machineContext, &worker->machineContext);
+    task->blocked = false;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Module.h"
+#include "Util/Util.h"
+#include "Value.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class PendingCall;
+
+// Runs calls into wasm instances as green threads on a fixed set of workers. Every call gets a stack of its own and
+// yields back to its worker once it used up its budget of loop iterations and calls, so a busy call can't hold up the
+// others. A call waiting for an async host function is suspended until the host completes it. New calls are spread
+// over the queues of the workers, an idle worker steals from the others' queues.
+class Scheduler
+{
+public:
+    static constexpr int64_t DEFAULT_TIME_SLICE = 10000;
+    // Same as the default stack of a thread, only the pages a call actually uses take memory
+    static constexpr size_t STACK_SIZE = 8 * 1024 * 1024;
+
+    Scheduler(size_t workerCount = std::thread::hardware_concurrency(), int64_t timeSlice = DEFAULT_TIME_SLICE);
+    // Waits for every spawned call to finish
+    ~Scheduler();
+
+    // Calls the export on one of the workers, a trap is rethrown by the future. The instance must not be used by
+    // anything else until the call has finished.
+    std::future<std::vector<Value>> spawn(Ref<Module> instance, std::string function, std::vector<Value> args);
+
+    // Blocks until every spawned call has finished
+    void wait();
+
+    // Whether the calling thread is running a call of a scheduler, only those can be suspended
+    static bool can_suspend();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+private:
+    friend class PendingCall;
+
+    struct Task;
+    struct Worker;
+
+    void run_worker(Worker& worker);
+    Task* next_task(Worker& worker);
+    Task* take_queued_task(Worker& from, bool steal);
+    void resume(Worker& worker, Task* task);
+    void finish(Task* task);
+    // Queues a suspended call on its worker again
+    void wake(Task* task);
+
+    static void run_task();
+    static void yield();
+    // Returns once the pending call is done, right away if it already is
+    static void suspend(PendingCall& call);
+
+    std::vector<Own<Worker>> m_workers;
+    const int64_t m_time_slice;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_idle;
+    // Calls no worker took yet, only ever goes up while m_mutex is held
+    std::atomic<size_t> m_queued_tasks { 0 };
+    size_t m_unfinished_tasks { 0 };
+    size_t m_next_worker { 0 };
+    bool m_stopping { false };
+
+    static inline thread_local Worker* m_current_worker { nullptr };
+};
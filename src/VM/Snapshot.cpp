@@ -0,0 +1,355 @@
+#include "Snapshot.h"
+#include "Stream/MappedFileStream.h"
+#include "Stream/MemoryStream.h"
+#include "VM.h"
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <format>
+#include <fstream>
+
+template <typename T>
+static void write_raw(std::vector<uint8_t>& bytes, const T& value)
+{
+    const auto* begin = reinterpret_cast<const uint8_t*>(&value);
+    bytes.insert(bytes.end(), begin, begin + sizeof(T));
+}
+
+template <typename T>
+static T read_raw(Stream& stream)
+{
+    T value;
+    stream.read(&value, sizeof(T));
+    return value;
+}
+
+static void write_reference(std::vector<uint8_t>& bytes, const Reference& reference, const RealModule& instance)
+{
+    // Only indexes are written, a function of another module can't be found again when restoring
+    if (reference.type == ReferenceType::Function && reference.index && reference.module != &instance)
+        throw SnapshotException("References to functions of other modules can't be snapshotted");
+    // The index only means something to the host of this process
+    if (reference.type == ReferenceType::Extern && reference.index)
+        throw SnapshotException("References to host objects can't be snapshotted");
+
+    write_raw<uint8_t>(bytes, static_cast<uint8_t>(reference.type));
+    write_raw<uint8_t>(bytes, reference.index.has_value());
+    write_raw<uint32_t>(bytes, reference.index.value_or(0));
+}
+
+static Reference read_reference(Stream& stream)
+{
+    const auto type = static_cast<ReferenceType>(read_raw<uint8_t>(stream));
+    if (type != ReferenceType::Function && type != ReferenceType::Extern)
+        throw SnapshotException("Invalid reference type");
+
+    const bool hasIndex = read_raw<uint8_t>(stream);
+    const auto index = read_raw<uint32_t>(stream);
+    if (type == ReferenceType::Extern && hasIndex)
+        throw SnapshotException("Invalid reference to a host object");
+
+    return Reference { type, hasIndex ? std::optional(index) : std::nullopt, nullptr };
+}
+
+// The instance calls through these without checking, so an index from the file must name one of its functions
+static Reference restore_reference(Reference reference, RealModule& instance, uint32_t functionCount)
+{
+    if (reference.type == ReferenceType::Function && reference.index && *reference.index >= functionCount)
+        throw SnapshotException("Invalid function reference");
+
+    reference.module = &instance;
+    return reference;
+}
+
+static void write_value(std::vector<uint8_t>& bytes, const Value& value, Type type, const RealModule& instance)
+{
+    write_raw(bytes, type);
+    switch (type)
+    {
+        case Type::i32:
+            write_raw(bytes, value.get<uint32_t>());
+            break;
+        case Type::i64:
+            write_raw(bytes, value.get<uint64_t>());
+            break;
+        case Type::f32:
+            write_raw(bytes, value.get<float>());
+            break;
+        case Type::f64:
+            write_raw(bytes, value.get<double>());
+            break;
+        case Type::v128:
+            write_raw(bytes, value.get<uint128_t>());
+            break;
+        case Type::funcref:
+        case Type::externref:
+            write_reference(bytes, value.get<Reference>(), instance);
+            break;
+        default:
+            std::unreachable();
+    }
+}
+
+static Value read_value(Stream& stream)
+{
+    switch (read_raw<Type>(stream))
+    {
+        case Type::i32:
+            return read_raw<uint32_t>(stream);
+        case Type::i64:
+            return read_raw<uint64_t>(stream);
+        case Type::f32:
+            return read_raw<float>(stream);
+        case Type::f64:
+            return read_raw<double>(stream);
+        case Type::v128:
+            return read_raw<uint128_t>(stream);
+        case Type::funcref:
+        case Type::externref:
+            return read_reference(stream);
+        default:
+            throw SnapshotException("Invalid global type");
+    }
+}
+
+static void write_bits(std::vector<uint8_t>& bytes, uint32_t count, const auto& is_set)
+{
+    write_raw<uint32_t>(bytes, count);
+    for (uint32_t i = 0; i < count; i++)
+        write_raw<uint8_t>(bytes, is_set(i));
+}
+
+static std::vector<bool> read_bits(Stream& stream)
+{
+    // Every bit takes a byte, so a damaged count fails here instead of allocating up to 4G bits
+    const uint32_t count = read_raw<uint32_t>(stream);
+    if (count > stream.size() - stream.offset())
+        throw SnapshotException("Invalid segment count");
+
+    std::vector<bool> bits(count);
+    for (size_t i = 0; i < bits.size(); i++)
+        bits[i] = read_raw<uint8_t>(stream) != 0;
+    return bits;
+}
+
+void Snapshot::write(RealModule& instance, const std::string& path)
+{
+    const auto file = instance.wasm_file();
+
+    std::vector<uint8_t> header;
+    write_raw(header, MAGIC);
+    write_raw(header, VERSION);
+    // Header size and checksum, filled in once the rest of the header is written
+    const size_t checksumOffset = header.size();
+    write_raw<uint64_t>(header, 0);
+    write_raw<uint64_t>(header, 0);
+    write_raw(header, file->contentHash);
+
+    const uint32_t importedGlobalCount = file->get_import_count_of_type(WasmFile::ImportType::Global);
+    write_raw<uint32_t>(header, file->globals.size());
+    for (size_t i = 0; i < file->globals.size(); i++)
+    {
+        const auto global = instance.get_global(importedGlobalCount + i);
+        write_value(header, global->get(), global->type(), instance);
+    }
+
+    const uint32_t importedTableCount = file->get_import_count_of_type(WasmFile::ImportType::Table);
+    write_raw<uint32_t>(header, file->tables.size());
+    for (size_t i = 0; i < file->tables.size(); i++)
+    {
+        const auto* table = instance.get_table(importedTableCount + i);
+        write_raw<uint64_t>(header, table->size());
+        for (uint64_t element = 0; element < table->size(); element++)
+            write_reference(header, table->unsafe_get(element), instance);
+    }
+
+    write_bits(header, file->elements.size(), [&](uint32_t index) { return instance.is_element_dropped(index); });
+    write_bits(header, file->dataBlocks.size(), [&](uint32_t index) { return instance.is_data_dropped(index); });
+
+    // Memory contents come after the header, each one starting on a page boundary so it can be mapped from the file
+    const uint32_t importedMemoryCount = file->get_import_count_of_type(WasmFile::ImportType::Memory);
+    std::vector<const Memory*> memories;
+    for (size_t i = 0; i < file->memories.size(); i++)
+        memories.push_back(instance.get_memory(importedMemoryCount + i));
+
+    const auto align = [](uint64_t offset) { return (offset + WASM_PAGE_SIZE - 1) / WASM_PAGE_SIZE * WASM_PAGE_SIZE; };
+
+    uint64_t fileSize = align(header.size() + sizeof(uint32_t) + memories.size() * 2 * sizeof(uint64_t));
+    std::vector<uint64_t> memoryOffsets;
+
+    write_raw<uint32_t>(header, memories.size());
+    for (const auto* memory : memories)
+    {
+        const uint64_t size = memory->size() * WASM_PAGE_SIZE;
+        write_raw(header, size);
+        write_raw(header, fileSize);
+        memoryOffsets.push_back(fileSize);
+        fileSize += size;
+    }
+
+    // Memory contents aren't covered, hashing them would touch every page of every restored instance
+    const uint64_t headerSize = header.size();
+    const uint64_t checksum = fnv1a_hash(header.data() + checksumOffset + 2 * sizeof(uint64_t), headerSize - checksumOffset - 2 * sizeof(uint64_t));
+    memcpy(header.data() + checksumOffset, &headerSize, sizeof(headerSize));
+    memcpy(header.data() + checksumOffset + sizeof(headerSize), &checksum, sizeof(checksum));
+
+    auto temporaryPath = std::filesystem::path(path);
+    temporaryPath += ".tmp";
+    {
+        std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+        // Pages that were never written to are left as holes, so they don't take up space in the file either
+        static const std::array<uint8_t, WASM_PAGE_SIZE> zeroPage {};
+        for (size_t i = 0; i < memories.size(); i++)
+        {
+            const uint64_t size = memories[i]->size() * WASM_PAGE_SIZE;
+            for (uint64_t offset = 0; offset < size; offset += WASM_PAGE_SIZE)
+            {
+                const auto* page = memories[i]->data() + offset;
+                if (memcmp(page, zeroPage.data(), WASM_PAGE_SIZE) == 0)
+                    continue;
+
+                out.seekp(memoryOffsets[i] + offset);
+                out.write(reinterpret_cast<const char*>(page), WASM_PAGE_SIZE);
+            }
+        }
+
+        if (!out)
+            throw SnapshotException(std::format("Failed to write {}", temporaryPath.string()));
+    }
+
+    std::error_code error;
+    std::filesystem::resize_file(temporaryPath, fileSize, error);
+    if (!error)
+        std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+        throw SnapshotException(std::format("Failed to write {}: {}", path, error.message()));
+}
+
+Ref<Snapshot> Snapshot::load(const std::string& path)
+{
+    auto snapshot = MakeRef<Snapshot>();
+
+    try
+    {
+        snapshot->m_mapping = MakeRef<FileMapping>(path);
+
+        const auto bytes = snapshot->m_mapping->bytes();
+        MemoryStream stream(bytes);
+
+        if (read_raw<uint64_t>(stream) != MAGIC)
+            throw SnapshotException("Not a snapshot");
+        if (read_raw<uint32_t>(stream) != VERSION)
+            throw SnapshotException("Unsupported snapshot version");
+
+        // Damage anywhere in the header is caught before anything is read from it
+        const auto headerSize = read_raw<uint64_t>(stream);
+        const auto checksum = read_raw<uint64_t>(stream);
+        if (headerSize < stream.offset() || headerSize > bytes.size() || checksum != fnv1a_hash(bytes.data() + stream.offset(), headerSize - stream.offset()))
+            throw SnapshotException("Snapshot is damaged");
+
+        snapshot->m_content_hash = read_raw<uint64_t>(stream);
+
+        const uint32_t globalCount = read_raw<uint32_t>(stream);
+        for (uint32_t i = 0; i < globalCount; i++)
+            snapshot->m_globals.push_back(read_value(stream));
+
+        const uint32_t tableCount = read_raw<uint32_t>(stream);
+        for (uint32_t i = 0; i < tableCount; i++)
+        {
+            auto& table = snapshot->m_tables.emplace_back();
+            const auto size = read_raw<uint64_t>(stream);
+            if (size > stream.size())
+                throw SnapshotException("Invalid table size");
+
+            for (uint64_t element = 0; element < size; element++)
+                table.elements.push_back(read_reference(stream));
+        }
+
+        snapshot->m_dropped_elements = read_bits(stream);
+        snapshot->m_dropped_data = read_bits(stream);
+
+        const uint32_t memoryCount = read_raw<uint32_t>(stream);
+        for (uint32_t i = 0; i < memoryCount; i++)
+        {
+            const auto size = read_raw<uint64_t>(stream);
+            const auto offset = read_raw<uint64_t>(stream);
+            if (size % WASM_PAGE_SIZE != 0 || offset % WASM_PAGE_SIZE != 0 || offset > bytes.size() || size > bytes.size() - offset)
+                throw SnapshotException("Invalid memory contents");
+
+            snapshot->m_memories.push_back(bytes.subspan(offset, size));
+        }
+    }
+    catch (const StreamReadException&)
+    {
+        throw SnapshotException(std::format("Failed to read {}", path));
+    }
+
+    return snapshot;
+}
+
+void Snapshot::restore(RealModule& instance) const
+{
+    const auto file = instance.wasm_file();
+
+    if (m_content_hash != file->contentHash)
+        throw SnapshotException("Snapshot was taken from a different module");
+
+    if (m_globals.size() != file->globals.size() || m_tables.size() != file->tables.size() || m_memories.size() != file->memories.size() || m_dropped_elements.size() != file->elements.size() || m_dropped_data.size() != file->dataBlocks.size())
+        throw SnapshotException("Snapshot doesn't match the module");
+
+    const uint32_t functionCount = file->get_import_count_of_type(WasmFile::ImportType::Function) + file->functionTypeIndexes.size();
+
+    const uint32_t importedGlobalCount = file->get_import_count_of_type(WasmFile::ImportType::Global);
+    for (size_t i = 0; i < m_globals.size(); i++)
+    {
+        const auto global = instance.get_global(importedGlobalCount + i);
+
+        auto value = m_globals[i];
+        if (value.get_type() != global->type())
+            throw SnapshotException("Snapshot doesn't match the module");
+        if (value.holds_alternative<Reference>())
+            value = restore_reference(value.get<Reference>(), instance, functionCount);
+
+        global->set(value);
+    }
+
+    const uint32_t importedTableCount = file->get_import_count_of_type(WasmFile::ImportType::Table);
+    for (size_t i = 0; i < m_tables.size(); i++)
+    {
+        auto* table = instance.get_table(importedTableCount + i);
+        const auto& elements = m_tables[i].elements;
+        if (elements.size() < table->size() || (table->max() && elements.size() > *table->max()))
+            throw SnapshotException("Snapshot doesn't match the module");
+
+        const auto referenceType = get_reference_type_from_reftype(table->type());
+        if (std::ranges::any_of(elements, [&](const Reference& reference) { return reference.type != referenceType; }))
+            throw SnapshotException("Snapshot doesn't match the module");
+
+        table->grow(elements.size() - table->size(), Reference { referenceType, {}, &instance });
+        for (uint64_t element = 0; element < elements.size(); element++)
+            table->unsafe_set(element, restore_reference(elements[element], instance, functionCount));
+    }
+
+    const uint32_t importedMemoryCount = file->get_import_count_of_type(WasmFile::ImportType::Memory);
+    for (size_t i = 0; i < m_memories.size(); i++)
+    {
+        auto* memory = instance.get_memory(importedMemoryCount + i);
+        const uint64_t pages = m_memories[i].size() / WASM_PAGE_SIZE;
+        if (pages < memory->size() || (memory->max() && pages > *memory->max()))
+            throw SnapshotException("Snapshot doesn't match the module");
+
+        memory->grow(pages - memory->size());
+        if (!m_memories[i].empty())
+            memory->initialize(0, m_memories[i], m_mapping.get());
+    }
+
+    for (uint32_t index = 0; index < m_dropped_elements.size(); index++)
+        if (m_dropped_elements[index])
+            instance.drop_element(index);
+
+    for (uint32_t index = 0; index < m_dropped_data.size(); index++)
+        if (m_dropped_data[index])
+            instance.drop_data(index);
+}
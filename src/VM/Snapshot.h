@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Module.h"
+#include "Util/Util.h"
+#include "Value.h"
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+class FileMapping;
+
+// State of an instance after it initialized itself: its globals, tables, memories and dropped segments. Instances
+// restored from a snapshot map the memory contents copy-on-write, so pages are shared until they're written to.
+class Snapshot
+{
+public:
+    static constexpr uint64_t MAGIC = 0x544f4853504e5341; // "ASNPSHOT"
+    static constexpr uint32_t VERSION = 2;
+
+    // Only what the instance owns is written, imported globals, tables and memories belong to other modules
+    static void write(RealModule& instance, const std::string& path);
+    static Ref<Snapshot> load(const std::string& path);
+
+    // Replaces the state of a freshly created instance of the module the snapshot was taken from
+    void restore(RealModule& instance) const;
+
+private:
+    struct TableSnapshot
+    {
+        // Function references point into the instance the snapshot is restored into
+        std::vector<Reference> elements;
+    };
+
+    Ref<FileMapping> m_mapping;
+    uint64_t m_content_hash { 0 };
+
+    std::vector<Value> m_globals;
+    std::vector<TableSnapshot> m_tables;
+    // Point into the mapping and start on a wasm page boundary of the file
+    std::vector<std::span<const uint8_t>> m_memories;
+    std::vector<bool> m_dropped_elements;
+    std::vector<bool> m_dropped_data;
+};
+
+class SnapshotException
+{
+public:
+    SnapshotException(std::string_view reason)
+        : m_reason(reason)
+    {
+    }
+
+    std::string reason() const { return m_reason; }
+
+private:
+    std::string m_reason;
+};
@@ -1,6 +1,10 @@
 #include "Type.h"
+#include "Trap.h"
 #include "Value.h"
 #include "WasmFile/WasmFile.h"
+#include <cstdint>
+#include <format>
+#include <stdexcept>
 #include <utility>
 
 Type read_type_from_stream(Stream& stream)
@@ -39,6 +43,53 @@ Value default_value_for_type(Type type)
     }
 };
 
+// Base 0 would read a leading zero as octal, so only an explicit prefix makes a number hexadecimal
+static bool has_hex_prefix(const std::string& text)
+{
+    const size_t digits = text.starts_with('-') || text.starts_with('+') ? 1 : 0;
+    return text.size() > digits + 1 && text[digits] == '0' && (text[digits + 1] == 'x' || text[digits + 1] == 'X');
+}
+
+Value value_from_string(const std::string& text, Type type)
+{
+    const int base = has_hex_prefix(text) ? 16 : 10;
+    size_t end = 0;
+
+    const auto check_whole_text_used = [&]() {
+        if (end != text.size())
+            throw std::invalid_argument(text);
+    };
+
+    switch (type)
+    {
+        case Type::i32: {
+            const long long value = std::stoll(text, &end, base);
+            check_whole_text_used();
+            // Signed and unsigned spellings are both fine, they end up as the same bits
+            if (value < INT32_MIN || value > UINT32_MAX)
+                throw std::out_of_range(text);
+            return static_cast<uint32_t>(value);
+        }
+        case Type::i64: {
+            const uint64_t value = text.starts_with('-') ? static_cast<uint64_t>(std::stoll(text, &end, base)) : std::stoull(text, &end, base);
+            check_whole_text_used();
+            return value;
+        }
+        case Type::f32: {
+            const float value = std::stof(text, &end);
+            check_whole_text_used();
+            return value;
+        }
+        case Type::f64: {
+            const double value = std::stod(text, &end);
+            check_whole_text_used();
+            return value;
+        }
+        default:
+            throw Trap(std::format("Values of type {} can't be given as text", get_type_name(type)));
+    }
+}
+
 ReferenceType get_reference_type_from_reftype(Type type)
 {
     if (type == Type::funcref)
@@ -48,6 +48,9 @@ enum class ReferenceType;
 Type read_type_from_stream(Stream&);
 bool is_valid_type(Type type);
 Value default_value_for_type(Type type);
+// Decimal or 0x prefixed for integers, anything std::stod takes for floats. Throws std::logic_error for text that
+// isn't a number as a whole or doesn't fit the type, and Trap for types that can't be written as text.
+Value value_from_string(const std::string& text, Type type);
 ReferenceType get_reference_type_from_reftype(Type type);
 std::string get_type_name(Type type);
 bool is_reference_type(Type type);
@@ -1,5 +1,7 @@
 #include "VM.h"
 #include "Operators.h"
+#include "Profile.h"
+#include "Snapshot.h"
 #include "Util/Util.h"
 #include "VM/Module.h"
 #include "VM/Type.h"
@@ -10,7 +12,47 @@
 #include <cstring>
 #include <utility>
 
+VM::Context& VM::context()
+{
+    if (!m_context) [[unlikely]]
+    {
+        thread_local Context defaultContext;
+        m_context = &defaultContext;
+    }
+    return *m_context;
+}
+
+void VM::set_context(Context* context)
+{
+    if (m_frame)
+        throw Trap("Can't switch contexts while a function is running");
+
+    m_context = context;
+}
+
 Ref<RealModule> VM::load_module(Ref<WasmFile::WasmFile> file, bool dont_make_current)
+{
+    auto new_module = create_instance(file);
+    initialize_instance(new_module);
+
+    if (!dont_make_current)
+        context().m_current_module = new_module;
+
+    return new_module;
+}
+
+Ref<RealModule> VM::load_module(Ref<WasmFile::WasmFile> file, const Snapshot& snapshot, bool dont_make_current)
+{
+    auto new_module = create_instance(file);
+    snapshot.restore(*new_module);
+
+    if (!dont_make_current)
+        context().m_current_module = new_module;
+
+    return new_module;
+}
+
+Ref<RealModule> VM::create_instance(Ref<WasmFile::WasmFile> file)
 {
     auto new_module = MakeRef<RealModule>(m_next_module_id++, file);
 
@@ -50,14 +92,25 @@ Ref<RealModule> VM::load_module(Ref<WasmFile::WasmFile> file, bool dont_make_cur
         }
     }
 
+    const uint32_t importedFunctionCount = file->get_import_count_of_type(WasmFile::ImportType::Function);
     for (size_t i = 0; i < new_module->wasm_file()->functionTypeIndexes.size(); i++)
     {
         auto* type = &new_module->wasm_file()->functionTypes[new_module->wasm_file()->functionTypeIndexes[i]];
         auto* code = &new_module->wasm_file()->codeBlocks[i];
-        auto function = MakeRef<RealFunction>(type, code, new_module);
+        auto function = MakeRef<RealFunction>(type, code, new_module, static_cast<uint32_t>(importedFunctionCount + i), !file->lazyCode.empty());
         new_module->add_function(function);
     }
 
+    new_module->seed_indirect_call_caches();
+
+    if (const auto& profile = context().m_profile)
+    {
+        // Sized up front, running functions keep pointers into it
+        auto& moduleProfile = profile->module(file->contentHash);
+        moduleProfile.ensure_function_count(importedFunctionCount + file->codeBlocks.size());
+        new_module->set_profile(&moduleProfile);
+    }
+
     for (const auto& global : new_module->wasm_file()->globals)
         new_module->add_global(MakeRef<Global>(global.type, global.mutability, run_bare_code(new_module, global.initCode)));
 
@@ -67,16 +120,45 @@ Ref<RealModule> VM::load_module(Ref<WasmFile::WasmFile> file, bool dont_make_cur
     for (const auto& tableInfo : new_module->wasm_file()->tables)
         new_module->add_table(MakeRef<Table>(tableInfo, Reference { get_reference_type_from_reftype(tableInfo.refType), {}, new_module.get() }));
 
-    for (auto& element : new_module->wasm_file()->elements)
+    return new_module;
+}
+
+void VM::reset_module(Ref<RealModule> instance)
+{
+    const auto file = instance->wasm_file();
+
+    // Imported objects belong to other modules, only the ones this instance created are reset
+    const uint32_t importedGlobalCount = file->get_import_count_of_type(WasmFile::ImportType::Global);
+    for (size_t i = 0; i < file->globals.size(); i++)
+        instance->get_global(importedGlobalCount + i)->set(run_bare_code(instance, file->globals[i].initCode));
+
+    const uint32_t importedMemoryCount = file->get_import_count_of_type(WasmFile::ImportType::Memory);
+    for (size_t i = 0; i < file->memories.size(); i++)
+        instance->get_memory(importedMemoryCount + i)->reset();
+
+    const uint32_t importedTableCount = file->get_import_count_of_type(WasmFile::ImportType::Table);
+    for (size_t i = 0; i < file->tables.size(); i++)
+        instance->get_table(importedTableCount + i)->reset(Reference { get_reference_type_from_reftype(file->tables[i].refType), {}, instance.get() });
+
+    instance->restore_segments();
+    initialize_instance(instance);
+}
+
+void VM::initialize_instance(Ref<RealModule> instance)
+{
+    // The module is shared by all of its instances, so it's never written to here
+    const auto& elements = instance->wasm_file()->elements;
+    for (uint32_t index = 0; index < elements.size(); index++)
     {
+        const auto& element = elements[index];
         if (element.mode == WasmFile::ElementMode::Active)
         {
-            const auto table = new_module->get_table(element.table);
+            const auto table = instance->get_table(element.table);
 
-            Value beginValue = run_bare_code(new_module, element.expr);
+            Value beginValue = run_bare_code(instance, element.expr);
             uint64_t begin = table->address_type() == AddressType::i64 ? beginValue.get<uint64_t>() : beginValue.get<uint32_t>();
 
-            size_t size = element.functionIndexes.empty() ? element.referencesExpr.size() : element.functionIndexes.size();
+            size_t size = element.functionIndexes.empty() ? element.reference_count() : element.functionIndexes.size();
 
             if (begin + size > table->size())
                 throw Trap("Out of bounds element");
@@ -85,60 +167,57 @@ Ref<RealModule> VM::load_module(Ref<WasmFile::WasmFile> file, bool dont_make_cur
             {
                 if (element.functionIndexes.empty())
                 {
-                    Value reference = run_bare_code(new_module, element.referencesExpr[i]);
+                    Value reference = run_bare_code(instance, element.reference_expression(i));
                     table->set(begin + i, reference.get<Reference>());
                 }
                 else
                 {
-                    table->set(begin + i, Reference { ReferenceType::Function, element.functionIndexes[i], new_module.get() });
+                    table->set(begin + i, Reference { ReferenceType::Function, element.functionIndexes[i], instance.get() });
                 }
             }
         }
 
         if (element.mode == WasmFile::ElementMode::Active || element.mode == WasmFile::ElementMode::Declarative)
-            element = WasmFile::Element();
+            instance->drop_element(index);
     }
 
-    for (auto& data : new_module->wasm_file()->dataBlocks)
+    const auto& dataBlocks = instance->wasm_file()->dataBlocks;
+    for (uint32_t index = 0; index < dataBlocks.size(); index++)
     {
+        const auto& data = dataBlocks[index];
         if (data.mode == WasmFile::ElementMode::Active)
         {
-            const auto* memory = new_module->get_memory(data.memoryIndex);
+            auto* memory = instance->get_memory(data.memoryIndex);
 
-            Value beginValue = run_bare_code(new_module, data.expr);
+            Value beginValue = run_bare_code(instance, data.expr);
             uint64_t begin = memory->address_type() == AddressType::i64 ? beginValue.get<uint64_t>() : beginValue.get<uint32_t>();
 
             if (memory->check_outside_bounds(begin, data.data.size()))
                 throw Trap("Out of bounds data");
 
-            memcpy(memory->data() + begin, data.data.data(), data.data.size());
+            memory->initialize(begin, data.data, instance->wasm_file()->mapping.get());
 
-            data = WasmFile::Data();
+            instance->drop_data(index);
         }
     }
 
-    if (auto start_function = new_module->start_function(); start_function.has_value())
+    if (auto start_function = instance->start_function(); start_function.has_value())
         (void)start_function.value()->run({});
-
-    if (!dont_make_current)
-        m_current_module = new_module;
-
-    return new_module;
 }
 
 void VM::register_module(const std::string& name, Ref<Module> module)
 {
-    m_registered_modules[name] = module;
+    context().m_registered_modules[name] = module;
 }
 
 std::vector<Value> VM::run_function(const std::string& name, std::span<const Value> args)
 {
-    return run_function(m_current_module, name, args);
+    return run_function(context().m_current_module, name, args);
 }
 
 std::vector<Value> VM::run_function(const std::string& mod, const std::string& name, std::span<const Value> args)
 {
-    return run_function(m_registered_modules[mod], name, args);
+    return run_function(context().m_registered_modules[mod], name, args);
 }
 
 std::vector<Value> VM::run_function(Ref<Module> mod, const std::string& name, std::span<const Value> args)
@@ -151,15 +230,19 @@ std::vector<Value> VM::run_function(Ref<Module> mod, const std::string& name, st
 
 std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* function, std::span<const Value> args)
 {
-    if (m_frame_stack.size() >= MAX_FRAME_STACK_SIZE)
+    auto& frameStack = context().m_frame_stack;
+    if (frameStack.size() >= MAX_FRAME_STACK_SIZE)
         throw Trap("Frame stack exceeded");
 
-    m_frame_stack.push(m_frame);
+    if (--m_budget <= 0) [[unlikely]]
+        preempt();
+
+    frameStack.push(m_frame);
     m_frame = new Frame(mod);
 
     const auto clean_up_frame = [&]() {
         delete m_frame;
-        m_frame = m_frame_stack.pop();
+        m_frame = frameStack.pop();
     };
 
     DEFER(clean_up_frame());
@@ -167,14 +250,34 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
     if (args.size() != function->type().params.size())
         throw Trap("Invalid argument count passed");
 
+    function->ensure_decoded();
+
     for (const auto& param : args)
         m_frame->locals.push_back(param);
 
     for (const auto local : function->code().locals)
         m_frame->locals.push_back(default_value_for_type(local));
 
+    FunctionProfile* profile = nullptr;
+    const auto enter_profile = [&]() {
+        profile = nullptr;
+        if (auto* moduleProfile = m_frame->mod->profile()) [[unlikely]]
+        {
+            profile = &moduleProfile->functions[function->index()];
+            profile->calls++;
+        }
+    };
+
+    enter_profile();
+
     const auto perform_tail_call = [&](Ref<RealFunction> new_function) {
+        // A tail call never runs into a loop or a new frame, so it has to count as well
+        if (--m_budget <= 0) [[unlikely]]
+            preempt();
+
         function = new_function.get();
+        function->ensure_decoded();
+
         const auto args = m_frame->stack.span_last_n_values(function->type().params.size());
 
         m_frame->locals.clear();
@@ -188,6 +291,8 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
         m_frame->stack.clear();
         m_frame->ip = 0;
         m_frame->mod = function->parent();
+
+        enter_profile();
     };
 
     while (m_frame->ip < function->code().instructions.size())
@@ -201,20 +306,42 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 throw Trap("Unreachable");
             case nop:
             case block:
+                break;
             case loop:
+                // Branches back to a loop run its loop instruction again, so every iteration passes here
+                if (--m_budget <= 0) [[unlikely]]
+                    preempt();
+                if (profile) [[unlikely]]
+                    profile->loopIterations[m_frame->ip - 1]++;
                 break;
             case if_: {
-                const auto& arguments = instruction.get_arguments<IfArguments>();
-
                 uint32_t value = m_frame->stack.pop_as<uint32_t>();
 
+                if (profile) [[unlikely]]
+                    record_branch(profile, value != 0);
+
                 if (value == 0)
-                {
-                    if (arguments.elseLocation.has_value())
-                        m_frame->ip = arguments.elseLocation.value() + 1;
-                    else
-                        m_frame->ip = arguments.endLabel.continuation;
-                }
+                    skip_if_body(instruction.get_arguments<IfArguments>());
+                break;
+            }
+            case if_likely: {
+                uint32_t value = m_frame->stack.pop_as<uint32_t>();
+
+                if (profile) [[unlikely]]
+                    record_branch(profile, value != 0);
+
+                if (value == 0) [[unlikely]]
+                    skip_if_body(instruction.get_arguments<IfArguments>());
+                break;
+            }
+            case if_unlikely: {
+                uint32_t value = m_frame->stack.pop_as<uint32_t>();
+
+                if (profile) [[unlikely]]
+                    record_branch(profile, value != 0);
+
+                if (value == 0) [[likely]]
+                    skip_if_body(instruction.get_arguments<IfArguments>());
                 break;
             }
             case else_:
@@ -226,10 +353,36 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
             case br:
                 branch_to_label(instruction.get_arguments<Label>());
                 break;
-            case br_if:
-                if (m_frame->stack.pop_as<uint32_t>() != 0)
+            case br_if: {
+                uint32_t value = m_frame->stack.pop_as<uint32_t>();
+
+                if (profile) [[unlikely]]
+                    record_branch(profile, value != 0);
+
+                if (value != 0)
+                    branch_to_label(instruction.get_arguments<Label>());
+                break;
+            }
+            case br_if_likely: {
+                uint32_t value = m_frame->stack.pop_as<uint32_t>();
+
+                if (profile) [[unlikely]]
+                    record_branch(profile, value != 0);
+
+                if (value != 0) [[likely]]
+                    branch_to_label(instruction.get_arguments<Label>());
+                break;
+            }
+            case br_if_unlikely: {
+                uint32_t value = m_frame->stack.pop_as<uint32_t>();
+
+                if (profile) [[unlikely]]
+                    record_branch(profile, value != 0);
+
+                if (value != 0) [[unlikely]]
                     branch_to_label(instruction.get_arguments<Label>());
                 break;
+            }
             case br_table: {
                 const auto& arguments = instruction.get_arguments<BranchTableArguments>();
                 uint32_t index = m_frame->stack.pop_as<uint32_t>();
@@ -245,29 +398,9 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
             case call:
                 call_function(mod->get_function(instruction.get_arguments<uint32_t>()));
                 break;
-            case call_indirect: {
-                const auto& arguments = instruction.get_arguments<CallIndirectArguments>();
-
-                const auto* table = mod->get_table(arguments.tableIndex);
-                uint64_t index = pop_address(table);
-
-                const auto reference = table->get(index);
-
-                if (!reference.index)
-                    throw Trap("Call indirect on null reference");
-
-                if (reference.type != ReferenceType::Function)
-                    throw Trap("Call indirect on non-function reference");
-
-                auto* module = reference.module ? reference.module : mod.get();
-                auto function = module->get_function(*reference.index);
-
-                if (function->type() != module->wasm_file()->functionTypes[arguments.typeIndex])
-                    throw Trap("Invalid call indirect type");
-
-                call_function(function);
+            case call_indirect:
+                call_function(resolve_indirect_call(instruction.get_arguments<CallIndirectArguments>(), profile));
                 break;
-            }
 
             case return_call: {
                 const auto& new_function = mod->get_function(instruction.get_arguments<uint32_t>());
@@ -283,24 +416,7 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 }
             }
             case return_call_indirect: {
-                const auto& arguments = instruction.get_arguments<CallIndirectArguments>();
-
-                const auto* table = mod->get_table(arguments.tableIndex);
-                uint64_t index = pop_address(table);
-
-                const auto reference = table->get(index);
-
-                if (!reference.index)
-                    throw Trap("Call indirect on null reference");
-
-                if (reference.type != ReferenceType::Function)
-                    throw Trap("Call indirect on non-function reference");
-
-                auto* module = reference.module ? reference.module : mod.get();
-                auto new_function = module->get_function(*reference.index);
-
-                if (new_function->type() != module->wasm_file()->functionTypes[arguments.typeIndex])
-                    throw Trap("Invalid call indirect type");
+                const auto new_function = resolve_indirect_call(instruction.get_arguments<CallIndirectArguments>(), profile);
 
                 if (is<RealFunction>(new_function))
                 {
@@ -445,8 +561,9 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 uint64_t destination = pop_address(memory);
 
                 const auto& data = mod->wasm_file()->dataBlocks[arguments.dataIndex];
+                const uint64_t dataSize = mod->is_data_dropped(arguments.dataIndex) ? 0 : data.data.size();
 
-                if (static_cast<uint64_t>(source) + count > data.data.size())
+                if (static_cast<uint64_t>(source) + count > dataSize)
                     throw Trap("Out of bounds memory init");
 
                 if (memory->check_outside_bounds(destination, count))
@@ -456,7 +573,7 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 break;
             }
             case data_drop:
-                mod->wasm_file()->dataBlocks[instruction.get_arguments<uint32_t>()] = WasmFile::Data();
+                mod->drop_data(instruction.get_arguments<uint32_t>());
                 break;
             case memory_copy: {
                 const auto& arguments = instruction.get_arguments<MemoryCopyArguments>();
@@ -506,7 +623,9 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 auto destination = pop_address(table);
 
                 const auto& element = mod->wasm_file()->elements[arguments.elementIndex];
-                size_t elemSize = element.functionIndexes.empty() ? element.referencesExpr.size() : element.functionIndexes.size();
+                size_t elemSize = element.functionIndexes.empty() ? element.reference_count() : element.functionIndexes.size();
+                if (mod->is_element_dropped(arguments.elementIndex))
+                    elemSize = 0;
 
                 if (static_cast<uint64_t>(source) + count > elemSize || static_cast<uint64_t>(destination) + count > table->size())
                     throw Trap("Out of bounds table init");
@@ -515,7 +634,7 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 {
                     if (element.functionIndexes.empty())
                     {
-                        Value reference = run_bare_code(mod, element.referencesExpr[source + i]);
+                        Value reference = run_bare_code(mod, element.reference_expression(source + i));
                         table->unsafe_set(destination + i, reference.get<Reference>());
                     }
                     else
@@ -524,7 +643,7 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
                 break;
             }
             case elem_drop:
-                mod->wasm_file()->elements[instruction.get_arguments<uint32_t>()] = WasmFile::Element();
+                mod->drop_element(instruction.get_arguments<uint32_t>());
                 break;
             case table_copy: {
                 const auto& arguments = instruction.get_arguments<TableCopyArguments>();
@@ -795,7 +914,7 @@ std::vector<Value> VM::run_function(Ref<RealModule> mod, const RealFunction* fun
 
 Ref<Module> VM::get_registered_module(const std::string& name)
 {
-    return m_registered_modules[name];
+    return context().m_registered_modules[name];
 }
 
 Value VM::run_bare_code(Ref<RealModule> mod, std::span<const Instruction> instructions)
@@ -870,6 +989,17 @@ Value VM::run_bare_code(Ref<RealModule> mod, std::span<const Instruction> instru
     return stack.pop();
 }
 
+void VM::preempt()
+{
+    if (!m_preemption_handler)
+    {
+        m_budget = std::numeric_limits<int64_t>::max();
+        return;
+    }
+
+    m_preemption_handler();
+}
+
 Memory* VM::get_current_frame_memory_0()
 {
     // FIXME: Verify there is a memory 0
@@ -930,6 +1060,58 @@ void VM::branch_to_label(Label label)
     m_frame->ip = label.continuation;
 }
 
+RELEASE_INLINE void VM::skip_if_body(const IfArguments& arguments)
+{
+    if (arguments.elseLocation.has_value())
+        m_frame->ip = arguments.elseLocation.value() + 1;
+    else
+        m_frame->ip = arguments.endLabel.continuation;
+}
+
+RELEASE_INLINE void VM::record_branch(FunctionProfile* profile, bool taken)
+{
+    auto& counts = profile->branches[m_frame->ip - 1];
+    if (taken)
+        counts.taken++;
+    else
+        counts.notTaken++;
+}
+
+RELEASE_INLINE Ref<Function> VM::resolve_indirect_call(const CallIndirectArguments& arguments, FunctionProfile* profile)
+{
+    const auto& mod = m_frame->mod;
+
+    const auto* table = mod->get_table(arguments.tableIndex);
+    uint64_t index = pop_address(table);
+
+    const auto reference = table->get(index);
+
+    if (!reference.index)
+        throw Trap("Call indirect on null reference");
+
+    if (reference.type != ReferenceType::Function)
+        throw Trap("Call indirect on non-function reference");
+
+    auto* module = reference.module ? reference.module : mod.get();
+    auto function = module->get_function(*reference.index);
+
+    // Functions of an instance never change, so a hit means this exact target already passed the type check here
+    auto& cache = mod->indirect_call_cache(arguments.cacheIndex);
+    if (cache.moduleId != module->id() || cache.functionIndex != *reference.index) [[unlikely]]
+    {
+        if (function->type() != module->wasm_file()->functionTypes[arguments.typeIndex])
+            throw Trap("Invalid call indirect type");
+
+        cache = RealModule::IndirectCallCache { .moduleId = module->id(), .functionIndex = *reference.index };
+    }
+
+    // Function indexes are only meaningful within the profiled module
+    if (profile && module == mod.get()) [[unlikely]]
+        profile->indirectCallTargets[m_frame->ip - 1][*reference.index]++;
+
+    return function;
+}
+
 void VM::call_function(Ref<Function> function)
 {
     const auto args = m_frame->stack.pop_n_values(function->type().params.size());
@@ -1026,7 +1208,7 @@ Value VM::to_address(uint64_t value, const Structure* structure)
 
 VM::ImportLocation VM::find_import(std::string_view environment, std::string_view name, WasmFile::ImportType type)
 {
-    for (const auto& [module_name, module] : m_registered_modules)
+    for (const auto& [module_name, module] : context().m_registered_modules)
     {
         if (module_name == environment)
         {
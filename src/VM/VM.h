@@ -8,15 +8,22 @@
 #include "ValueStack.h"
 #include "WasmFile/Parser.h"
 #include "WasmFile/WasmFile.h"
+#include <atomic>
 #include <cstdint>
+#include <limits>
 #include <span>
 #include <vector>
 
+struct FunctionProfile;
+class Profile;
+class Snapshot;
+
 constexpr uint64_t WASM_PAGE_SIZE = 65536;
 constexpr uint32_t MAX_FRAME_STACK_SIZE = 256;
 
 class VM
 {
+    friend class Scheduler;
     friend class WASIModule;
 
 public:
@@ -33,7 +40,44 @@ public:
         }
     };
 
+    // Owns the modules loaded and registered in it and the frames of the calls running in it. Every thread runs in a
+    // context of its own, so instances in different contexts execute concurrently without sharing any state.
+    class Context
+    {
+    public:
+        Context() = default;
+
+        // Make noncopyable and nonmovable
+        Context(const Context& other) = delete;
+        Context& operator=(const Context& other) = delete;
+
+        Context(Context&& other) = delete;
+        Context& operator=(Context&& other) = delete;
+
+        // Makes the modules registered in the other context importable here too, like host modules for worker threads
+        void share_registered_modules(const Context& other) { m_registered_modules = other.m_registered_modules; }
+
+    private:
+        friend class VM;
+
+        Stack<Frame*> m_frame_stack;
+        Ref<Module> m_current_module;
+        StringMap<Ref<Module>> m_registered_modules;
+        Ref<Profile> m_profile;
+    };
+
+    // The context of the calling thread, every thread starts out in a default context of its own
+    static Context& context();
+    // Switches the calling thread to another context, nullptr switches back to its default one.
+    // Has to be called while no function is running on the thread.
+    static void set_context(Context* context);
+
+    // Creates a new instance of the module, the file is left as it is and can be instantiated any number of times
     static Ref<RealModule> load_module(Ref<WasmFile::WasmFile> file, bool dont_make_current = false);
+    // Skips the active segments and the start function, the instance starts out in the state of the snapshot instead
+    static Ref<RealModule> load_module(Ref<WasmFile::WasmFile> file, const Snapshot& snapshot, bool dont_make_current = false);
+    // Puts an instance back into the state load_module left it in, reusing its memories, tables and globals
+    static void reset_module(Ref<RealModule> instance);
     static void register_module(const std::string& name, Ref<Module> module);
 
     static std::vector<Value> run_function(const std::string& name, std::span<const Value> args);
@@ -43,12 +87,22 @@ public:
 
     static Ref<Module> get_registered_module(const std::string& name);
 
-    static Ref<Module> current_module() { return m_current_module; }
+    static Ref<Module> current_module() { return context().m_current_module; }
+
+    // Modules loaded in the current context while a profile is set record their execution counts into it
+    static void set_profile(Ref<Profile> profile) { context().m_profile = profile; }
 
 private:
+    // Links the imports and creates the functions, globals, memories and tables of a new instance
+    static Ref<RealModule> create_instance(Ref<WasmFile::WasmFile> file);
+    // Applies the active segments and runs the start function
+    static void initialize_instance(Ref<RealModule> instance);
+
     static Value run_bare_code(Ref<RealModule> mod, std::span<const Instruction> instructions);
 
     static Memory* get_current_frame_memory_0();
+    // Called once the budget ran out, hands the thread to the scheduler if there is one
+    static void preempt();
 
     template <typename LhsType, typename RhsType, Value(function)(LhsType, RhsType)>
     static void run_binary_operation();
@@ -59,7 +113,10 @@ private:
     template <typename ActualType, IsValueType StackType>
     static void run_store_instruction(const WasmFile::MemArg& memArg);
     static void branch_to_label(Label label);
+    static void skip_if_body(const IfArguments& arguments);
+    static void record_branch(FunctionProfile* profile, bool taken);
     static void call_function(Ref<Function> function);
+    static Ref<Function> resolve_indirect_call(const CallIndirectArguments& arguments, FunctionProfile* profile);
 
     template <IsVector VectorType, bool Zero>
     static void run_load_vector_element_instruction(const WasmFile::MemArg& megArg);
@@ -81,9 +138,11 @@ private:
 
     static ImportLocation find_import(std::string_view environment, std::string_view name, WasmFile::ImportType type);
 
-    static inline Frame* m_frame;
-    static inline Stack<Frame*> m_frame_stack;
-    static inline size_t m_next_module_id = 0;
-    static inline Ref<Module> m_current_module;
-    static inline StringMap<Ref<Module>> m_registered_modules;
+    // The frame of the call running on this thread, kept out of the context since it's used by every instruction
+    static inline thread_local Frame* m_frame { nullptr };
+    static inline thread_local Context* m_context { nullptr };
+    // Loop iterations and calls left until the running call yields, only ever runs out on scheduler workers
+    static inline thread_local int64_t m_budget { std::numeric_limits<int64_t>::max() };
+    static inline thread_local void (*m_preemption_handler)() { nullptr };
+    static inline std::atomic<size_t> m_next_module_id { 0 };
 };
@@ -1,9 +1,13 @@
 #include "WASI.h"
+#include "Util/ThreadPool.h"
+#include "VM/AsyncFunction.h"
 #include "VM/Module.h"
+#include "VM/Scheduler.h"
 #include "VM/VM.h"
 #include "VM/Value.h"
 #include <cassert>
 #include <cstring>
+#include <exception>
 #include <functional>
 #include <print>
 #include <sys/stat.h>
@@ -89,6 +93,14 @@ private:
     WasmFile::FunctionType m_type;
 };
 
+// Runs the system calls that may block for calls on a scheduler, their worker runs other calls meanwhile.
+// The calls just wait on the kernel, a few threads are enough.
+static ThreadPool& blocking_call_pool()
+{
+    static ThreadPool pool(4);
+    return pool;
+}
+
 WASIModule::WASIModule()
 {
     m_functions["clock_time_get"] = MakeRef<NativeFunction>(
@@ -139,19 +151,43 @@ WASIModule::WASIModule()
         }),
         std::vector { Type::i32, Type::i64, Type::i32, Type::i32 }, Type::i32);
 
-    m_functions["fd_write"] = MakeRef<NativeFunction>(
-        NativeFunction::FunctionType([](std::span<const Value> args) {
-            uint32_t written = 0;
-            const auto memory = VM::get_current_frame_memory_0();
+    m_functions["fd_write"] = MakeRef<AsyncFunction>(
+        AsyncFunction::Implementation([](std::span<const Value> args) -> AsyncFunction::Result {
+            // The guest is suspended until the write is done, so its memory stays where it is
+            uint8_t* memory = VM::get_current_frame_memory_0()->data();
+            const uint32_t fd = args[0].get<uint32_t>();
+            const uint32_t iovs = args[1].get<uint32_t>();
+            const uint32_t iovCount = args[2].get<uint32_t>();
+            const uint32_t result = args[3].get<uint32_t>();
+
+            const auto write_all = [=]() {
+                uint32_t written = 0;
+                IOVector* iov = (IOVector*)(memory + iovs);
 
-            IOVector* iov = (IOVector*)(memory->data() + args[1].get<uint32_t>());
+                for (uint32_t i = 0; i < iovCount; i++)
+                    written += (uint32_t)write(fd, (memory + iov[i].pointer), iov[i].length);
 
-            for (uint32_t i = 0; i < args[2].get<uint32_t>(); i++)
-                written += (uint32_t)write(args[0].get<uint32_t>(), (memory->data() + iov[i].pointer), iov[i].length);
+                memcpy(memory + result, &written, sizeof(written));
 
-            memcpy(memory->data() + args[3].get<uint32_t>(), &written, sizeof(written));
+                return std::vector<Value> { written };
+            };
 
-            return std::vector<Value> { written };
+            if (!Scheduler::can_suspend())
+                return write_all();
+
+            auto call = MakeRef<PendingCall>();
+            // Nothing may escape a task of the pool, the guest traps instead
+            blocking_call_pool().submit([call, write_all]() {
+                try
+                {
+                    call->complete(write_all());
+                }
+                catch (const std::exception& e)
+                {
+                    call->fail(e.what());
+                }
+            });
+            return call;
         }),
         std::vector { Type::i32, Type::i32, Type::i32, Type::i32 }, Type::i32);
 
@@ -0,0 +1,301 @@
+#include "CallGraph.h"
+#include "Opcode.h"
+#include "Parser.h"
+#include <algorithm>
+#include <utility>
+
+static bool is_memory_instruction(Opcode opcode)
+{
+    switch (opcode)
+    {
+        using enum Opcode;
+#define X(opcode, memoryType, targetType) case opcode:
+        ENUMERATE_LOAD_OPERATIONS(X)
+        ENUMERATE_STORE_OPERATIONS(X)
+#undef X
+        case v128_load8_splat:
+        case v128_load16_splat:
+        case v128_load32_splat:
+        case v128_load64_splat:
+        case v128_load32_zero:
+        case v128_load64_zero:
+        case v128_load8_lane:
+        case v128_load16_lane:
+        case v128_load32_lane:
+        case v128_load64_lane:
+        case v128_store8_lane:
+        case v128_store16_lane:
+        case v128_store32_lane:
+        case v128_store64_lane:
+        case memory_size:
+        case memory_grow:
+        case memory_init:
+        case memory_copy:
+        case memory_fill:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static std::optional<uint64_t> constant_offset(const std::vector<Instruction>& expr)
+{
+    if (expr.size() != 2 || expr[1].opcode != Opcode::end)
+        return {};
+
+    if (expr[0].opcode == Opcode::i32_const)
+        return expr[0].get_arguments<uint32_t>();
+    if (expr[0].opcode == Opcode::i64_const)
+        return expr[0].get_arguments<uint64_t>();
+
+    return {};
+}
+
+static std::optional<uint32_t> referenced_function(std::span<const Instruction> expr)
+{
+    if (expr.size() != 2 || expr[1].opcode != Opcode::end || expr[0].opcode != Opcode::ref_func)
+        return {};
+
+    return expr[0].get_arguments<uint32_t>();
+}
+
+CallGraph::CallGraph(WasmFile::WasmFile& wasmFile)
+    : m_wasmFile(wasmFile)
+    , m_imported_function_count(wasmFile.get_import_count_of_type(WasmFile::ImportType::Function))
+{
+    find_constant_tables();
+
+    for (auto& code : wasmFile.codeBlocks)
+        devirtualize_indirect_calls(code);
+
+    update_summaries();
+}
+
+void CallGraph::update_summaries()
+{
+    m_functions.clear();
+    m_functions.resize(m_imported_function_count + m_wasmFile.codeBlocks.size());
+
+    for (uint32_t i = 0; i < m_imported_function_count; i++)
+    {
+        auto& summary = m_functions[i];
+        summary.imported = true;
+        summary.mayGrowMemory = true;
+        summary.touchesMemory = true;
+    }
+
+    for (size_t i = 0; i < m_wasmFile.codeBlocks.size(); i++)
+        collect_summary(m_functions[m_imported_function_count + i], m_wasmFile.codeBlocks[i]);
+
+    propagate_effects();
+}
+
+uint32_t CallGraph::leaf_function_count() const
+{
+    return static_cast<uint32_t>(std::ranges::count_if(m_functions, [](const auto& summary) { return summary.isLeaf; }));
+}
+
+void CallGraph::find_constant_tables()
+{
+    const uint32_t importedTableCount = m_wasmFile.get_import_count_of_type(WasmFile::ImportType::Table);
+
+    // Imported tables can be written by anyone, so they stay unknown
+    m_constant_tables.resize(importedTableCount + m_wasmFile.tables.size());
+    for (size_t i = 0; i < m_wasmFile.tables.size(); i++)
+        m_constant_tables[importedTableCount + i] = ConstantTable { .size = m_wasmFile.tables[i].limits.min, .slots = {} };
+
+    for (const auto& exp : m_wasmFile.exports)
+        if (exp.type == WasmFile::ImportType::Table)
+            m_constant_tables[exp.index].reset();
+
+    // table.grow only appends new slots, so it can't change what an existing slot holds
+    for (const auto& code : m_wasmFile.codeBlocks)
+    {
+        for (const auto& instruction : code.instructions)
+        {
+            switch (instruction.opcode)
+            {
+                using enum Opcode;
+                case table_set:
+                case table_fill:
+                    m_constant_tables[instruction.get_arguments<uint32_t>()].reset();
+                    break;
+                case table_copy:
+                    m_constant_tables[instruction.get_arguments<TableCopyArguments>().destination].reset();
+                    break;
+                case table_init:
+                    m_constant_tables[instruction.get_arguments<TableInitArguments>().tableIndex].reset();
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    for (const auto& element : m_wasmFile.elements)
+    {
+        if (element.mode != WasmFile::ElementMode::Active || !m_constant_tables[element.table].has_value())
+            continue;
+
+        auto& table = m_constant_tables[element.table].value();
+
+        const auto offset = constant_offset(element.expr);
+        const size_t size = element.functionIndexes.empty() ? element.reference_count() : element.functionIndexes.size();
+
+        if (!offset.has_value() || *offset > table.size || size > table.size - *offset)
+        {
+            m_constant_tables[element.table].reset();
+            continue;
+        }
+
+        for (size_t i = 0; i < size; i++)
+        {
+            if (element.functionIndexes.empty())
+                table.slots[*offset + i] = referenced_function(element.reference_expression(i));
+            else
+                table.slots[*offset + i] = element.functionIndexes[i];
+        }
+    }
+}
+
+void CallGraph::devirtualize_indirect_calls(WasmFile::Code& code)
+{
+    for (size_t ip = 1; ip < code.instructions.size(); ip++)
+    {
+        auto& instruction = code.instructions[ip];
+        if (instruction.opcode != Opcode::call_indirect && instruction.opcode != Opcode::return_call_indirect)
+            continue;
+
+        const auto arguments = instruction.get_arguments<CallIndirectArguments>();
+        const auto& table = m_constant_tables[arguments.tableIndex];
+        if (!table.has_value())
+            continue;
+
+        // The table index is on top of the stack, so a constant right before the call is always the one used
+        auto& indexInstruction = code.instructions[ip - 1];
+
+        uint64_t slot;
+        if (indexInstruction.opcode == Opcode::i32_const)
+            slot = indexInstruction.get_arguments<uint32_t>();
+        else if (indexInstruction.opcode == Opcode::i64_const)
+            slot = indexInstruction.get_arguments<uint64_t>();
+        else
+            continue;
+
+        const auto it = table->slots.find(slot);
+        if (it == table->slots.end() || !it->second.has_value())
+            continue;
+
+        // Type mismatches have to keep trapping at runtime
+        const uint32_t target = it->second.value();
+        if (function_type(target) != m_wasmFile.functionTypes[arguments.typeIndex])
+            continue;
+
+        indexInstruction = Instruction { .opcode = Opcode::nop };
+        instruction = Instruction {
+            .opcode = instruction.opcode == Opcode::call_indirect ? Opcode::call : Opcode::return_call,
+            .arguments = target,
+        };
+        m_devirtualized_calls++;
+    }
+}
+
+void CallGraph::collect_summary(FunctionSummary& summary, const WasmFile::Code& code)
+{
+    for (const auto& instruction : code.instructions)
+    {
+        switch (instruction.opcode)
+        {
+            using enum Opcode;
+            case call:
+            case return_call:
+                summary.callees.push_back(instruction.get_arguments<uint32_t>());
+                break;
+            case call_indirect:
+            case return_call_indirect:
+                summary.hasIndirectCalls = true;
+                break;
+            case ref_func:
+                summary.referencedFunctions.push_back(instruction.get_arguments<uint32_t>());
+                break;
+            case memory_grow:
+                summary.mayGrowMemory = true;
+                summary.touchesMemory = true;
+                break;
+            default:
+                if (is_memory_instruction(instruction.opcode))
+                    summary.touchesMemory = true;
+                break;
+        }
+    }
+
+    const auto deduplicate = [](std::vector<uint32_t>& indices) {
+        std::ranges::sort(indices);
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    };
+
+    deduplicate(summary.callees);
+    deduplicate(summary.referencedFunctions);
+
+    summary.isLeaf = summary.callees.empty() && !summary.hasIndirectCalls;
+}
+
+void CallGraph::propagate_effects()
+{
+    std::vector<std::vector<uint32_t>> callers(m_functions.size());
+    for (uint32_t i = 0; i < m_functions.size(); i++)
+        for (const auto callee : m_functions[i].callees)
+            callers[callee].push_back(i);
+
+    std::vector<uint32_t> worklist;
+    for (uint32_t i = 0; i < m_functions.size(); i++)
+    {
+        auto& summary = m_functions[i];
+        if (summary.hasIndirectCalls)
+        {
+            summary.mayGrowMemory = true;
+            summary.touchesMemory = true;
+        }
+
+        if (summary.mayGrowMemory || summary.touchesMemory)
+            worklist.push_back(i);
+    }
+
+    while (!worklist.empty())
+    {
+        const uint32_t index = worklist.back();
+        worklist.pop_back();
+
+        const bool mayGrowMemory = m_functions[index].mayGrowMemory;
+        const bool touchesMemory = m_functions[index].touchesMemory;
+
+        for (const auto caller : callers[index])
+        {
+            auto& callerSummary = m_functions[caller];
+            if ((mayGrowMemory && !callerSummary.mayGrowMemory) || (touchesMemory && !callerSummary.touchesMemory))
+            {
+                callerSummary.mayGrowMemory |= mayGrowMemory;
+                callerSummary.touchesMemory |= touchesMemory;
+                worklist.push_back(caller);
+            }
+        }
+    }
+}
+
+const WasmFile::FunctionType& CallGraph::function_type(uint32_t index) const
+{
+    if (index >= m_imported_function_count)
+        return m_wasmFile.functionTypes[m_wasmFile.functionTypeIndexes[index - m_imported_function_count]];
+
+    uint32_t importedFunctionIndex = 0;
+    for (const auto& import : m_wasmFile.imports)
+    {
+        if (import.type != WasmFile::ImportType::Function)
+            continue;
+
+        if (importedFunctionIndex++ == index)
+            return m_wasmFile.functionTypes[import.functionTypeIndex];
+    }
+
+    std::unreachable();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "WasmFile.h"
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+struct FunctionSummary
+{
+    std::vector<uint32_t> callees;
+    std::vector<uint32_t> referencedFunctions;
+
+    bool imported { false };
+    bool hasIndirectCalls { false };
+
+    // No calls of any kind, direct or indirect
+    bool isLeaf { false };
+
+    // Both are transitive, calls into imports and unresolved indirect calls are assumed to do everything
+    bool mayGrowMemory { false };
+    bool touchesMemory { false };
+};
+
+// Whole-module analysis of validated code. Building the graph also devirtualizes call_indirect sites
+// whose target is provably constant, so the summaries already reflect the rewritten calls.
+class CallGraph
+{
+public:
+    CallGraph(WasmFile::WasmFile& wasmFile);
+
+    const FunctionSummary& function(uint32_t index) const { return m_functions[index]; }
+    uint32_t function_count() const { return static_cast<uint32_t>(m_functions.size()); }
+
+    uint32_t devirtualized_call_count() const { return m_devirtualized_calls; }
+    uint32_t leaf_function_count() const;
+
+    // Has to be called after passes that change which functions call each other
+    void update_summaries();
+
+private:
+    struct ConstantTable
+    {
+        uint64_t size;
+        // Slots missing from the map hold null, nullopt marks a slot that can't be resolved to a function
+        std::unordered_map<uint64_t, std::optional<uint32_t>> slots;
+    };
+
+    void find_constant_tables();
+    void devirtualize_indirect_calls(WasmFile::Code& code);
+    void collect_summary(FunctionSummary& summary, const WasmFile::Code& code);
+    void propagate_effects();
+
+    const WasmFile::FunctionType& function_type(uint32_t index) const;
+
+    WasmFile::WasmFile& m_wasmFile;
+    uint32_t m_imported_function_count { 0 };
+
+    // Indexed by table index, nullopt when the contents of the table can change after instantiation
+    std::vector<std::optional<ConstantTable>> m_constant_tables;
+
+    std::vector<FunctionSummary> m_functions;
+    uint32_t m_devirtualized_calls { 0 };
+};
@@ -0,0 +1,120 @@
+#include "Encoder.h"
+#include "Opcode.h"
+#include <format>
+
+void Encoder::write_unsigned_leb(uint64_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            byte |= 0x80;
+        write_byte(byte);
+    } while (value != 0);
+}
+
+void Encoder::write_signed_leb(int64_t value)
+{
+    while (true)
+    {
+        const uint8_t byte = value & 0x7F;
+        value >>= 7;
+
+        // Done once the rest is only copies of the sign bit of this byte
+        if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)))
+        {
+            write_byte(byte);
+            return;
+        }
+
+        write_byte(byte | 0x80);
+    }
+}
+
+void Encoder::write_opcode(Opcode opcode)
+{
+    const auto value = static_cast<uint32_t>(opcode);
+    if (value <= 0xFF)
+    {
+        write_byte(value);
+        return;
+    }
+
+    // Prefixed opcodes keep the prefix in the upper byte
+    write_byte(value >> 16);
+    write_u32(value & 0xFFFF);
+}
+
+void Encoder::write_name(std::string_view name)
+{
+    write_u32(name.size());
+    write_bytes(std::span(reinterpret_cast<const uint8_t*>(name.data()), name.size()));
+}
+
+void Encoder::write_limits(const WasmFile::Limits& limits)
+{
+    uint8_t flags = limits.max ? 0x01 : 0x00;
+    if (limits.address_type == AddressType::i64)
+        flags |= 0x04;
+
+    write_byte(flags);
+    write_u64(limits.min);
+    if (limits.max)
+        write_u64(*limits.max);
+}
+
+void Encoder::write_constant_expression(std::span<const Instruction> instructions)
+{
+    for (const auto& instruction : instructions)
+    {
+        write_opcode(instruction.opcode);
+
+        switch (instruction.opcode)
+        {
+            using enum Opcode;
+            case i32_const:
+                write_s32(static_cast<int32_t>(instruction.get_arguments<uint32_t>()));
+                break;
+            case i64_const:
+                write_s64(static_cast<int64_t>(instruction.get_arguments<uint64_t>()));
+                break;
+            case f32_const:
+                write_raw(instruction.get_arguments<float>());
+                break;
+            case f64_const:
+                write_raw(instruction.get_arguments<double>());
+                break;
+            case v128_const:
+                write_raw(instruction.get_arguments<uint128_t>());
+                break;
+            case ref_null:
+                write_type(instruction.get_arguments<Type>());
+                break;
+            case ref_func:
+            case global_get:
+                write_u32(instruction.get_arguments<uint32_t>());
+                break;
+            case i32_add:
+            case i32_sub:
+            case i32_mul:
+            case i64_add:
+            case i64_sub:
+            case i64_mul:
+            case end:
+                break;
+            default:
+                throw WasmFile::InvalidWASMException(std::format("Can't encode opcode {:#x} in a constant expression", static_cast<uint32_t>(instruction.opcode)));
+        }
+    }
+
+    if (instructions.empty() || instructions.back().opcode != Opcode::end)
+        write_opcode(Opcode::end);
+}
+
+void Encoder::write_section(uint8_t id, const Encoder& contents)
+{
+    write_byte(id);
+    write_u32(contents.bytes().size());
+    write_bytes(contents.bytes());
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Parser.h"
+#include "WasmFile.h"
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// Writes the binary format, the counterpart of the read_from_stream functions of the structures in WasmFile
+class Encoder
+{
+public:
+    void write_byte(uint8_t byte) { m_bytes.push_back(byte); }
+    void write_bytes(std::span<const uint8_t> bytes) { m_bytes.insert(m_bytes.end(), bytes.begin(), bytes.end()); }
+
+    void write_u32(uint32_t value) { write_unsigned_leb(value); }
+    void write_u64(uint64_t value) { write_unsigned_leb(value); }
+    void write_s32(int32_t value) { write_signed_leb(value); }
+    void write_s64(int64_t value) { write_signed_leb(value); }
+
+    void write_name(std::string_view name);
+    void write_type(Type type) { write_byte(static_cast<uint8_t>(type)); }
+    void write_limits(const WasmFile::Limits& limits);
+
+    // Only the instructions that can appear in constant expressions, the end is added if it's missing
+    void write_constant_expression(std::span<const Instruction> instructions);
+
+    void write_section(uint8_t id, const Encoder& contents);
+
+    const std::vector<uint8_t>& bytes() const { return m_bytes; }
+
+private:
+    template <typename T>
+    void write_raw(const T& value)
+    {
+        const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+        m_bytes.insert(m_bytes.end(), bytes, bytes + sizeof(T));
+    }
+
+    void write_unsigned_leb(uint64_t value);
+    void write_signed_leb(int64_t value);
+    void write_opcode(Opcode opcode);
+
+    std::vector<uint8_t> m_bytes;
+};
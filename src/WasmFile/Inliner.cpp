@@ -0,0 +1,245 @@
+#include "Inliner.h"
+#include "Labels.h"
+#include "Opcode.h"
+#include "Parser.h"
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+static Instruction zero_value_instruction(Type type)
+{
+    switch (type)
+    {
+        case Type::i32:
+            return Instruction { .opcode = Opcode::i32_const, .arguments = static_cast<uint32_t>(0) };
+        case Type::i64:
+            return Instruction { .opcode = Opcode::i64_const, .arguments = static_cast<uint64_t>(0) };
+        case Type::f32:
+            return Instruction { .opcode = Opcode::f32_const, .arguments = 0.0f };
+        case Type::f64:
+            return Instruction { .opcode = Opcode::f64_const, .arguments = 0.0 };
+        case Type::v128:
+            return Instruction { .opcode = Opcode::v128_const, .arguments = static_cast<uint128_t>(0) };
+        case Type::funcref:
+        case Type::externref:
+            return Instruction { .opcode = Opcode::ref_null, .arguments = type };
+        default:
+            std::unreachable();
+    }
+}
+
+Inliner::Inliner(WasmFile::WasmFile& wasmFile)
+    : m_wasmFile(wasmFile)
+    , m_imported_function_count(wasmFile.get_import_count_of_type(WasmFile::ImportType::Function))
+{
+    const uint32_t functionCount = m_imported_function_count + wasmFile.codeBlocks.size();
+
+    m_states.resize(functionCount, State::Unvisited);
+    m_has_tail_calls.resize(functionCount, true);
+
+    for (uint32_t function = m_imported_function_count; function < functionCount; function++)
+        if (m_states[function] == State::Unvisited)
+            visit(function);
+}
+
+void Inliner::visit(uint32_t root)
+{
+    struct PendingFunction
+    {
+        uint32_t function;
+        std::vector<uint32_t> callees;
+        size_t nextCallee;
+    };
+
+    std::vector<PendingFunction> pending;
+
+    const auto enter = [&](uint32_t function) {
+        m_states[function] = State::InProgress;
+
+        std::vector<uint32_t> callees;
+        for (const auto& site : code(function).callSites)
+        {
+            const auto& instruction = code(function).instructions[site.ip];
+            if (instruction.opcode == Opcode::call)
+                callees.push_back(instruction.get_arguments<uint32_t>());
+        }
+
+        pending.push_back(PendingFunction { .function = function, .callees = std::move(callees), .nextCallee = 0 });
+    };
+
+    enter(root);
+
+    while (!pending.empty())
+    {
+        auto& top = pending.back();
+        if (top.nextCallee < top.callees.size())
+        {
+            const uint32_t callee = top.callees[top.nextCallee++];
+            if (callee >= m_imported_function_count && m_states[callee] == State::Unvisited)
+                enter(callee);
+            continue;
+        }
+
+        const uint32_t function = top.function;
+        pending.pop_back();
+
+        inline_calls_into(function);
+
+        // Only callees without tail calls are ever inlined, so this can be checked after inlining
+        bool hasTailCalls = false;
+        for (const auto& instruction : code(function).instructions)
+            if (instruction.opcode == Opcode::return_call || instruction.opcode == Opcode::return_call_indirect)
+                hasTailCalls = true;
+
+        m_has_tail_calls[function] = hasTailCalls;
+        m_states[function] = State::Done;
+    }
+}
+
+void Inliner::inline_calls_into(uint32_t function)
+{
+    auto& callerCode = code(function);
+    const uint32_t paramCount = function_type(function).params.size();
+
+    // Back to front, so the call sites that are still left don't move
+    for (auto it = callerCode.callSites.rbegin(); it != callerCode.callSites.rend(); it++)
+    {
+        const auto& instruction = callerCode.instructions[it->ip];
+        if (instruction.opcode != Opcode::call)
+            continue;
+
+        const uint32_t callee = instruction.get_arguments<uint32_t>();
+        if (!can_inline(function, callee))
+            continue;
+
+        inline_call(callerCode, paramCount, *it, callee);
+        m_inlined_calls++;
+    }
+
+    callerCode.callSites.clear();
+    callerCode.callSites.shrink_to_fit();
+}
+
+bool Inliner::can_inline(uint32_t caller, uint32_t callee) const
+{
+    // In progress means the callee is part of a cycle with the caller
+    if (callee < m_imported_function_count || callee == caller || m_states[callee] != State::Done)
+        return false;
+
+    // Pruned bodies are never called, there is nothing to inline
+    if (code(callee).lazyBody)
+        return false;
+
+    // A tail call would replace the frame of the caller
+    if (m_has_tail_calls[callee])
+        return false;
+
+    const uint32_t size = inlined_size(callee);
+    if (size > MAX_INLINED_SIZE || code(caller).instructions.size() + size > MAX_CALLER_SIZE)
+        return false;
+
+    const size_t addedLocals = function_type(callee).params.size() + code(callee).locals.size();
+    return function_type(caller).params.size() + code(caller).locals.size() + addedLocals <= MAX_CALLER_LOCALS;
+}
+
+void Inliner::inline_call(WasmFile::Code& caller, uint32_t callerParamCount, const WasmFile::CallSite& site, uint32_t callee)
+{
+    const auto& calleeType = function_type(callee);
+    const auto& calleeCode = code(callee);
+
+    const uint32_t paramCount = calleeType.params.size();
+    const uint32_t localBase = callerParamCount + caller.locals.size();
+    // The arguments are moved into locals, so the body starts with the stack of the caller without them
+    const uint32_t stackHeight = site.stackHeight - paramCount;
+
+    std::vector<Instruction> inlined;
+    inlined.reserve(inlined_size(callee));
+
+    inlined.push_back(Instruction { .opcode = Opcode::block });
+
+    for (uint32_t i = paramCount; i > 0; i--)
+        inlined.push_back(Instruction { .opcode = Opcode::local_set, .arguments = localBase + i - 1 });
+
+    // Locals of the callee have to start out zeroed on every call, not only on the first one
+    for (uint32_t i = 0; i < calleeCode.locals.size(); i++)
+    {
+        inlined.push_back(zero_value_instruction(calleeCode.locals[i]));
+        inlined.push_back(Instruction { .opcode = Opcode::local_set, .arguments = localBase + paramCount + i });
+    }
+
+    const uint32_t bodyBegin = site.ip + inlined.size();
+    const uint32_t bodyEnd = bodyBegin + calleeCode.instructions.size();
+
+    const auto relocate = [&](Label& label) {
+        label.continuation += bodyBegin;
+        label.stackHeight += stackHeight;
+    };
+
+    for (auto instruction : calleeCode.instructions)
+    {
+        switch (instruction.opcode)
+        {
+            using enum Opcode;
+            case local_get:
+            case local_set:
+            case local_tee:
+                instruction.get_arguments<uint32_t>() += localBase;
+                break;
+            case return_:
+                // The final end of the callee becomes the end of the inlined block, so returning is a branch past it
+                inlined.push_back(Instruction {
+                    .opcode = Opcode::br,
+                    .arguments = Label {
+                        .continuation = bodyEnd,
+                        .arity = static_cast<uint32_t>(calleeType.returns.size()),
+                        .stackHeight = stackHeight,
+                    },
+                });
+                continue;
+            case call_indirect:
+                // Every copy gets its own inline cache
+                instruction.get_arguments<CallIndirectArguments>().cacheIndex = m_wasmFile.indirectCallSiteCount++;
+                break;
+            default:
+                break;
+        }
+
+        for_each_label(instruction, relocate);
+        for_each_else_location(instruction, [&](uint32_t& elseLocation) { elseLocation += bodyBegin; });
+        inlined.push_back(std::move(instruction));
+    }
+
+    const uint32_t growth = inlined.size() - 1;
+    for (auto& instruction : caller.instructions)
+    {
+        for_each_label(instruction, [&](Label& label) {
+            if (label.continuation > site.ip)
+                label.continuation += growth;
+        });
+
+        for_each_else_location(instruction, [&](uint32_t& elseLocation) {
+            if (elseLocation > site.ip)
+                elseLocation += growth;
+        });
+    }
+
+    caller.instructions[site.ip] = std::move(inlined.front());
+    caller.instructions.insert(caller.instructions.begin() + site.ip + 1, std::make_move_iterator(inlined.begin() + 1), std::make_move_iterator(inlined.end()));
+
+    // Locals point into the arena, so the longer list is a new allocation there
+    const auto locals = m_wasmFile.arena.allocate_array<Type>(caller.locals.size() + paramCount + calleeCode.locals.size());
+    auto next = std::ranges::copy(caller.locals, locals.begin()).out;
+    next = std::ranges::copy(calleeType.params, next).out;
+    std::ranges::copy(calleeCode.locals, next);
+    caller.locals = locals;
+}
+
+uint32_t Inliner::inlined_size(uint32_t callee) const
+{
+    return 1 + function_type(callee).params.size() + 2 * code(callee).locals.size() + code(callee).instructions.size();
+}
+
+const WasmFile::FunctionType& Inliner::function_type(uint32_t function) const
+{
+    return m_wasmFile.functionTypes[m_wasmFile.functionTypeIndexes[function - m_imported_function_count]];
+}
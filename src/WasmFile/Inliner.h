@@ -0,0 +1,48 @@
+#pragma once
+
+#include "WasmFile.h"
+#include <cstdint>
+#include <vector>
+
+// Splices small callees into their call sites. Works on validated code, since it relies on the lowered
+// labels and the call sites recorded by the validator. Functions are handled bottom-up, so a callee is
+// already inlined into itself by the time it's considered, and recursive calls are never inlined.
+class Inliner
+{
+public:
+    // Counted in instructions, including the block, argument stores and local initialization around the body
+    static constexpr uint32_t MAX_INLINED_SIZE = 48;
+    static constexpr uint32_t MAX_CALLER_SIZE = 16384;
+    static constexpr uint32_t MAX_CALLER_LOCALS = 512;
+
+    Inliner(WasmFile::WasmFile& wasmFile);
+
+    uint32_t inlined_call_count() const { return m_inlined_calls; }
+
+private:
+    enum class State : uint8_t
+    {
+        Unvisited,
+        InProgress,
+        Done,
+    };
+
+    void visit(uint32_t root);
+    void inline_calls_into(uint32_t function);
+    bool can_inline(uint32_t caller, uint32_t callee) const;
+    void inline_call(WasmFile::Code& caller, uint32_t callerParamCount, const WasmFile::CallSite& site, uint32_t callee);
+
+    uint32_t inlined_size(uint32_t callee) const;
+    const WasmFile::FunctionType& function_type(uint32_t function) const;
+    WasmFile::Code& code(uint32_t function) { return m_wasmFile.codeBlocks[function - m_imported_function_count]; }
+    const WasmFile::Code& code(uint32_t function) const { return m_wasmFile.codeBlocks[function - m_imported_function_count]; }
+
+    WasmFile::WasmFile& m_wasmFile;
+    uint32_t m_imported_function_count { 0 };
+
+    // Indexed by function index
+    std::vector<State> m_states;
+    std::vector<bool> m_has_tail_calls;
+
+    uint32_t m_inlined_calls { 0 };
+};
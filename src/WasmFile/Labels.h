@@ -0,0 +1,47 @@
+#pragma once
+
+#include "Opcode.h"
+#include "Parser.h"
+
+// Helpers for passes that move validated code around and have to keep the lowered branch targets in sync
+
+template <typename Function>
+void for_each_label(Instruction& instruction, Function function)
+{
+    switch (instruction.opcode)
+    {
+        using enum Opcode;
+        case if_:
+        case if_likely:
+        case if_unlikely:
+            function(instruction.get_arguments<IfArguments>().endLabel);
+            break;
+        case else_:
+        case br:
+        case br_if:
+        case br_if_likely:
+        case br_if_unlikely:
+            function(instruction.get_arguments<Label>());
+            break;
+        case br_table: {
+            auto& arguments = instruction.get_arguments<BranchTableArguments>();
+            for (auto& label : arguments.labels)
+                function(label);
+            function(arguments.defaultLabel);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+template <typename Function>
+void for_each_else_location(Instruction& instruction, Function function)
+{
+    if (instruction.opcode != Opcode::if_ && instruction.opcode != Opcode::if_likely && instruction.opcode != Opcode::if_unlikely)
+        return;
+
+    auto& arguments = instruction.get_arguments<IfArguments>();
+    if (arguments.elseLocation.has_value())
+        function(arguments.elseLocation.value());
+}
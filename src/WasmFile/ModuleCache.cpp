@@ -0,0 +1,891 @@
+#include "ModuleCache.h"
+#include "Labels.h"
+#include "Opcode.h"
+#include "Parser.h"
+#include "Stream/MappedFileStream.h"
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <link.h>
+#include <type_traits>
+#include <unistd.h>
+#include <variant>
+
+using Arguments = decltype(Instruction::arguments);
+
+template <typename T>
+inline constexpr bool is_vector = false;
+
+template <typename T>
+inline constexpr bool is_vector<std::vector<T>> = true;
+
+// Views into the arena of the module, stored like vectors and copied into the arena of the loaded module
+template <typename T>
+inline constexpr bool is_arena_view = false;
+
+template <typename T>
+inline constexpr bool is_arena_view<std::span<const T>> = true;
+
+template <>
+inline constexpr bool is_arena_view<std::string_view> = true;
+
+template <typename T>
+inline constexpr bool is_optional = false;
+
+template <typename T>
+inline constexpr bool is_optional<std::optional<T>> = true;
+
+// Stored as their underlying value and checked on reading, so a damaged file can't produce values outside of them
+template <typename T>
+inline constexpr bool is_checked_enum = IsAnyOf<T, bool, Type, AddressType, Opcode, WasmFile::ImportType, WasmFile::GlobalMutability, WasmFile::ElementMode>;
+
+// Could be copied as they are, but hold enums or optionals, so they're stored field by field to check those
+template <typename T>
+inline constexpr bool is_checked_struct = IsAnyOf<T, WasmFile::Limits, WasmFile::Table, WasmFile::Memory, WasmFile::BlockType, BlockLoopArguments, IfArguments>;
+
+template <typename T>
+struct RawEnum
+{
+    using Underlying = std::underlying_type_t<T>;
+};
+
+template <>
+struct RawEnum<bool>
+{
+    using Underlying = uint8_t;
+};
+
+template <typename T>
+static bool is_valid_enum_value(typename RawEnum<T>::Underlying value)
+{
+    if constexpr (std::same_as<T, bool>)
+        return value <= 1;
+    else if constexpr (std::same_as<T, Type>)
+        return is_valid_type(static_cast<Type>(value));
+    else if constexpr (std::same_as<T, AddressType>)
+        return value <= static_cast<int>(AddressType::i64);
+    else if constexpr (std::same_as<T, Opcode>)
+    {
+        // Only the ranges the opcodes come from, anything unknown within them traps in the interpreter
+        const uint32_t prefix = static_cast<uint32_t>(value) >> 16;
+        return value >= 0 && (prefix == 0 ? value <= 0xFF : (prefix == 0xFC || prefix == 0xFD || prefix == 0xFF) && (value & 0xFFFF) <= 0x1FF);
+    }
+    else if constexpr (std::same_as<T, WasmFile::ImportType>)
+        return value >= 0 && value <= static_cast<int>(WasmFile::ImportType::Global);
+    else if constexpr (std::same_as<T, WasmFile::GlobalMutability>)
+        return value >= 0 && value <= static_cast<int>(WasmFile::GlobalMutability::Variable);
+    else
+        return value >= 0 && value <= static_cast<int>(WasmFile::ElementMode::Declarative);
+}
+
+// GNU build ID of the executable, so every rebuild gets its own cache entries
+static uint64_t build_id()
+{
+    static const uint64_t id = []() {
+        uint64_t hash = 0;
+        dl_iterate_phdr([](dl_phdr_info* info, size_t, void* data) {
+            for (size_t i = 0; i < info->dlpi_phnum; i++)
+            {
+                const auto& header = info->dlpi_phdr[i];
+                if (header.p_type != PT_NOTE)
+                    continue;
+
+                const auto* note = reinterpret_cast<const uint8_t*>(info->dlpi_addr + header.p_vaddr);
+                const auto* end = note + header.p_memsz;
+                while (note + sizeof(ElfW(Nhdr)) <= end)
+                {
+                    const auto* noteHeader = reinterpret_cast<const ElfW(Nhdr)*>(note);
+                    const auto* name = note + sizeof(ElfW(Nhdr));
+                    const auto* description = name + (noteHeader->n_namesz + 3) / 4 * 4;
+                    if (noteHeader->n_type == NT_GNU_BUILD_ID)
+                    {
+                        *static_cast<uint64_t*>(data) = fnv1a_hash(description, noteHeader->n_descsz);
+                        return 1;
+                    }
+                    note = description + (noteHeader->n_descsz + 3) / 4 * 4;
+                }
+            }
+
+            // The executable comes first, libraries don't identify the build
+            return 1;
+        },
+            &hash);
+
+        // Without a build ID, the build time of this file is the closest thing
+        if (hash == 0)
+            hash = fnv1a_hash(__DATE__ __TIME__, sizeof(__DATE__ __TIME__));
+        return hash;
+    }();
+
+    return id;
+}
+
+static uint64_t cache_key(std::span<const uint8_t> module, WasmFile::LoadOptions options)
+{
+    uint64_t hash = fnv1a_hash(module.data(), module.size());
+    hash = fnv1a_hash(&options.optimize, sizeof(options.optimize), hash);
+    const uint64_t id = build_id();
+    return fnv1a_hash(&id, sizeof(id), hash);
+}
+
+class CacheWriter
+{
+public:
+    template <typename T>
+    void write(const T& value)
+    {
+        if constexpr (is_arena_view<T>)
+        {
+            write<uint32_t>(value.size());
+            const auto* bytes = reinterpret_cast<const uint8_t*>(value.data());
+            m_bytes.insert(m_bytes.end(), bytes, bytes + value.size() * sizeof(typename T::value_type));
+        }
+        else if constexpr (is_optional<T>)
+        {
+            write(value.has_value());
+            if (value.has_value())
+                write(*value);
+        }
+        else if constexpr (std::is_trivially_copyable_v<T> && !is_checked_struct<T>)
+        {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+            m_bytes.insert(m_bytes.end(), bytes, bytes + sizeof(T));
+        }
+        else if constexpr (is_vector<T>)
+        {
+            write<uint32_t>(value.size());
+            if constexpr (std::is_trivially_copyable_v<typename T::value_type> && !is_checked_struct<typename T::value_type>)
+            {
+                const auto* bytes = reinterpret_cast<const uint8_t*>(value.data());
+                m_bytes.insert(m_bytes.end(), bytes, bytes + value.size() * sizeof(typename T::value_type));
+            }
+            else
+            {
+                for (const auto& element : value)
+                    write(element);
+            }
+        }
+        else
+        {
+            write_fields(value);
+        }
+    }
+
+    void write_bytes(std::span<const uint8_t> bytes) { m_bytes.insert(m_bytes.end(), bytes.begin(), bytes.end()); }
+
+    const std::vector<uint8_t>& bytes() const { return m_bytes; }
+
+private:
+    void write_fields(const WasmFile::Limits& limits)
+    {
+        write(limits.min);
+        write(limits.max);
+        write(limits.address_type);
+    }
+
+    void write_fields(const WasmFile::Table& table)
+    {
+        write(table.refType);
+        write(table.limits);
+    }
+
+    void write_fields(const WasmFile::Memory& memory)
+    {
+        write(memory.limits);
+    }
+
+    void write_fields(const WasmFile::BlockType& blockType)
+    {
+        write(blockType.type);
+        write(blockType.index);
+    }
+
+    void write_fields(const BlockLoopArguments& arguments)
+    {
+        write(arguments.blockType);
+        write(arguments.label);
+    }
+
+    void write_fields(const IfArguments& arguments)
+    {
+        write(arguments.blockType);
+        write(arguments.endLabel);
+        write(arguments.elseLocation);
+    }
+
+    void write_fields(const Instruction& instruction)
+    {
+        write(instruction.opcode);
+        write<uint8_t>(instruction.arguments.index());
+        std::visit([this](const auto& arguments) { write(arguments); }, instruction.arguments);
+    }
+
+    void write_fields(const BranchTableArgumentsPrevalidated& arguments)
+    {
+        write(arguments.labels);
+        write(arguments.defaultLabel);
+    }
+
+    void write_fields(const BranchTableArguments& arguments)
+    {
+        write(arguments.labels);
+        write(arguments.defaultLabel);
+    }
+
+    void write_fields(const WasmFile::FunctionType& type)
+    {
+        write(type.params);
+        write(type.returns);
+    }
+
+    void write_fields(const WasmFile::Import& import)
+    {
+        write(import.type);
+        write(import.environment);
+        write(import.name);
+        write(import.functionTypeIndex);
+        write(import.tableRefType);
+        write(import.tableLimits);
+        write(import.memoryLimits);
+        write(import.globalType);
+        write(import.globalMutability);
+    }
+
+    void write_fields(const WasmFile::Global& global)
+    {
+        write(global.type);
+        write(global.mutability);
+        write(global.initCode);
+    }
+
+    void write_fields(const WasmFile::Export& exp)
+    {
+        write(exp.name);
+        write(exp.type);
+        write(exp.index);
+    }
+
+    void write_fields(const WasmFile::Element& element)
+    {
+        write(element.table);
+        write(element.expr);
+        write(element.functionIndexes);
+        write(element.referencesCode);
+        write(element.referencesEnds);
+        write(element.mode);
+        write(element.valueType);
+    }
+
+    void write_fields(const WasmFile::Code& code)
+    {
+        write(code.locals);
+        write(code.instructions);
+    }
+
+    void write_fields(const WasmFile::Data& data)
+    {
+        write(data.type);
+        write(data.memoryIndex);
+        write(data.expr);
+        write(data.data);
+        write(data.mode);
+    }
+
+    std::vector<uint8_t> m_bytes;
+};
+
+// Reads the cache file in place from the mapping. Damaged files throw StreamReadException instead of crashing.
+class CacheReader
+{
+public:
+    CacheReader(Stream& stream, Arena& arena)
+        : m_stream(stream)
+        , m_arena(arena)
+    {
+    }
+
+    template <typename T>
+    T read()
+    {
+        if constexpr (is_arena_view<T>)
+        {
+            using Element = std::remove_const_t<typename T::value_type>;
+
+            const uint32_t count = read<uint32_t>();
+            const auto bytes = m_stream.read_span(count * sizeof(Element));
+            check_enum_values<Element>(bytes);
+            const auto values = m_arena.copy(std::span(reinterpret_cast<const Element*>(bytes.data()), count));
+            return T(values.data(), values.size());
+        }
+        else if constexpr (is_optional<T>)
+        {
+            if (!read<bool>())
+                return std::nullopt;
+            return read<typename T::value_type>();
+        }
+        else if constexpr (is_checked_enum<T>)
+        {
+            const auto value = m_stream.read_little_endian<typename RawEnum<T>::Underlying>();
+            if (!is_valid_enum_value<T>(value))
+                throw StreamReadException();
+            return static_cast<T>(value);
+        }
+        else if constexpr (std::is_trivially_copyable_v<T> && !is_checked_struct<T>)
+        {
+            return m_stream.read_little_endian<T>();
+        }
+        else if constexpr (is_vector<T>)
+        {
+            using Element = typename T::value_type;
+
+            const uint32_t count = read<uint32_t>();
+            if constexpr (std::is_trivially_copyable_v<Element> && !is_checked_struct<Element>)
+            {
+                const auto bytes = m_stream.read_span(count * sizeof(Element));
+                check_enum_values<Element>(bytes);
+                T values(count, Element {});
+                memcpy(values.data(), bytes.data(), bytes.size());
+                return values;
+            }
+            else
+            {
+                // Every element takes at least a byte, so a damaged count can't make this allocate much
+                if (count > m_stream.size() - m_stream.offset())
+                    throw StreamReadException();
+
+                T values;
+                values.reserve(count);
+                for (uint32_t i = 0; i < count; i++)
+                    values.push_back(read<Element>());
+                return values;
+            }
+        }
+        else
+        {
+            return read_fields(std::type_identity<T> {});
+        }
+    }
+
+    // The cache file stays mapped as long as the module lives, so data segments are used from there. Entries are only
+    // ever replaced by renaming a new file over them, so the mapped bytes never change, whatever LoadOptions::mapData says.
+    std::span<const uint8_t> read_in_place()
+    {
+        const uint32_t size = read<uint32_t>();
+        return m_stream.read_span(size);
+    }
+
+private:
+    template <typename T>
+    static void check_enum_values(std::span<const uint8_t> bytes)
+    {
+        if constexpr (is_checked_enum<T>)
+        {
+            for (size_t offset = 0; offset < bytes.size(); offset += sizeof(T))
+            {
+                typename RawEnum<T>::Underlying value;
+                memcpy(&value, bytes.data() + offset, sizeof(value));
+                if (!is_valid_enum_value<T>(value))
+                    throw StreamReadException();
+            }
+        }
+    }
+
+    template <size_t... Indices>
+    static constexpr auto make_argument_readers(std::index_sequence<Indices...>)
+    {
+        return std::array<Arguments (*)(CacheReader&), sizeof...(Indices)> {
+            [](CacheReader& reader) { return Arguments(std::in_place_index<Indices>, reader.read<std::variant_alternative_t<Indices, Arguments>>()); }...
+        };
+    }
+
+    WasmFile::Limits read_fields(std::type_identity<WasmFile::Limits>)
+    {
+        return WasmFile::Limits {
+            .min = read<uint64_t>(),
+            .max = read<std::optional<uint64_t>>(),
+            .address_type = read<AddressType>(),
+        };
+    }
+
+    WasmFile::Table read_fields(std::type_identity<WasmFile::Table>)
+    {
+        return WasmFile::Table {
+            .refType = read<Type>(),
+            .limits = read<WasmFile::Limits>(),
+        };
+    }
+
+    WasmFile::Memory read_fields(std::type_identity<WasmFile::Memory>)
+    {
+        return WasmFile::Memory {
+            .limits = read<WasmFile::Limits>(),
+        };
+    }
+
+    WasmFile::BlockType read_fields(std::type_identity<WasmFile::BlockType>)
+    {
+        return WasmFile::BlockType {
+            .type = read<std::optional<Type>>(),
+            .index = read<uint64_t>(),
+        };
+    }
+
+    BlockLoopArguments read_fields(std::type_identity<BlockLoopArguments>)
+    {
+        return BlockLoopArguments {
+            .blockType = read<WasmFile::BlockType>(),
+            .label = read<Label>(),
+        };
+    }
+
+    IfArguments read_fields(std::type_identity<IfArguments>)
+    {
+        return IfArguments {
+            .blockType = read<WasmFile::BlockType>(),
+            .endLabel = read<Label>(),
+            .elseLocation = read<std::optional<uint32_t>>(),
+        };
+    }
+
+    Instruction read_fields(std::type_identity<Instruction>)
+    {
+        static constexpr auto argumentReaders = make_argument_readers(std::make_index_sequence<std::variant_size_v<Arguments>>());
+
+        const auto opcode = read<Opcode>();
+        const auto index = read<uint8_t>();
+        if (index >= argumentReaders.size())
+            throw StreamReadException();
+
+        return Instruction { .opcode = opcode, .arguments = argumentReaders[index](*this) };
+    }
+
+    BranchTableArgumentsPrevalidated read_fields(std::type_identity<BranchTableArgumentsPrevalidated>)
+    {
+        return BranchTableArgumentsPrevalidated {
+            .labels = read<std::vector<uint32_t>>(),
+            .defaultLabel = read<uint32_t>(),
+        };
+    }
+
+    BranchTableArguments read_fields(std::type_identity<BranchTableArguments>)
+    {
+        return BranchTableArguments {
+            .labels = read<std::vector<Label>>(),
+            .defaultLabel = read<Label>(),
+        };
+    }
+
+    WasmFile::FunctionType read_fields(std::type_identity<WasmFile::FunctionType>)
+    {
+        return WasmFile::FunctionType {
+            .params = read<std::vector<Type>>(),
+            .returns = read<std::vector<Type>>(),
+        };
+    }
+
+    WasmFile::Import read_fields(std::type_identity<WasmFile::Import>)
+    {
+        return WasmFile::Import {
+            .type = read<WasmFile::ImportType>(),
+            .environment = read<std::string_view>(),
+            .name = read<std::string_view>(),
+            .functionTypeIndex = read<uint32_t>(),
+            .tableRefType = read<Type>(),
+            .tableLimits = read<WasmFile::Limits>(),
+            .memoryLimits = read<WasmFile::Limits>(),
+            .globalType = read<Type>(),
+            .globalMutability = read<WasmFile::GlobalMutability>(),
+        };
+    }
+
+    WasmFile::Global read_fields(std::type_identity<WasmFile::Global>)
+    {
+        return WasmFile::Global {
+            .type = read<Type>(),
+            .mutability = read<WasmFile::GlobalMutability>(),
+            .initCode = read<std::vector<Instruction>>(),
+        };
+    }
+
+    WasmFile::Export read_fields(std::type_identity<WasmFile::Export>)
+    {
+        return WasmFile::Export {
+            .name = read<std::string_view>(),
+            .type = read<WasmFile::ImportType>(),
+            .index = read<uint32_t>(),
+        };
+    }
+
+    WasmFile::Element read_fields(std::type_identity<WasmFile::Element>)
+    {
+        return WasmFile::Element {
+            .table = read<uint32_t>(),
+            .expr = read<std::vector<Instruction>>(),
+            .functionIndexes = read<std::vector<uint32_t>>(),
+            .referencesCode = read<std::vector<Instruction>>(),
+            .referencesEnds = read<std::vector<uint32_t>>(),
+            .mode = read<WasmFile::ElementMode>(),
+            .valueType = read<Type>(),
+        };
+    }
+
+    WasmFile::Code read_fields(std::type_identity<WasmFile::Code>)
+    {
+        return WasmFile::Code {
+            .locals = read<std::span<const Type>>(),
+            .instructions = read<std::vector<Instruction>>(),
+        };
+    }
+
+    WasmFile::Data read_fields(std::type_identity<WasmFile::Data>)
+    {
+        return WasmFile::Data {
+            .type = read<uint32_t>(),
+            .memoryIndex = read<uint32_t>(),
+            .expr = read<std::vector<Instruction>>(),
+            .data = read_in_place(),
+            .mode = read<WasmFile::ElementMode>(),
+        };
+    }
+
+    Stream& m_stream;
+    Arena& m_arena;
+};
+
+// Everything the interpreter indexes with is checked against the module, the lowered code is trusted after that
+static void verify_indices(WasmFile::WasmFile& wasmFile)
+{
+    const auto require = [](bool condition) {
+        if (!condition)
+            throw StreamReadException();
+    };
+
+    uint32_t functionCount = wasmFile.functionTypeIndexes.size();
+    uint32_t tableCount = wasmFile.tables.size();
+    uint32_t memoryCount = wasmFile.memories.size();
+    uint32_t globalCount = wasmFile.globals.size();
+    const uint32_t typeCount = wasmFile.functionTypes.size();
+
+    for (const auto& import : wasmFile.imports)
+    {
+        switch (import.type)
+        {
+            case WasmFile::ImportType::Function:
+                require(import.functionTypeIndex < typeCount);
+                functionCount++;
+                break;
+            case WasmFile::ImportType::Table:
+                tableCount++;
+                break;
+            case WasmFile::ImportType::Memory:
+                memoryCount++;
+                break;
+            case WasmFile::ImportType::Global:
+                globalCount++;
+                break;
+        }
+    }
+
+    const auto verify_block_type = [&](const WasmFile::BlockType& blockType) {
+        require(blockType.type || blockType.index == UINT64_MAX || blockType.index < typeCount);
+    };
+
+    const auto verify_code = [&](std::vector<Instruction>& instructions, uint32_t localCount) {
+        const uint32_t size = instructions.size();
+        for (auto& instruction : instructions)
+        {
+            for_each_label(instruction, [&](Label& label) { require(label.continuation <= size); });
+            for_each_else_location(instruction, [&](uint32_t& elseLocation) { require(elseLocation < size); });
+
+            if (const auto* memArg = std::get_if<WasmFile::MemArg>(&instruction.arguments))
+                require(memArg->memory_index < memoryCount);
+            if (const auto* arguments = std::get_if<LoadStoreLaneArguments>(&instruction.arguments))
+                require(arguments->memArg.memory_index < memoryCount && arguments->lane < 16);
+            if (const auto* arguments = std::get_if<BlockLoopArguments>(&instruction.arguments))
+                verify_block_type(arguments->blockType);
+            if (const auto* arguments = std::get_if<IfArguments>(&instruction.arguments))
+                verify_block_type(arguments->blockType);
+
+            switch (instruction.opcode)
+            {
+                using enum Opcode;
+                case call:
+                case return_call:
+                case ref_func:
+                    require(instruction.get_arguments<uint32_t>() < functionCount);
+                    break;
+                case call_indirect:
+                case return_call_indirect: {
+                    const auto& arguments = instruction.get_arguments<CallIndirectArguments>();
+                    require(arguments.typeIndex < typeCount && arguments.tableIndex < tableCount && arguments.cacheIndex < wasmFile.indirectCallSiteCount);
+                    break;
+                }
+                case local_get:
+                case local_set:
+                case local_tee:
+                    require(instruction.get_arguments<uint32_t>() < localCount);
+                    break;
+                case global_get:
+                case global_set:
+                    require(instruction.get_arguments<uint32_t>() < globalCount);
+                    break;
+                case table_get:
+                case table_set:
+                case table_grow:
+                case table_size:
+                case table_fill:
+                    require(instruction.get_arguments<uint32_t>() < tableCount);
+                    break;
+                case memory_size:
+                case memory_grow:
+                case memory_fill:
+                    require(instruction.get_arguments<uint32_t>() < memoryCount);
+                    break;
+                case data_drop:
+                    require(instruction.get_arguments<uint32_t>() < wasmFile.dataBlocks.size());
+                    break;
+                case elem_drop:
+                    require(instruction.get_arguments<uint32_t>() < wasmFile.elements.size());
+                    break;
+                case memory_init: {
+                    const auto& arguments = instruction.get_arguments<MemoryInitArguments>();
+                    require(arguments.dataIndex < wasmFile.dataBlocks.size() && arguments.memoryIndex < memoryCount);
+                    break;
+                }
+                case memory_copy: {
+                    const auto& arguments = instruction.get_arguments<MemoryCopyArguments>();
+                    require(arguments.source < memoryCount && arguments.destination < memoryCount);
+                    break;
+                }
+                case table_init: {
+                    const auto& arguments = instruction.get_arguments<TableInitArguments>();
+                    require(arguments.elementIndex < wasmFile.elements.size() && arguments.tableIndex < tableCount);
+                    break;
+                }
+                case table_copy: {
+                    const auto& arguments = instruction.get_arguments<TableCopyArguments>();
+                    require(arguments.source < tableCount && arguments.destination < tableCount);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    };
+
+    require(wasmFile.codeBlocks.size() == wasmFile.functionTypeIndexes.size());
+    for (size_t i = 0; i < wasmFile.codeBlocks.size(); i++)
+    {
+        const uint32_t typeIndex = wasmFile.functionTypeIndexes[i];
+        require(typeIndex < typeCount);
+
+        auto& code = wasmFile.codeBlocks[i];
+        verify_code(code.instructions, wasmFile.functionTypes[typeIndex].params.size() + code.locals.size());
+    }
+
+    for (auto& global : wasmFile.globals)
+        verify_code(global.initCode, 0);
+
+    for (const auto& exported : wasmFile.exports)
+    {
+        switch (exported.type)
+        {
+            case WasmFile::ImportType::Function:
+                require(exported.index < functionCount);
+                break;
+            case WasmFile::ImportType::Table:
+                require(exported.index < tableCount);
+                break;
+            case WasmFile::ImportType::Memory:
+                require(exported.index < memoryCount);
+                break;
+            case WasmFile::ImportType::Global:
+                require(exported.index < globalCount);
+                break;
+        }
+    }
+
+    require(!wasmFile.startFunction || *wasmFile.startFunction < functionCount);
+
+    for (auto& element : wasmFile.elements)
+    {
+        require(element.mode != WasmFile::ElementMode::Active || element.table < tableCount);
+        for (const auto function : element.functionIndexes)
+            require(function < functionCount);
+
+        uint32_t begin = 0;
+        for (const auto end : element.referencesEnds)
+        {
+            require(begin <= end && end <= element.referencesCode.size());
+            begin = end;
+        }
+
+        verify_code(element.expr, 0);
+        verify_code(element.referencesCode, 0);
+    }
+
+    for (auto& data : wasmFile.dataBlocks)
+    {
+        require(data.mode != WasmFile::ElementMode::Active || data.memoryIndex < memoryCount);
+        verify_code(data.expr, 0);
+    }
+}
+
+ModuleCache::ModuleCache(std::filesystem::path directory)
+    : m_directory(std::move(directory))
+{
+}
+
+std::optional<std::filesystem::path> ModuleCache::directory_from_environment()
+{
+    const char* directory = getenv("WASVM_CACHE_DIR");
+    if (!directory || *directory == '\0')
+        return {};
+    return std::filesystem::path(directory);
+}
+
+Ref<WasmFile::WasmFile> ModuleCache::read_from_stream(Stream& stream, WasmFile::LoadOptions options) const
+{
+    // Lazily loaded modules never run the whole module passes, so there is nothing to save. Pruned bodies
+    // would need the code section to be stored as well.
+    if (!stream.is_contiguous() || !options.validate || options.lazy || options.pruneUnreachable)
+        return WasmFile::WasmFile::read_from_stream(stream, options);
+
+    const auto module = stream.buffer();
+    const auto path = path_for(cache_key(module, options));
+
+    if (auto cached = load(path, module, options))
+        return cached;
+
+    auto wasmFile = WasmFile::WasmFile::read_from_stream(stream, options);
+    store(path, module, *wasmFile);
+    return wasmFile;
+}
+
+std::filesystem::path ModuleCache::path_for(uint64_t key) const
+{
+    return m_directory / std::format("{:016x}.wasvmc", key);
+}
+
+Ref<WasmFile::WasmFile> ModuleCache::load(const std::filesystem::path& path, std::span<const uint8_t> module, WasmFile::LoadOptions options) const
+{
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(path, error))
+        return nullptr;
+
+    try
+    {
+        MappedFileStream stream(path.string());
+        auto wasmFile = MakeRef<WasmFile::WasmFile>();
+        CacheReader reader(stream, wasmFile->arena);
+
+        if (reader.read<uint64_t>() != MAGIC || reader.read<uint32_t>() != FORMAT_VERSION || reader.read<uint64_t>() != build_id())
+            return nullptr;
+
+        // Damage anywhere after the header is caught before anything is read from it
+        const uint64_t checksum = reader.read<uint64_t>();
+        const auto payload = stream.buffer().subspan(stream.offset());
+        if (checksum != fnv1a_hash(payload.data(), payload.size()))
+            return nullptr;
+
+        // The key is only a hash, so the entry keeps the whole module to rule out collisions
+        const auto cachedModule = reader.read_in_place();
+        if (cachedModule.size() != module.size() || memcmp(cachedModule.data(), module.data(), module.size()) != 0)
+            return nullptr;
+        if (reader.read<bool>() != options.optimize)
+            return nullptr;
+
+        wasmFile->loadOptions = options;
+        wasmFile->mapping = stream.mapping();
+        wasmFile->functionTypes = reader.read<std::vector<WasmFile::FunctionType>>();
+        wasmFile->imports = reader.read<std::vector<WasmFile::Import>>();
+        wasmFile->functionTypeIndexes = reader.read<std::vector<uint32_t>>();
+        wasmFile->tables = reader.read<std::vector<WasmFile::Table>>();
+        wasmFile->memories = reader.read<std::vector<WasmFile::Memory>>();
+        wasmFile->globals = reader.read<std::vector<WasmFile::Global>>();
+        wasmFile->exports = reader.read<std::vector<WasmFile::Export>>();
+        wasmFile->startFunction = reader.read<std::optional<uint32_t>>();
+        wasmFile->elements = reader.read<std::vector<WasmFile::Element>>();
+        wasmFile->codeBlocks = reader.read<std::vector<WasmFile::Code>>();
+        wasmFile->dataBlocks = reader.read<std::vector<WasmFile::Data>>();
+        wasmFile->dataCount = reader.read<std::optional<uint32_t>>();
+        wasmFile->devirtualizedCallCount = reader.read<uint32_t>();
+        wasmFile->inlinedCallCount = reader.read<uint32_t>();
+        wasmFile->removedInstructionCount = reader.read<uint32_t>();
+        wasmFile->contentHash = reader.read<uint64_t>();
+        wasmFile->indirectCallSiteCount = reader.read<uint32_t>();
+
+        if (!stream.eof())
+            return nullptr;
+
+        verify_indices(*wasmFile);
+
+        return wasmFile;
+    }
+    catch (const StreamReadException&)
+    {
+        return nullptr;
+    }
+    catch (const std::bad_variant_access&)
+    {
+        // Arguments that don't match their opcode
+        return nullptr;
+    }
+}
+
+void ModuleCache::store(const std::filesystem::path& path, std::span<const uint8_t> module, const WasmFile::WasmFile& wasmFile) const
+{
+    CacheWriter payload;
+    payload.write(module);
+    payload.write(wasmFile.loadOptions.optimize);
+
+    payload.write(wasmFile.functionTypes);
+    payload.write(wasmFile.imports);
+    payload.write(wasmFile.functionTypeIndexes);
+    payload.write(wasmFile.tables);
+    payload.write(wasmFile.memories);
+    payload.write(wasmFile.globals);
+    payload.write(wasmFile.exports);
+    payload.write(wasmFile.startFunction);
+    payload.write(wasmFile.elements);
+    payload.write(wasmFile.codeBlocks);
+    payload.write(wasmFile.dataBlocks);
+    payload.write(wasmFile.dataCount);
+    payload.write(wasmFile.devirtualizedCallCount);
+    payload.write(wasmFile.inlinedCallCount);
+    payload.write(wasmFile.removedInstructionCount);
+    payload.write(wasmFile.contentHash);
+    payload.write(wasmFile.indirectCallSiteCount.load());
+
+    CacheWriter writer;
+    writer.write(MAGIC);
+    writer.write(FORMAT_VERSION);
+    writer.write(build_id());
+    writer.write(fnv1a_hash(payload.bytes().data(), payload.bytes().size()));
+    writer.write_bytes(payload.bytes());
+
+    // Failing to write the cache only costs the next launch some time, so errors are ignored.
+    // Other processes may read the same entry, so it only appears under its name once it's complete.
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+
+    auto temporaryPath = path;
+    temporaryPath += std::format(".{}.tmp", getpid());
+    {
+        std::ofstream file(temporaryPath, std::ios::binary);
+        if (!file)
+            return;
+        file.write(reinterpret_cast<const char*>(writer.bytes().data()), writer.bytes().size());
+        if (!file)
+        {
+            file.close();
+            std::filesystem::remove(temporaryPath, error);
+            return;
+        }
+    }
+
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+        std::filesystem::remove(temporaryPath, error);
+}
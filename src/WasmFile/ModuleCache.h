@@ -0,0 +1,33 @@
+#pragma once
+
+#include "WasmFile.h"
+#include <cstdint>
+#include <filesystem>
+#include <span>
+
+// Keeps validated modules on disk after the whole module passes ran, so later launches of the same module
+// skip parsing, validation and optimization. Entries are keyed by the bytes of the module, the load options
+// and the build of wasvm, since the layout of the lowered code is only meaningful to the build that wrote it.
+class ModuleCache
+{
+public:
+    static constexpr uint64_t MAGIC = 0x4548434143575341; // "ASWCACHE"
+    static constexpr uint32_t FORMAT_VERSION = 2;
+
+    ModuleCache(std::filesystem::path directory);
+
+    // $WASVM_CACHE_DIR if it is set, no caching otherwise
+    static std::optional<std::filesystem::path> directory_from_environment();
+
+    // Only validated modules from contiguous streams are cached, everything else is read as usual.
+    // A missing, stale or damaged entry is replaced by the freshly read module.
+    Ref<WasmFile::WasmFile> read_from_stream(Stream& stream, WasmFile::LoadOptions options = {}) const;
+
+private:
+    std::filesystem::path path_for(uint64_t key) const;
+
+    Ref<WasmFile::WasmFile> load(const std::filesystem::path& path, std::span<const uint8_t> module, WasmFile::LoadOptions options) const;
+    void store(const std::filesystem::path& path, std::span<const uint8_t> module, const WasmFile::WasmFile& wasmFile) const;
+
+    std::filesystem::path m_directory;
+};
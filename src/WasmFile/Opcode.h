@@ -466,8 +466,32 @@ enum class Opcode
     i16x8_relaxed_q15mulr_s = 0xFD0111,
     i16x8_relaxed_dot_i8x16_i7x16_s = 0xFD0112,
     i32x4_relaxed_dot_i8x16_i7x16_add_s = 0xFD0113,
+
+    // Internal opcodes, they never appear in a binary and are only produced after validation
+    if_likely = 0xFF0000,
+    if_unlikely = 0xFF0001,
+    br_if_likely = 0xFF0002,
+    br_if_unlikely = 0xFF0003,
 };
 
+constexpr Opcode hinted_branch_opcode(Opcode opcode, bool likely)
+{
+    switch (opcode)
+    {
+        using enum Opcode;
+        case if_:
+        case if_likely:
+        case if_unlikely:
+            return likely ? if_likely : if_unlikely;
+        case br_if:
+        case br_if_likely:
+        case br_if_unlikely:
+            return likely ? br_if_likely : br_if_unlikely;
+        default:
+            return opcode;
+    }
+}
+
 enum class MultiByteFC
 {
     i32_trunc_sat_f32_s = 0,
@@ -0,0 +1,383 @@
+#include "Optimizer.h"
+#include "Labels.h"
+#include "Opcode.h"
+#include "VM/Operators.h"
+#include "VM/Value.h"
+#include <bit>
+#include <utility>
+
+static bool is_constant(Opcode opcode)
+{
+    switch (opcode)
+    {
+        using enum Opcode;
+        case i32_const:
+        case i64_const:
+        case f32_const:
+        case f64_const:
+        case v128_const:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Pushes exactly one value and has no other effect, so removing it together with its use is fine
+static bool is_pure_push(Opcode opcode)
+{
+    return is_constant(opcode) || opcode == Opcode::local_get || opcode == Opcode::global_get;
+}
+
+static bool ends_control_flow(Opcode opcode)
+{
+    switch (opcode)
+    {
+        using enum Opcode;
+        case unreachable:
+        case br:
+        case br_table:
+        case return_:
+        case return_call:
+        case return_call_indirect:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static Value constant_value(const Instruction& instruction)
+{
+    switch (instruction.opcode)
+    {
+        using enum Opcode;
+        case i32_const:
+            return instruction.get_arguments<uint32_t>();
+        case i64_const:
+            return instruction.get_arguments<uint64_t>();
+        case f32_const:
+            return instruction.get_arguments<float>();
+        case f64_const:
+            return instruction.get_arguments<double>();
+        case v128_const:
+            return instruction.get_arguments<uint128_t>();
+        default:
+            std::unreachable();
+    }
+}
+
+static std::optional<Instruction> constant_instruction(const Value& value)
+{
+    switch (value.get_type())
+    {
+        case Type::i32:
+            return Instruction { .opcode = Opcode::i32_const, .arguments = value.get<uint32_t>() };
+        case Type::i64:
+            return Instruction { .opcode = Opcode::i64_const, .arguments = value.get<uint64_t>() };
+        case Type::f32:
+            return Instruction { .opcode = Opcode::f32_const, .arguments = value.get<float>() };
+        case Type::f64:
+            return Instruction { .opcode = Opcode::f64_const, .arguments = value.get<double>() };
+        case Type::v128:
+            return Instruction { .opcode = Opcode::v128_const, .arguments = value.get<uint128_t>() };
+        default:
+            return {};
+    }
+}
+
+template <typename T>
+static std::optional<T> operand_as(const Value& value)
+{
+    if (!value.holds_alternative<ToValueType<T>>())
+        return {};
+    return std::bit_cast<T>(value.get<ToValueType<T>>());
+}
+
+// Operations that trap are left alone, so the trap still happens at runtime
+static std::optional<Value> fold_unary(Opcode opcode, const Value& operand)
+{
+    try
+    {
+        switch (opcode)
+        {
+            using enum Opcode;
+#define X(opcode, operation, type, resultType)      \
+    case opcode:                                    \
+        if (const auto a = operand_as<type>(operand)) \
+            return operation_##operation(*a);       \
+        return {};
+            ENUMERATE_UNARY_OPERATIONS(X)
+#undef X
+            default:
+                return {};
+        }
+    }
+    catch (const Trap&)
+    {
+        return {};
+    }
+}
+
+static std::optional<Value> fold_binary(Opcode opcode, const Value& lhs, const Value& rhs)
+{
+    try
+    {
+        switch (opcode)
+        {
+            using enum Opcode;
+#define X(opcode, operation, lhsType, rhsType, resultType)                 \
+    case opcode: {                                                         \
+        const auto a = operand_as<lhsType>(lhs);                           \
+        const auto b = operand_as<rhsType>(rhs);                           \
+        if (!a || !b)                                                      \
+            return {};                                                     \
+        return operation_##operation(*a, *b);                              \
+    }
+            ENUMERATE_BINARY_OPERATIONS(X)
+#undef X
+            default:
+                return {};
+        }
+    }
+    catch (const Trap&)
+    {
+        return {};
+    }
+}
+
+static bool is_unary_operation(Opcode opcode)
+{
+    switch (opcode)
+    {
+#define X(opcode, operation, type, resultType) case Opcode::opcode:
+        ENUMERATE_UNARY_OPERATIONS(X)
+#undef X
+        return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_binary_operation(Opcode opcode)
+{
+    switch (opcode)
+    {
+#define X(opcode, operation, lhsType, rhsType, resultType) case Opcode::opcode:
+        ENUMERATE_BINARY_OPERATIONS(X)
+#undef X
+        return true;
+        default:
+            return false;
+    }
+}
+
+Optimizer::Optimizer(WasmFile::WasmFile& wasmFile)
+    : m_wasmFile(wasmFile)
+    , m_imported_global_count(wasmFile.get_import_count_of_type(WasmFile::ImportType::Global))
+{
+    for (auto& code : wasmFile.codeBlocks)
+        optimize(code);
+}
+
+Optimizer::Optimizer(WasmFile::WasmFile& wasmFile, WasmFile::Code& code)
+    : m_wasmFile(wasmFile)
+    , m_imported_global_count(wasmFile.get_import_count_of_type(WasmFile::ImportType::Global))
+{
+    optimize(code);
+}
+
+void Optimizer::optimize(WasmFile::Code& code)
+{
+    auto& instructions = code.instructions;
+    const uint32_t size = instructions.size();
+
+    // Instructions something can branch to, the function level continuation is one past the end
+    std::vector<bool> isTarget(size + 1, false);
+    for (auto& instruction : instructions)
+    {
+        for_each_label(instruction, [&](Label& label) { isTarget[label.continuation] = true; });
+        for_each_else_location(instruction, [&](uint32_t& elseLocation) { isTarget[elseLocation + 1] = true; });
+    }
+
+    // Nothing may branch into the middle of a sequence that gets rewritten, the first instruction can stay a target
+    const auto has_target_after = [&](uint32_t first, uint32_t last) {
+        for (uint32_t ip = first + 1; ip <= last; ip++)
+            if (isTarget[ip])
+                return true;
+        return false;
+    };
+
+    std::vector<bool> removed(size, false);
+    // Instructions that survived so far, the rewrites only ever look at the last few
+    std::vector<uint32_t> kept;
+    kept.reserve(size);
+
+    const auto remove = [&](uint32_t ip) {
+        removed[ip] = true;
+        m_removed_instructions++;
+    };
+
+    const auto kept_instruction = [&](size_t fromBack) -> Instruction* {
+        if (kept.size() <= fromBack)
+            return nullptr;
+        return &instructions[kept[kept.size() - 1 - fromBack]];
+    };
+
+    for (uint32_t ip = 0; ip < size; ip++)
+    {
+        auto& instruction = instructions[ip];
+
+        if (instruction.opcode == Opcode::nop)
+        {
+            remove(ip);
+            continue;
+        }
+
+        if (instruction.opcode == Opcode::global_get)
+            if (auto constant = constant_global(instruction.get_arguments<uint32_t>()))
+                instruction = std::move(*constant);
+
+        const auto* previous = kept_instruction(0);
+
+        if (instruction.opcode == Opcode::end && previous && (previous->opcode == Opcode::block || previous->opcode == Opcode::loop) && !has_target_after(kept.back(), ip))
+        {
+            remove(kept.back());
+            remove(ip);
+            kept.pop_back();
+            continue;
+        }
+
+        if (instruction.opcode == Opcode::local_get && previous && previous->opcode == Opcode::local_set && previous->get_arguments<uint32_t>() == instruction.get_arguments<uint32_t>() && !isTarget[ip])
+        {
+            instructions[kept.back()].opcode = Opcode::local_tee;
+            remove(ip);
+            continue;
+        }
+
+        if (is_unary_operation(instruction.opcode) && previous && is_constant(previous->opcode) && !isTarget[ip])
+        {
+            if (const auto result = fold_unary(instruction.opcode, constant_value(*previous)))
+            {
+                if (auto folded = constant_instruction(*result))
+                {
+                    instructions[kept.back()] = std::move(*folded);
+                    remove(ip);
+                    continue;
+                }
+            }
+        }
+
+        if (is_binary_operation(instruction.opcode) && kept.size() >= 2)
+        {
+            const auto* lhs = kept_instruction(1);
+            if (is_constant(lhs->opcode) && is_constant(previous->opcode) && !has_target_after(kept[kept.size() - 2], ip))
+            {
+                if (const auto result = fold_binary(instruction.opcode, constant_value(*lhs), constant_value(*previous)))
+                {
+                    if (auto folded = constant_instruction(*result))
+                    {
+                        instructions[kept[kept.size() - 2]] = std::move(*folded);
+                        remove(kept.back());
+                        remove(ip);
+                        kept.pop_back();
+                        continue;
+                    }
+                }
+            }
+        }
+
+        if ((instruction.opcode == Opcode::select_ || instruction.opcode == Opcode::select_typed) && previous && previous->opcode == Opcode::i32_const && !has_target_after(kept.back(), ip))
+        {
+            if (previous->get_arguments<uint32_t>() != 0)
+            {
+                // The first value is selected, so only the second one has to go
+                remove(kept.back());
+                kept.pop_back();
+                instruction = Instruction { .opcode = Opcode::drop };
+            }
+            else if (kept.size() >= 3 && is_pure_push(kept_instruction(2)->opcode) && is_pure_push(kept_instruction(1)->opcode) && !has_target_after(kept[kept.size() - 3], ip))
+            {
+                // The second value is selected and the first one can be dropped at its source
+                const uint32_t second = kept[kept.size() - 2];
+                remove(kept[kept.size() - 3]);
+                remove(kept.back());
+                remove(ip);
+                kept.resize(kept.size() - 3);
+                kept.push_back(second);
+                continue;
+            }
+        }
+
+        kept.push_back(ip);
+
+        if (!ends_control_flow(instruction.opcode))
+            continue;
+
+        // Everything up to the end or else of the enclosing block is unreachable
+        uint32_t depth = 0;
+        uint32_t next = ip + 1;
+        for (; next < size; next++)
+        {
+            const auto opcode = instructions[next].opcode;
+            if (opcode == Opcode::block || opcode == Opcode::loop || opcode == Opcode::if_ || opcode == Opcode::if_likely || opcode == Opcode::if_unlikely)
+                depth++;
+            else if (opcode == Opcode::end && depth-- == 0)
+                break;
+            else if (opcode == Opcode::else_ && depth == 0)
+                break;
+
+            remove(next);
+        }
+
+        ip = next - 1;
+    }
+
+    if (kept.size() == size)
+        return;
+
+    // Removed instructions map to the next one that's kept, which is only ever reached through them anyway
+    std::vector<uint32_t> newIndices(size + 1);
+    uint32_t newIndex = 0;
+    for (uint32_t ip = 0; ip < size; ip++)
+    {
+        newIndices[ip] = newIndex;
+        if (!removed[ip])
+            newIndex++;
+    }
+    newIndices[size] = newIndex;
+
+    std::vector<Instruction> optimized;
+    optimized.reserve(newIndex);
+
+    for (uint32_t ip = 0; ip < size; ip++)
+    {
+        if (removed[ip])
+            continue;
+
+        auto& instruction = instructions[ip];
+        for_each_label(instruction, [&](Label& label) { label.continuation = newIndices[label.continuation]; });
+        for_each_else_location(instruction, [&](uint32_t& elseLocation) { elseLocation = newIndices[elseLocation]; });
+        optimized.push_back(std::move(instruction));
+    }
+
+    instructions = std::move(optimized);
+}
+
+std::optional<Instruction> Optimizer::constant_global(uint32_t index) const
+{
+    // Imported globals are only known after linking
+    if (index < m_imported_global_count)
+        return {};
+
+    const auto& global = m_wasmFile.globals[index - m_imported_global_count];
+    if (global.mutability != WasmFile::GlobalMutability::Constant)
+        return {};
+
+    const auto& initCode = global.initCode;
+    if (initCode.empty() || !is_constant(initCode[0].opcode))
+        return {};
+
+    if (initCode.size() > 2 || (initCode.size() == 2 && initCode[1].opcode != Opcode::end))
+        return {};
+
+    return initCode[0];
+}
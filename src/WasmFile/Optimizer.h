@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Parser.h"
+#include "WasmFile.h"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Peephole pass over validated code: folds constant expressions, propagates immutable globals, removes
+// unreachable code, nops and empty blocks, and merges local.set/local.get pairs. Instructions that are
+// removed are compacted away at the end, with every label and else location remapped to the new indices.
+class Optimizer
+{
+public:
+    Optimizer(WasmFile::WasmFile& wasmFile);
+    // Only optimizes the given function, for bodies that are decoded after the module was loaded
+    Optimizer(WasmFile::WasmFile& wasmFile, WasmFile::Code& code);
+
+    uint32_t removed_instruction_count() const { return m_removed_instructions; }
+
+private:
+    void optimize(WasmFile::Code& code);
+    std::optional<Instruction> constant_global(uint32_t index) const;
+
+    WasmFile::WasmFile& m_wasmFile;
+    uint32_t m_imported_global_count { 0 };
+
+    uint32_t m_removed_instructions { 0 };
+};
@@ -4,6 +4,7 @@
 #include "VM/Trap.h"
 #include "WasmFile.h"
 #include <cstdint>
+#include <span>
 
 enum class Opcode;
 
@@ -36,6 +37,8 @@ struct CallIndirectArguments
 {
     uint32_t typeIndex;
     uint32_t tableIndex;
+    // Slot of this call site in the inline cache of every instance
+    uint32_t cacheIndex;
 };
 
 struct MemoryInitArguments
@@ -98,4 +101,25 @@ struct Instruction
     }
 };
 
-std::vector<Instruction> parse(Stream& stream, Ref<WasmFile::WasmFile> wasmFile);
+// Decodes one instruction at a time. Labels and else locations depend on what follows, so they're left to the caller.
+class InstructionDecoder
+{
+public:
+    // Branch hint offsets are relative to bodyOffset and sorted
+    InstructionDecoder(Stream& stream, WasmFile::WasmFile& wasmFile, std::span<const WasmFile::BranchHint> branchHints = {}, uint64_t bodyOffset = 0);
+
+    Instruction next();
+
+private:
+    Opcode apply_branch_hint(Opcode opcode, uint64_t offset);
+
+    Stream& m_stream;
+    WasmFile::WasmFile& m_wasmFile;
+    std::span<const WasmFile::BranchHint> m_branch_hints;
+    size_t m_next_branch_hint { 0 };
+    uint64_t m_body_offset;
+};
+
+// Decodes up to the end of the outermost block and fills in the labels, without validating anything. Validated
+// function bodies go through Validator::decode_function instead, which does both in one pass.
+std::vector<Instruction> parse(Stream& stream, WasmFile::WasmFile& wasmFile, std::span<const WasmFile::BranchHint> branchHints = {}, uint64_t bodyOffset = 0);
@@ -68,14 +68,29 @@ enum class ValidatorLabelType
     IfAfterElse,
 };
 
+static constexpr uint32_t NO_PENDING_BRANCH = UINT32_MAX;
+
+// A branch out of a block whose end hasn't been decoded yet
+struct PendingBranch
+{
+    uint32_t ip;
+    // Into the labels of a br_table, its default label comes after those
+    uint32_t tableSlot;
+    uint32_t next;
+};
+
 struct ValidatorLabel
 {
     uint32_t stackHeight;
-    std::vector<Type> returnTypes;
-    std::vector<Type> paramTypes;
+    std::span<const Type> returnTypes;
+    std::span<const Type> paramTypes;
     ValidatorLabelType type;
     bool unreachable;
+    // The continuation of everything but a loop is filled in at its end
     Label label;
+    // The block or if instruction
+    uint32_t begin { 0 };
+    uint32_t pendingBranches { NO_PENDING_BRANCH };
 };
 
 class ValidatorStack : private Stack<ValidatorType>
@@ -108,7 +123,16 @@ public:
     using Stack::push;
     using Stack::size;
 
-    constexpr void push_label(const ValidatorLabel& label)
+    void reset()
+    {
+        clear();
+        m_labels.clear();
+        m_pending_branches.clear();
+    }
+
+    bool has_labels() const { return !m_labels.empty(); }
+
+    constexpr void push_label(ValidatorLabel label)
     {
         m_labels.push_back(std::move(label));
     }
@@ -119,12 +143,36 @@ public:
         m_labels.pop_back();
     }
 
-    ValidatorLabel get_label(uint32_t index)
+    ValidatorLabel& get_label(uint32_t index)
     {
         VALIDATION_ASSERT(index + 1 <= m_labels.size(), "Not enough labels");
         return m_labels[m_labels.size() - index - 1];
     }
 
+    // Branches to a loop go to its start, which is known already
+    void add_branch(ValidatorLabel& label, uint32_t ip, uint32_t tableSlot = 0)
+    {
+        if (label.type == ValidatorLabelType::Loop)
+            return;
+
+        m_pending_branches.push_back(PendingBranch { .ip = ip, .tableSlot = tableSlot, .next = label.pendingBranches });
+        label.pendingBranches = static_cast<uint32_t>(m_pending_branches.size() - 1);
+    }
+
+    void resolve_branches(const ValidatorLabel& label, std::vector<Instruction>& instructions)
+    {
+        for (auto i = label.pendingBranches; i != NO_PENDING_BRANCH; i = m_pending_branches[i].next)
+        {
+            const auto& branch = m_pending_branches[i];
+            auto& instruction = instructions[branch.ip];
+
+            if (auto* table = std::get_if<BranchTableArguments>(&instruction.arguments))
+                (branch.tableSlot < table->labels.size() ? table->labels[branch.tableSlot] : table->defaultLabel) = label.label;
+            else
+                instruction.arguments = label.label;
+        }
+    }
+
     ValidatorLabel& last_label()
     {
         assert(!m_labels.empty());
@@ -133,17 +181,18 @@ public:
 
 private:
     std::vector<ValidatorLabel> m_labels;
+    std::vector<PendingBranch> m_pending_branches;
 };
 
-Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
+Validator::Validator(WasmFile::WasmFile& wasmFile)
     : m_wasmFile(wasmFile)
 {
-    for (const auto& import : wasmFile->imports)
+    for (const auto& import : wasmFile.imports)
     {
         switch (import.type)
         {
             case WasmFile::ImportType::Function:
-                VALIDATION_ASSERT(import.functionTypeIndex < wasmFile->functionTypes.size(), "Invalid function type of import");
+                VALIDATION_ASSERT(import.functionTypeIndex < wasmFile.functionTypes.size(), "Invalid function type of import");
                 m_functions.push_back(import.functionTypeIndex);
                 break;
             case WasmFile::ImportType::Global:
@@ -167,19 +216,19 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
         }
     }
 
-    for (const auto index : wasmFile->functionTypeIndexes)
+    for (const auto index : wasmFile.functionTypeIndexes)
     {
-        VALIDATION_ASSERT(index < wasmFile->functionTypes.size(), "Invalid function typ index");
+        VALIDATION_ASSERT(index < wasmFile.functionTypes.size(), "Invalid function typ index");
         m_functions.push_back(index);
     }
 
-    for (const auto& global : wasmFile->globals)
+    for (const auto& global : wasmFile.globals)
     {
         validate_constant_expression(global.initCode, global.type, true);
         m_globals.push_back({ global.type, global.mutability });
     }
 
-    for (const auto& memory : wasmFile->memories)
+    for (const auto& memory : wasmFile.memories)
     {
         auto max_pages = memory.limits.address_type == AddressType::i64 ? MAX_WASM_PAGES_I64 : MAX_WASM_PAGES_I32;
 
@@ -189,12 +238,12 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
         m_memories.push_back(memory.limits.address_type);
     }
 
-    for (const auto& table : wasmFile->tables)
+    for (const auto& table : wasmFile.tables)
         m_tables.push_back({ table.refType, table.limits.address_type });
 
-    std::vector<std::string> usedExportNames;
+    std::vector<std::string_view> usedExportNames;
 
-    for (const auto& exp : wasmFile->exports)
+    for (const auto& exp : wasmFile.exports)
     {
         VALIDATION_ASSERT(!vector_contains(usedExportNames, exp.name), "Export name already used");
         usedExportNames.push_back(exp.name);
@@ -218,7 +267,7 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
         }
     }
 
-    for (const auto& element : wasmFile->elements)
+    for (const auto& element : wasmFile.elements)
     {
         if (element.mode == WasmFile::ElementMode::Active)
         {
@@ -226,8 +275,8 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
             VALIDATION_ASSERT(element.valueType == m_tables[element.table].first, "Invalid element type");
         }
 
-        for (const auto& expression : element.referencesExpr)
-            validate_constant_expression(expression, element.valueType, true);
+        for (size_t i = 0; i < element.reference_count(); i++)
+            validate_constant_expression(element.reference_expression(i), element.valueType, true);
 
         if (element.expr.size() > 0)
             validate_constant_expression(element.expr, type_from_address_type(m_tables[element.table].second), true);
@@ -241,7 +290,7 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
             {
                 if (element.functionIndexes.empty())
                 {
-                    Value referenceValue = run_global_restricted_constant_expression(element.referencesExpr[i]);
+                    Value referenceValue = run_global_restricted_constant_expression(element.reference_expression(i));
                     assert(referenceValue.holds_alternative<Reference>());
                     const auto reference = referenceValue.get<Reference>();
                     VALIDATION_ASSERT(reference.type == ReferenceType::Function);
@@ -255,7 +304,7 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
         }*/
     }
 
-    for (const auto& data : wasmFile->dataBlocks)
+    for (const auto& data : wasmFile.dataBlocks)
     {
         if (data.mode == WasmFile::ElementMode::Active)
         {
@@ -264,22 +313,22 @@ Validator::Validator(Ref<WasmFile::WasmFile> wasmFile)
         }
     }
 
-    for (size_t i = 0; i < wasmFile->functionTypeIndexes.size(); i++)
-        validate_function(wasmFile->functionTypes[wasmFile->functionTypeIndexes[i]], wasmFile->codeBlocks[i]);
-
-    if (wasmFile->startFunction)
+    if (wasmFile.startFunction)
     {
-        VALIDATION_ASSERT(*wasmFile->startFunction < m_functions.size(), "Invalid start function");
+        VALIDATION_ASSERT(*wasmFile.startFunction < m_functions.size(), "Invalid start function");
 
-        const auto& type = wasmFile->functionTypes[m_functions[*wasmFile->startFunction]];
+        const auto& type = wasmFile.functionTypes[m_functions[*wasmFile.startFunction]];
         VALIDATION_ASSERT(type.params.size() == 0, "Invalid start function type");
         VALIDATION_ASSERT(type.returns.size() == 0, "Invalid start function type");
     }
 }
 
-void Validator::validate_function(const WasmFile::FunctionType& functionType, WasmFile::Code& code)
+void Validator::decode_function(Stream& stream, const WasmFile::FunctionType& functionType, WasmFile::Code& code, std::span<const WasmFile::BranchHint> branchHints, uint64_t bodyOffset)
 {
-    ValidatorStack stack;
+    // Reused by every function validated on this thread, so the stacks keep their capacity
+    static thread_local ValidatorStack stack;
+    stack.reset();
+
     stack.push_label(ValidatorLabel {
         .stackHeight = 0,
         .returnTypes = functionType.returns,
@@ -287,7 +336,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
         .type = ValidatorLabelType::Entry,
         .unreachable = false,
         .label = Label {
-            .continuation = static_cast<uint32_t>(code.instructions.size()),
+            .continuation = 0,
             .arity = static_cast<uint32_t>(functionType.returns.size()),
             .stackHeight = 0 } });
 
@@ -333,8 +382,18 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
         stack.push(Type::v128);
     };
 
-    for (auto& instruction : code.instructions)
+    InstructionDecoder decoder(stream, m_wasmFile, branchHints, bodyOffset);
+    auto& instructions = code.instructions;
+
+    // The end of the function closes the entry label
+    while (stack.has_labels())
     {
+        VALIDATION_ASSERT(!stream.eof(), "Invalid code");
+
+        instructions.push_back(decoder.next());
+        auto& instruction = instructions.back();
+        const auto ip = static_cast<uint32_t>(instructions.size() - 1);
+
         switch (instruction.opcode)
         {
             using enum Opcode;
@@ -346,32 +405,42 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 break;
             case block:
             case loop: {
-                const auto& arguments = instruction.get_arguments<BlockLoopArguments>();
-                const auto& params = arguments.blockType.get_param_types(m_wasmFile);
+                // Copied, the arguments are replaced right away
+                const auto blockType = instruction.get_arguments<BlockLoopArguments>().blockType;
+                const auto params = blockType.get_param_types(m_wasmFile);
+                const auto returns = blockType.get_return_types(m_wasmFile);
                 instruction.arguments = {};
 
-                Label label = arguments.label;
-                label.stackHeight = static_cast<uint32_t>(stack.size() - arguments.blockType.get_param_types(m_wasmFile).size());
+                const bool isLoop = instruction.opcode == loop;
+                Label label = {
+                    .continuation = isLoop ? ip : 0,
+                    .arity = static_cast<uint32_t>(isLoop ? params.size() : returns.size()),
+                    .stackHeight = static_cast<uint32_t>(stack.size() - params.size()),
+                };
 
                 for (const auto type : std::views::reverse(params))
                     stack.expect(type);
 
                 stack.push_label(ValidatorLabel {
                     .stackHeight = stack.size(),
-                    .returnTypes = arguments.blockType.get_return_types(m_wasmFile),
+                    .returnTypes = returns,
                     .paramTypes = params,
-                    .type = instruction.opcode == loop ? ValidatorLabelType::Loop : ValidatorLabelType::Block,
+                    .type = isLoop ? ValidatorLabelType::Loop : ValidatorLabelType::Block,
                     .unreachable = false,
-                    .label = label });
+                    .label = label,
+                    .begin = ip });
 
                 for (const auto type : params)
                     stack.push(type);
 
                 break;
             }
-            case if_: {
+            case if_:
+            case if_likely:
+            case if_unlikely: {
                 const auto& arguments = instruction.get_arguments<IfArguments>();
-                const auto& params = arguments.blockType.get_param_types(m_wasmFile);
+                const auto params = arguments.blockType.get_param_types(m_wasmFile);
+                const auto returns = arguments.blockType.get_return_types(m_wasmFile);
 
                 stack.expect(Type::i32);
 
@@ -381,11 +450,15 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
 
                 stack.push_label(ValidatorLabel {
                     .stackHeight = stack.size(),
-                    .returnTypes = arguments.blockType.get_return_types(m_wasmFile),
+                    .returnTypes = returns,
                     .paramTypes = params,
                     .type = ValidatorLabelType::If,
                     .unreachable = false,
-                    .label = arguments.endLabel });
+                    .label = Label {
+                        .continuation = 0,
+                        .arity = static_cast<uint32_t>(returns.size()),
+                        .stackHeight = 0 },
+                    .begin = ip });
 
                 for (const auto type : params)
                     stack.push(type);
@@ -394,6 +467,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
             case else_: {
                 auto& label = stack.last_label();
                 VALIDATION_ASSERT(label.type == ValidatorLabelType::If, "Invalid else");
+                instructions[label.begin].get_arguments<IfArguments>().elseLocation = ip;
 
                 for (const auto type : std::views::reverse(label.returnTypes))
                     stack.expect(type);
@@ -421,11 +495,27 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 for (const auto type : label.returnTypes)
                     stack.push(type);
 
+                if (label.type != ValidatorLabelType::Loop)
+                {
+                    label.label.continuation = ip + 1;
+
+                    if (label.type == ValidatorLabelType::If || label.type == ValidatorLabelType::IfAfterElse)
+                    {
+                        auto& arguments = instructions[label.begin].get_arguments<IfArguments>();
+                        arguments.endLabel = label.label;
+                        if (arguments.elseLocation)
+                            instructions[*arguments.elseLocation].arguments = label.label;
+                    }
+
+                    stack.resolve_branches(label, instructions);
+                }
+
                 stack.pop_label();
                 break;
             }
             case br: {
-                const auto& label = stack.get_label(instruction.get_arguments<uint32_t>());
+                auto& label = stack.get_label(instruction.get_arguments<uint32_t>());
+                stack.add_branch(label, ip);
                 instruction.arguments = label.label;
 
                 if (label.type != ValidatorLabelType::Loop)
@@ -436,8 +526,11 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 stack.erase(stack.last_label().stackHeight, 0);
                 break;
             }
-            case br_if: {
-                const auto& label = stack.get_label(instruction.get_arguments<uint32_t>());
+            case br_if:
+            case br_if_likely:
+            case br_if_unlikely: {
+                auto& label = stack.get_label(instruction.get_arguments<uint32_t>());
+                stack.add_branch(label, ip);
                 instruction.arguments = label.label;
 
                 stack.expect(Type::i32);
@@ -459,12 +552,15 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
 
                 stack.expect(Type::i32);
 
-                const auto& defaultLabel = stack.get_label(arguments.defaultLabel);
+                auto& defaultLabel = stack.get_label(arguments.defaultLabel);
+                stack.add_branch(defaultLabel, ip, static_cast<uint32_t>(arguments.labels.size()));
 
                 std::vector<Label> labels;
+                labels.reserve(arguments.labels.size());
                 for (const auto& labelIndex : arguments.labels)
                 {
-                    const auto& label = stack.get_label(labelIndex);
+                    auto& label = stack.get_label(labelIndex);
+                    stack.add_branch(label, ip, static_cast<uint32_t>(labels.size()));
                     labels.push_back(label.label);
 
                     if (label.type != ValidatorLabelType::Loop)
@@ -510,7 +606,10 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
             case call: {
                 VALIDATION_ASSERT(instruction.get_arguments<uint32_t>() < m_functions.size(), "Invalid code");
 
-                const auto& calleeType = m_wasmFile->functionTypes[m_functions[instruction.get_arguments<uint32_t>()]];
+                if (!stack.last_label().unreachable)
+                    code.callSites.push_back(WasmFile::CallSite { .ip = ip, .stackHeight = stack.size() });
+
+                const auto& calleeType = m_wasmFile.functionTypes[m_functions[instruction.get_arguments<uint32_t>()]];
                 for (const auto type : std::views::reverse(calleeType.params))
                     stack.expect(type);
 
@@ -522,7 +621,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 const auto& arguments = instruction.get_arguments<CallIndirectArguments>();
 
                 VALIDATION_ASSERT(arguments.tableIndex < m_tables.size(), "Invalid code");
-                VALIDATION_ASSERT(arguments.typeIndex < m_wasmFile->functionTypes.size(), "Invalid code");
+                VALIDATION_ASSERT(arguments.typeIndex < m_wasmFile.functionTypes.size(), "Invalid code");
 
                 const auto& table = m_tables[arguments.tableIndex];
 
@@ -530,7 +629,11 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
 
                 stack.expect(table.second);
 
-                const auto& calleeType = m_wasmFile->functionTypes[arguments.typeIndex];
+                // Recorded without the table index, which is what the stack looks like if the call gets devirtualized
+                if (!stack.last_label().unreachable)
+                    code.callSites.push_back(WasmFile::CallSite { .ip = ip, .stackHeight = stack.size() });
+
+                const auto& calleeType = m_wasmFile.functionTypes[arguments.typeIndex];
                 for (const auto type : std::views::reverse(calleeType.params))
                     stack.expect(type);
 
@@ -541,7 +644,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
             case return_call: {
                 VALIDATION_ASSERT(instruction.get_arguments<uint32_t>() < m_functions.size(), "Invalid code");
 
-                const auto& calleeType = m_wasmFile->functionTypes[m_functions[instruction.get_arguments<uint32_t>()]];
+                const auto& calleeType = m_wasmFile.functionTypes[m_functions[instruction.get_arguments<uint32_t>()]];
                 for (const auto type : std::views::reverse(calleeType.params))
                     stack.expect(type);
 
@@ -557,7 +660,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 const auto& arguments = instruction.get_arguments<CallIndirectArguments>();
 
                 VALIDATION_ASSERT(arguments.tableIndex < m_tables.size(), "Invalid code");
-                VALIDATION_ASSERT(arguments.typeIndex < m_wasmFile->functionTypes.size(), "Invalid code");
+                VALIDATION_ASSERT(arguments.typeIndex < m_wasmFile.functionTypes.size(), "Invalid code");
 
                 const auto& table = m_tables[arguments.tableIndex];
 
@@ -565,7 +668,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
 
                 stack.expect(table.second);
 
-                const auto& calleeType = m_wasmFile->functionTypes[arguments.typeIndex];
+                const auto& calleeType = m_wasmFile.functionTypes[arguments.typeIndex];
                 for (const auto type : std::views::reverse(calleeType.params))
                     stack.expect(type);
 
@@ -713,18 +816,19 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 break;
 
             case memory_init: {
-                VALIDATION_ASSERT(m_wasmFile->dataCount, "Invalid code");
+                VALIDATION_ASSERT(m_wasmFile.dataCount, "Invalid code");
                 const auto& arguments = instruction.get_arguments<MemoryInitArguments>();
                 VALIDATION_ASSERT(arguments.memoryIndex < m_memories.size(), "Invalid code");
-                VALIDATION_ASSERT(arguments.dataIndex < m_wasmFile->dataBlocks.size(), "Invalid code");
+                // The data section may still be on its way while functions are validated, the count is checked against it after loading
+                VALIDATION_ASSERT(arguments.dataIndex < *m_wasmFile.dataCount, "Invalid code");
                 stack.expect(Type::i32);
                 stack.expect(Type::i32);
                 stack.expect(m_memories[arguments.memoryIndex]);
                 break;
             }
             case data_drop:
-                VALIDATION_ASSERT(m_wasmFile->dataCount, "Invalid data index from data.drop");
-                VALIDATION_ASSERT(instruction.get_arguments<uint32_t>() < m_wasmFile->dataBlocks.size(), "Invalid memory index from data.drop");
+                VALIDATION_ASSERT(m_wasmFile.dataCount, "Invalid data index from data.drop");
+                VALIDATION_ASSERT(instruction.get_arguments<uint32_t>() < *m_wasmFile.dataCount, "Invalid memory index from data.drop");
                 break;
             case memory_copy: {
                 const auto& arguments = instruction.get_arguments<MemoryCopyArguments>();
@@ -752,10 +856,10 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 const auto& arguments = instruction.get_arguments<TableInitArguments>();
 
                 VALIDATION_ASSERT(arguments.tableIndex < m_tables.size(), "Invalid table for table.init");
-                VALIDATION_ASSERT(arguments.elementIndex < m_wasmFile->elements.size(), "Invalid element for table.init");
+                VALIDATION_ASSERT(arguments.elementIndex < m_wasmFile.elements.size(), "Invalid element for table.init");
 
                 const auto& table = m_tables[arguments.tableIndex];
-                VALIDATION_ASSERT(table.first == m_wasmFile->elements[arguments.elementIndex].valueType, "Invalid element type for table.init");
+                VALIDATION_ASSERT(table.first == m_wasmFile.elements[arguments.elementIndex].valueType, "Invalid element type for table.init");
 
                 stack.expect(Type::i32);
                 stack.expect(Type::i32);
@@ -763,7 +867,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
                 break;
             }
             case elem_drop:
-                VALIDATION_ASSERT(instruction.get_arguments<uint32_t>() < m_wasmFile->elements.size(), "Invalid code");
+                VALIDATION_ASSERT(instruction.get_arguments<uint32_t>() < m_wasmFile.elements.size(), "Invalid code");
                 break;
             case table_copy: {
                 const auto& arguments = instruction.get_arguments<TableCopyArguments>();
@@ -943,7 +1047,7 @@ void Validator::validate_function(const WasmFile::FunctionType& functionType, Wa
     // VALIDATION_ASSERT(stack.size() == 0);
 }
 
-void Validator::validate_constant_expression(const std::vector<Instruction>& instructions, Type expectedReturnType, bool globalRestrictions)
+void Validator::validate_constant_expression(std::span<const Instruction> instructions, Type expectedReturnType, bool globalRestrictions)
 {
     ValidatorStack stack;
     // TODO: This is a hack to make the validator work with the current code
@@ -1015,7 +1119,7 @@ void Validator::validate_constant_expression(const std::vector<Instruction>& ins
     VALIDATION_ASSERT(stack.size() == 0, "Invalid code");
 }
 
-Value Validator::run_global_restricted_constant_expression(const std::vector<Instruction>& instructions)
+Value Validator::run_global_restricted_constant_expression(std::span<const Instruction> instructions)
 {
     ValueStack stack;
 
@@ -8,15 +8,21 @@ class Validator
 public:
     static constexpr uint64_t MAX_WASM_PAGES_I32 = 0x10000;
     static constexpr uint64_t MAX_WASM_PAGES_I64 = 0x1000000000000;
+    // Smaller code sections are decoded on the calling thread, starting the workers would take longer
+    static constexpr size_t MIN_PARALLEL_CODE_SIZE = 256 * 1024;
 
-    Validator(Ref<WasmFile::WasmFile> wasmFile);
+    // Validates everything but the function bodies, which are validated by decode_function
+    Validator(WasmFile::WasmFile& wasmFile);
+
+    // Decodes a body in a single pass that validates each instruction as it's read and lowers it to the form the VM
+    // runs. Only depends on the sections before the code, so bodies can be decoded on any thread once those are read.
+    void decode_function(Stream& stream, const WasmFile::FunctionType& type, WasmFile::Code& code, std::span<const WasmFile::BranchHint> branchHints = {}, uint64_t bodyOffset = 0);
 
 private:
-    void validate_function(const WasmFile::FunctionType& type, WasmFile::Code& code);
-    void validate_constant_expression(const std::vector<Instruction>& instructions, Type expectedReturnType, bool globalRestrictions);
-    Value run_global_restricted_constant_expression(const std::vector<Instruction>& instructions);
+    void validate_constant_expression(std::span<const Instruction> instructions, Type expectedReturnType, bool globalRestrictions);
+    Value run_global_restricted_constant_expression(std::span<const Instruction> instructions);
 
-    Ref<WasmFile::WasmFile> m_wasmFile;
+    WasmFile::WasmFile& m_wasmFile;
 
     uint32_t m_imported_global_count { 0 };
     std::vector<std::pair<Type, WasmFile::GlobalMutability>> m_globals;
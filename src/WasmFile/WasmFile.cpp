@@ -1,15 +1,63 @@
 #include "WasmFile.h"
+#include "CallGraph.h"
+#include "Inliner.h"
+#include "Opcode.h"
+#include "Optimizer.h"
 #include "Parser.h"
+#include "Stream/MappedFileStream.h"
 #include "Stream/MemoryStream.h"
+#include "Util/Parallel.h"
+#include "Util/ThreadPool.h"
 #include "Validator.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
 
 namespace WasmFile
 {
-    Ref<WasmFile> s_currentWasmFile;
+    static std::span<const uint8_t> read_bytes_into_arena(Stream& stream, WasmFile& wasmFile)
+    {
+        const uint32_t size = stream.read_leb<uint32_t>();
+        if (size > stream.size() - stream.offset())
+            throw StreamReadException();
+
+        const auto bytes = wasmFile.arena.allocate_array<uint8_t>(size);
+        stream.read(bytes.data(), size);
+        return bytes;
+    }
+
+    // Bytes of a mapped file are used in place unless that's turned off, everything else is copied into the arena
+    static std::span<const uint8_t> read_data_bytes(Stream& stream, WasmFile& wasmFile)
+    {
+        const auto& mapping = wasmFile.mapping;
+        if (!mapping || !stream.is_contiguous() || !wasmFile.loadOptions.mapData)
+            return read_bytes_into_arena(stream, wasmFile);
+
+        const auto bytes = stream.read_span(stream.read_leb<uint32_t>());
+        if (mapping->file_offset(bytes))
+            return bytes;
+        return wasmFile.arena.copy(bytes);
+    }
 
-    static std::vector<Instruction> parse_with_current_wasm_file(Stream& stream)
+    static std::string_view read_name(Stream& stream, WasmFile& wasmFile)
     {
-        return parse(stream, s_currentWasmFile);
+        const auto bytes = read_bytes_into_arena(stream, wasmFile);
+        const auto name = std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        if (!is_valid_utf8(name))
+            throw StreamReadException();
+        return name;
+    }
+
+    // Stream::read_vec for the entries that allocate in the module they're read into
+    template <typename T>
+    static std::vector<T> read_vec(Stream& stream, WasmFile& wasmFile)
+    {
+        uint32_t size = stream.read_leb<uint32_t>();
+        std::vector<T> vec;
+        for (uint32_t i = 0; i < size; i++)
+            vec.push_back(T::read_from_stream(stream, wasmFile));
+        return vec;
     }
 
     Limits Limits::read_from_stream(Stream& stream)
@@ -76,10 +124,10 @@ namespace WasmFile
         };
     }
 
-    Import Import::read_from_stream(Stream& stream)
+    Import Import::read_from_stream(Stream& stream, WasmFile& wasmFile)
     {
-        std::string environment = stream.read_typed<std::string>();
-        std::string name = stream.read_typed<std::string>();
+        const auto environment = read_name(stream, wasmFile);
+        const auto name = read_name(stream, wasmFile);
 
         uint8_t type = stream.read_leb<uint8_t>();
         switch (type)
@@ -141,7 +189,7 @@ namespace WasmFile
         };
     }
 
-    Global Global::read_from_stream(Stream& stream)
+    Global Global::read_from_stream(Stream& stream, WasmFile& wasmFile)
     {
         auto type = read_type_from_stream(stream);
         auto mut = (GlobalMutability)stream.read_little_endian<uint8_t>();
@@ -152,20 +200,20 @@ namespace WasmFile
         return Global {
             .type = type,
             .mutability = mut,
-            .initCode = parse(stream, s_currentWasmFile),
+            .initCode = parse(stream, wasmFile),
         };
     }
 
-    Export Export::read_from_stream(Stream& stream)
+    Export Export::read_from_stream(Stream& stream, WasmFile& wasmFile)
     {
         return Export {
-            .name = stream.read_typed<std::string>(),
+            .name = read_name(stream, wasmFile),
             .type = (ImportType)stream.read_little_endian<uint8_t>(), // FIXME: Don't rely on casts
             .index = stream.read_leb<uint32_t>(),
         };
     }
 
-    Element Element::read_from_stream(Stream& stream)
+    Element Element::read_from_stream(Stream& stream, WasmFile& wasmFile)
     {
         uint32_t type = stream.read_leb<uint32_t>();
 
@@ -189,7 +237,7 @@ namespace WasmFile
         {
             element.mode = ElementMode::Active;
             element.table = has_table_index ? stream.read_leb<uint32_t>() : 0;
-            element.expr = parse(stream, s_currentWasmFile);
+            element.expr = parse(stream, wasmFile);
         }
 
         element.valueType = Type::funcref;
@@ -209,13 +257,29 @@ namespace WasmFile
         }
 
         if (has_element_expressions)
-            element.referencesExpr = stream.read_vec_with_function<std::vector<Instruction>, parse_with_current_wasm_file>();
+        {
+            const uint32_t count = stream.read_leb<uint32_t>();
+            for (uint32_t i = 0; i < count; i++)
+            {
+                auto expression = parse(stream, wasmFile);
+                element.referencesCode.insert(element.referencesCode.end(), std::make_move_iterator(expression.begin()), std::make_move_iterator(expression.end()));
+                element.referencesEnds.push_back(element.referencesCode.size());
+            }
+        }
         else
+        {
             element.functionIndexes = stream.read_vec<uint32_t>();
+        }
 
         return element;
     }
 
+    std::span<const Instruction> Element::reference_expression(size_t index) const
+    {
+        const uint32_t begin = index == 0 ? 0 : referencesEnds[index - 1];
+        return std::span(referencesCode).subspan(begin, referencesEnds[index] - begin);
+    }
+
     Local Local::read_from_stream(Stream& stream)
     {
         return Local {
@@ -224,11 +288,8 @@ namespace WasmFile
         };
     }
 
-    Code Code::read_from_stream(Stream& stream)
+    static std::span<const Type> read_locals(Stream& stream, WasmFile& wasmFile)
     {
-        // Skip size
-        stream.read_leb<uint32_t>();
-
         std::vector<Local> locals = stream.read_vec<Local>();
 
         uint64_t count = 0;
@@ -238,18 +299,73 @@ namespace WasmFile
         if (count > UINT32_MAX)
             throw InvalidWASMException("Too many locals");
 
-        std::vector<Type> localTypes;
+        const auto localTypes = wasmFile.arena.allocate_array<Type>(count);
+        size_t next = 0;
         for (const auto& local : locals)
-            for (size_t i = 0; i < local.count; i++)
-                localTypes.push_back(local.type);
+        {
+            std::fill_n(localTypes.begin() + next, local.count, local.type);
+            next += local.count;
+        }
+
+        return localTypes;
+    }
+
+    Code Code::read_from_stream(Stream& stream, WasmFile& wasmFile, std::span<const BranchHint> branchHints)
+    {
+        // Skip size
+        stream.read_leb<uint32_t>();
+
+        const uint64_t bodyOffset = stream.offset();
+        const auto locals = read_locals(stream, wasmFile);
 
         return Code {
-            .locals = localTypes,
-            .instructions = parse(stream, s_currentWasmFile),
+            .locals = locals,
+            .instructions = parse(stream, wasmFile, branchHints, bodyOffset),
         };
     }
 
-    Data Data::read_from_stream(Stream& stream)
+    Code Code::read_from_stream(Stream& stream, WasmFile& wasmFile, Validator& validator, const FunctionType& type, std::span<const BranchHint> branchHints)
+    {
+        // Skip size
+        stream.read_leb<uint32_t>();
+
+        const uint64_t bodyOffset = stream.offset();
+
+        Code code { .locals = read_locals(stream, wasmFile) };
+        validator.decode_function(stream, type, code, branchHints, bodyOffset);
+        return code;
+    }
+
+    static std::unordered_map<uint32_t, std::vector<BranchHint>> read_branch_hints(Stream& stream)
+    {
+        std::unordered_map<uint32_t, std::vector<BranchHint>> branchHints;
+
+        uint32_t functionCount = stream.read_leb<uint32_t>();
+        for (uint32_t i = 0; i < functionCount; i++)
+        {
+            uint32_t functionIndex = stream.read_leb<uint32_t>();
+            auto& hints = branchHints[functionIndex];
+
+            uint32_t hintCount = stream.read_leb<uint32_t>();
+            for (uint32_t j = 0; j < hintCount; j++)
+            {
+                uint32_t offset = stream.read_leb<uint32_t>();
+                uint32_t size = stream.read_leb<uint32_t>();
+                uint8_t value = stream.read_little_endian<uint8_t>();
+
+                if (size != 1 || value > 1)
+                    throw StreamReadException();
+
+                hints.push_back(BranchHint { .offset = offset, .likely = value == 1 });
+            }
+
+            std::ranges::sort(hints, {}, &BranchHint::offset);
+        }
+
+        return branchHints;
+    }
+
+    Data Data::read_from_stream(Stream& stream, WasmFile& wasmFile)
     {
         uint32_t type = stream.read_leb<uint32_t>();
         switch (type)
@@ -258,8 +374,8 @@ namespace WasmFile
                 return Data {
                     .type = type,
                     .memoryIndex = 0,
-                    .expr = parse(stream, s_currentWasmFile),
-                    .data = stream.read_vec<uint8_t>(),
+                    .expr = parse(stream, wasmFile),
+                    .data = read_data_bytes(stream, wasmFile),
                     .mode = ElementMode::Active,
                 };
             case 1:
@@ -267,15 +383,15 @@ namespace WasmFile
                     .type = type,
                     .memoryIndex = (uint32_t)-1,
                     .expr = {},
-                    .data = stream.read_vec<uint8_t>(),
+                    .data = read_data_bytes(stream, wasmFile),
                     .mode = ElementMode::Passive,
                 };
             case 2:
                 return Data {
                     .type = type,
                     .memoryIndex = stream.read_leb<uint32_t>(),
-                    .expr = parse(stream, s_currentWasmFile),
-                    .data = stream.read_vec<uint8_t>(),
+                    .expr = parse(stream, wasmFile),
+                    .data = read_data_bytes(stream, wasmFile),
                     .mode = ElementMode::Active,
                 };
             default:
@@ -283,12 +399,207 @@ namespace WasmFile
         }
     }
 
-    Ref<WasmFile> WasmFile::read_from_stream(Stream& stream, bool runValidator)
+    // The next body together with its size field, every way of decoding a body stops at the end of these bytes
+    static std::span<const uint8_t> read_body_bytes(Stream& sectionStream)
+    {
+        const size_t begin = sectionStream.offset();
+        const uint32_t size = sectionStream.read_leb<uint32_t>();
+        const size_t sizeFieldLength = sectionStream.offset() - begin;
+        sectionStream.move_to(begin);
+        return sectionStream.read_span(sizeFieldLength + size);
+    }
+
+    // Without a validator the body is only decoded
+    static Code read_body(std::span<const uint8_t> body, WasmFile& wasm, std::span<const BranchHint> branchHints, Validator* validator = nullptr, const FunctionType* type = nullptr)
+    {
+        MemoryStream bodyStream(body);
+        auto code = validator ? Code::read_from_stream(bodyStream, wasm, *validator, *type, branchHints) : Code::read_from_stream(bodyStream, wasm, branchHints);
+        if (!bodyStream.eof())
+            throw InvalidWASMException("Function body size mismatch");
+        return code;
+    }
+
+    static std::span<const BranchHint> find_branch_hints(const WasmFile& wasm, uint32_t functionIndex)
+    {
+        if (const auto it = wasm.branchHints.find(functionIndex); it != wasm.branchHints.end())
+            return it->second;
+        return {};
+    }
+
+    // Bodies don't depend on each other, so large code sections are decoded on every core. The error of the first
+    // invalid body by index is reported, so the result doesn't depend on scheduling.
+    static void read_bodies(WasmFile& wasm, std::span<const std::span<const uint8_t>> bodies, Validator* validator)
+    {
+        const uint32_t importedFunctionCount = wasm.get_import_count_of_type(ImportType::Function);
+        wasm.codeBlocks.resize(bodies.size());
+
+        const auto read = [&](size_t i) {
+            const FunctionType* type = validator ? &wasm.functionTypes[wasm.functionTypeIndexes[i]] : nullptr;
+            wasm.codeBlocks[i] = read_body(bodies[i], wasm, find_branch_hints(wasm, importedFunctionCount + i), validator, type);
+        };
+
+        size_t codeSize = 0;
+        for (const auto& body : bodies)
+            codeSize += body.size();
+
+        if (codeSize < Validator::MIN_PARALLEL_CODE_SIZE)
+        {
+            for (size_t i = 0; i < bodies.size(); i++)
+                read(i);
+            return;
+        }
+
+        std::vector<std::exception_ptr> errors(bodies.size());
+        std::atomic<size_t> firstError = bodies.size();
+        parallel_for(bodies.size(), [&](size_t i) {
+            if (i > firstError.load(std::memory_order_relaxed))
+                return;
+
+            try
+            {
+                read(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+                size_t current = firstError.load(std::memory_order_relaxed);
+                while (i < current && !firstError.compare_exchange_weak(current, i, std::memory_order_relaxed))
+                    ;
+            }
+        });
+
+        for (const auto& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+    }
+
+    // Hands every body to decode as soon as its bytes have arrived instead of waiting for the whole section, so work
+    // on the first functions can start while the rest is still being read from a slow stream
+    static void read_code_section_incrementally(Stream& stream, std::span<uint8_t> section, WasmFile& wasm, const std::function<void(uint32_t, std::span<const uint8_t>, std::span<const BranchHint>)>& decode)
+    {
+        size_t received = 0;
+        const auto receive_until = [&](size_t end) {
+            end = std::min(end, section.size());
+            if (end <= received)
+                return;
+            stream.read(section.data() + received, end - received);
+            received = end;
+        };
+
+        size_t position = 0;
+        const auto read_size = [&]() {
+            receive_until(position + 5);
+            MemoryStream sizeStream(section.subspan(position, received - position));
+            const uint32_t value = sizeStream.read_leb<uint32_t>();
+            position += sizeStream.offset();
+            return value;
+        };
+
+        const uint32_t codeCount = read_size();
+        // Every body takes at least one byte
+        if (codeCount > section.size())
+            throw StreamReadException();
+        if (codeCount != wasm.functionTypeIndexes.size())
+            throw InvalidWASMException("Function count doesnt match code count");
+
+        const uint32_t importedFunctionCount = wasm.get_import_count_of_type(ImportType::Function);
+        wasm.codeBlocks.resize(codeCount);
+
+        for (uint32_t i = 0; i < codeCount; i++)
+        {
+            const size_t bodyBegin = position;
+            const uint32_t bodySize = read_size();
+            if (bodySize > section.size() - position)
+                throw StreamReadException();
+
+            receive_until(position + bodySize);
+            decode(i, section.subspan(bodyBegin, position + bodySize - bodyBegin), find_branch_hints(wasm, importedFunctionCount + i));
+            position += bodySize;
+        }
+
+        if (position != section.size())
+            throw InvalidWASMException("Extra data at the end of a section");
+    }
+
+    static Code parse_lazy_body(WasmFile& wasm, const Code& code, Validator* validator = nullptr, const FunctionType* type = nullptr)
+    {
+        const auto body = std::span<const uint8_t>(wasm.lazyCode).subspan(code.lazyBody->offset, code.lazyBody->size);
+        return read_body(body, wasm, code.lazyBody->branchHints, validator, type);
+    }
+
+    // Decodes the bodies reachable from the exports, the start function and every reference in the module.
+    // Indirect calls can only reach functions that are referenced somewhere, so those cover them too.
+    static uint32_t decode_reachable_code(WasmFile& wasm, Validator* validator)
+    {
+        const uint32_t importedFunctionCount = wasm.get_import_count_of_type(ImportType::Function);
+        const uint32_t functionCount = importedFunctionCount + wasm.codeBlocks.size();
+
+        std::vector<bool> reached(functionCount, false);
+        std::vector<uint32_t> pending;
+
+        // Indices that are out of range are reported by the validator
+        const auto reach = [&](uint32_t function) {
+            if (function < functionCount && !reached[function])
+            {
+                reached[function] = true;
+                pending.push_back(function);
+            }
+        };
+
+        const auto reach_references = [&](std::span<const Instruction> instructions) {
+            for (const auto& instruction : instructions)
+                if (instruction.opcode == Opcode::ref_func)
+                    reach(instruction.get_arguments<uint32_t>());
+        };
+
+        for (const auto& exp : wasm.exports)
+            if (exp.type == ImportType::Function)
+                reach(exp.index);
+
+        if (wasm.startFunction)
+            reach(*wasm.startFunction);
+
+        for (const auto& global : wasm.globals)
+            reach_references(global.initCode);
+
+        for (const auto& element : wasm.elements)
+        {
+            for (const auto function : element.functionIndexes)
+                reach(function);
+            reach_references(element.referencesCode);
+        }
+
+        while (!pending.empty())
+        {
+            const uint32_t function = pending.back();
+            pending.pop_back();
+
+            if (function < importedFunctionCount)
+                continue;
+
+            const uint32_t codeIndex = function - importedFunctionCount;
+            const FunctionType* type = validator ? &wasm.functionTypes[wasm.functionTypeIndexes[codeIndex]] : nullptr;
+            auto& code = wasm.codeBlocks[codeIndex];
+            code = parse_lazy_body(wasm, code, validator, type);
+
+            for (const auto& instruction : code.instructions)
+            {
+                if (instruction.opcode == Opcode::call || instruction.opcode == Opcode::return_call)
+                    reach(instruction.get_arguments<uint32_t>());
+            }
+            reach_references(code.instructions);
+        }
+
+        return std::ranges::count_if(wasm.codeBlocks, [](const Code& code) { return code.lazyBody.has_value(); });
+    }
+
+    Ref<WasmFile> WasmFile::read_from_stream(Stream& stream, LoadOptions options)
     {
         try
         {
             Ref<WasmFile> wasm = MakeRef<WasmFile>();
-            s_currentWasmFile = wasm;
+            wasm->loadOptions = options;
+            wasm->mapping = stream.mapping();
 
             uint32_t signature = stream.read_little_endian<uint32_t>();
             uint32_t version = stream.read_little_endian<uint32_t>();
@@ -299,8 +610,22 @@ namespace WasmFile
             if (version != 1)
                 throw InvalidWASMException("Invalid WASM version");
 
+            wasm->contentHash = fnv1a_hash(&signature, sizeof(signature));
+            wasm->contentHash = fnv1a_hash(&version, sizeof(version), wasm->contentHash);
+
             std::vector<Section> foundSections;
 
+            // Pruning starts out like lazy loading and decodes the reachable bodies once every root is known
+            const bool deferBodies = options.lazy || options.pruneUnreachable;
+
+            // Validates the bodies as they're decoded, null if the sections before the code don't validate. That's
+            // reported by the validation after loading.
+            Own<Validator> codeValidator;
+            // Bodies that arrive through a stream are decoded on workers while the rest of the module is still being read
+            std::vector<std::exception_ptr> streamingErrors;
+            std::vector<uint8_t> streamedCode;
+            Own<ThreadPool> validationPool;
+
             while (!stream.eof())
             {
                 Section tag = (Section)stream.read_little_endian<uint8_t>();
@@ -310,21 +635,98 @@ namespace WasmFile
                     throw InvalidWASMException("Duplicate sections");
                 foundSections.push_back(tag);
 
-                std::vector<uint8_t> section(size);
-                stream.read((void*)section.data(), size);
+                // The workers read everything but the data section, which is the only one expected after the code anyway
+                if (validationPool && tag != Section::Custom && tag != Section::Data)
+                    validationPool->wait();
 
-                MemoryStream sectionStream((char*)section.data(), size);
+                // Everything the bodies refer to has arrived by now
+                if (tag == Section::Code && options.validate && !options.lazy)
+                {
+                    try
+                    {
+                        codeValidator = MakeOwn<Validator>(*wasm);
+                    }
+                    catch (const InvalidWASMException&)
+                    {
+                    }
+                }
+
+                // Memory backed streams are parsed in place, everything else is copied one section at a time
+                std::vector<uint8_t> sectionCopy;
+                std::span<const uint8_t> section;
+                const bool decodeWhileReading = tag == Section::Code && !stream.is_contiguous() && !deferBodies;
+                if (stream.is_contiguous())
+                {
+                    section = stream.read_span(size);
+                }
+                else if (decodeWhileReading)
+                {
+                    if (codeValidator)
+                    {
+                        streamingErrors.resize(wasm->functionTypeIndexes.size());
+                        validationPool = MakeOwn<ThreadPool>();
+                    }
+
+                    // Outlives the section, the workers are still decoding from it
+                    streamedCode.resize(size);
+                    read_code_section_incrementally(stream, streamedCode, *wasm, [&](uint32_t i, std::span<const uint8_t> body, std::span<const BranchHint> branchHints) {
+                        if (!validationPool)
+                        {
+                            wasm->codeBlocks[i] = read_body(body, *wasm, branchHints);
+                            return;
+                        }
+
+                        // The hints are cleared once the section is read
+                        validationPool->submit([&, i, body, branchHints = std::vector(branchHints.begin(), branchHints.end())]() {
+                            try
+                            {
+                                wasm->codeBlocks[i] = read_body(body, *wasm, branchHints, codeValidator.get(), &wasm->functionTypes[wasm->functionTypeIndexes[i]]);
+                            }
+                            catch (...)
+                            {
+                                streamingErrors[i] = std::current_exception();
+                            }
+                        });
+                    });
+                    section = streamedCode;
+                }
+                else
+                {
+                    sectionCopy.resize(size);
+                    stream.read((void*)sectionCopy.data(), size);
+                    section = sectionCopy;
+                }
+
+                wasm->contentHash = fnv1a_hash(&tag, sizeof(tag), wasm->contentHash);
+                wasm->contentHash = fnv1a_hash(section.data(), section.size(), wasm->contentHash);
+
+                MemoryStream sectionStream(section);
                 switch (tag)
                 {
-                    case Section::Custom:
-                        sectionStream.read_typed<std::string>();
+                    case Section::Custom: {
+                        const auto name = sectionStream.read_typed<std::string>();
+
+                        // Hints never affect semantics, so a malformed section is ignored instead of rejecting the module
+                        if (name == "metadata.code.branch_hint")
+                        {
+                            try
+                            {
+                                wasm->branchHints = read_branch_hints(sectionStream);
+                            }
+                            catch (const StreamReadException&)
+                            {
+                                wasm->branchHints.clear();
+                            }
+                        }
+
                         sectionStream.move_to(sectionStream.size());
                         break;
+                    }
                     case Section::Type:
                         wasm->functionTypes = sectionStream.read_vec<FunctionType>();
                         break;
                     case Section::Import:
-                        wasm->imports = sectionStream.read_vec<Import>();
+                        wasm->imports = read_vec<Import>(sectionStream, *wasm);
                         break;
                     case Section::Function:
                         wasm->functionTypeIndexes = sectionStream.read_vec<uint32_t>();
@@ -336,22 +738,64 @@ namespace WasmFile
                         wasm->memories = sectionStream.read_vec<Memory>();
                         break;
                     case Section::Global:
-                        wasm->globals = sectionStream.read_vec<Global>();
+                        wasm->globals = read_vec<Global>(sectionStream, *wasm);
                         break;
                     case Section::Export:
-                        wasm->exports = sectionStream.read_vec<Export>();
+                        wasm->exports = read_vec<Export>(sectionStream, *wasm);
                         break;
                     case Section::Start:
                         wasm->startFunction = sectionStream.read_leb<uint32_t>();
                         break;
                     case Section::Element:
-                        wasm->elements = sectionStream.read_vec<Element>();
+                        wasm->elements = read_vec<Element>(sectionStream, *wasm);
                         break;
-                    case Section::Code:
-                        wasm->codeBlocks = sectionStream.read_vec<Code>();
+                    case Section::Code: {
+                        if (decodeWhileReading)
+                        {
+                            wasm->branchHints.clear();
+                            sectionStream.move_to(sectionStream.size());
+                            break;
+                        }
+
+                        const uint32_t importedFunctionCount = wasm->get_import_count_of_type(ImportType::Function);
+
+                        if (deferBodies)
+                            wasm->lazyCode.assign(section.begin(), section.end());
+
+                        uint32_t codeCount = sectionStream.read_leb<uint32_t>();
+                        if (codeCount != wasm->functionTypeIndexes.size())
+                            throw InvalidWASMException("Function count doesnt match code count");
+
+                        std::vector<std::span<const uint8_t>> bodies;
+                        for (uint32_t i = 0; i < codeCount; i++)
+                        {
+                            if (deferBodies)
+                            {
+                                const uint32_t offset = sectionStream.offset();
+                                const auto body = read_body_bytes(sectionStream);
+                                const auto branchHints = find_branch_hints(*wasm, importedFunctionCount + i);
+
+                                wasm->codeBlocks.push_back(Code {
+                                    .lazyBody = LazyBody {
+                                        .offset = offset,
+                                        .size = static_cast<uint32_t>(body.size()),
+                                        .branchHints = std::vector(branchHints.begin(), branchHints.end()),
+                                    },
+                                });
+                                continue;
+                            }
+
+                            bodies.push_back(read_body_bytes(sectionStream));
+                        }
+
+                        if (!deferBodies)
+                            read_bodies(*wasm, bodies, codeValidator.get());
+
+                        wasm->branchHints.clear();
                         break;
+                    }
                     case Section::Data:
-                        wasm->dataBlocks = sectionStream.read_vec<Data>();
+                        wasm->dataBlocks = read_vec<Data>(sectionStream, *wasm);
                         break;
                     case Section::DataCount: {
                         wasm->dataCount = sectionStream.read_leb<uint32_t>();
@@ -372,10 +816,53 @@ namespace WasmFile
                 if (wasm->dataBlocks.size() != wasm->dataCount)
                     throw InvalidWASMException("Data counts do not match");
 
-            s_currentWasmFile = nullptr;
+            if (options.pruneUnreachable && !options.lazy)
+            {
+                wasm->prunedFunctionCount = decode_reachable_code(*wasm, codeValidator.get());
+                if (wasm->prunedFunctionCount == 0)
+                    wasm->lazyCode = {};
+            }
+
+            if (options.validate && options.lazy)
+            {
+                // Whole module passes need every body, so lazily loaded modules only get the per function ones
+                wasm->lazyValidator = MakeRef<Validator>(*wasm);
+            }
+            else if (options.validate)
+            {
+                // A body that failed while streaming is reported as is, before any module level error it may have caused
+                if (validationPool)
+                {
+                    validationPool->wait();
+                    for (const auto& error : streamingErrors)
+                        if (error)
+                            std::rethrow_exception(error);
+                }
+
+                // The bodies were validated while they were decoded
+                const auto validator = MakeRef<Validator>(*wasm);
+
+                wasm->callGraph = MakeRef<CallGraph>(*wasm);
+                wasm->devirtualizedCallCount = wasm->callGraph->devirtualized_call_count();
 
-            if (runValidator)
-                Validator validator = Validator(wasm);
+                // Runs after the call graph, so devirtualized calls can be inlined too
+                Inliner inliner = Inliner(*wasm);
+                wasm->inlinedCallCount = inliner.inlined_call_count();
+
+                // Runs last, so it also cleans up the code the inliner spliced in
+                if (options.optimize)
+                {
+                    Optimizer optimizer = Optimizer(*wasm);
+                    wasm->removedInstructionCount = optimizer.removed_instruction_count();
+                }
+
+                if (wasm->inlinedCallCount > 0 || wasm->removedInstructionCount > 0)
+                    wasm->callGraph->update_summaries();
+
+                // Pruned bodies are never called, but are still handled like lazy ones in case one is
+                if (wasm->prunedFunctionCount > 0)
+                    wasm->lazyValidator = validator;
+            }
 
             return wasm;
         }
@@ -385,6 +872,34 @@ namespace WasmFile
         }
     }
 
+    void WasmFile::decode_lazy_code(const FunctionType& type, Code& code)
+    {
+        Code decoded;
+        try
+        {
+            decoded = parse_lazy_body(*this, code, lazyValidator.get(), &type);
+        }
+        catch (const StreamReadException&)
+        {
+            throw InvalidWASMException("Stream read failed");
+        }
+
+        if (lazyValidator)
+        {
+            decoded.callSites.clear();
+
+            if (loadOptions.optimize)
+            {
+                Optimizer optimizer = Optimizer(*this, decoded);
+                removedInstructionCount += optimizer.removed_instruction_count();
+            }
+        }
+
+        code.locals = std::move(decoded.locals);
+        code.instructions = std::move(decoded.instructions);
+        code.lazyBody.reset();
+    }
+
     std::optional<Export> WasmFile::find_export_by_name(std::string_view name)
     {
         for (const auto& exportValue : exports)
@@ -421,32 +936,42 @@ namespace WasmFile
         }
     }
 
-    std::vector<Type> BlockType::get_param_types(Ref<WasmFile> wasmFile) const
+    static std::span<const Type> single_type_span(Type type)
+    {
+        static constexpr Type VALUE_TYPES[] = { Type::i32, Type::i64, Type::f32, Type::f64, Type::v128, Type::funcref, Type::externref };
+
+        const auto* it = std::ranges::find(VALUE_TYPES, type);
+        if (it == std::end(VALUE_TYPES))
+            throw InvalidWASMException("Invalid block type");
+        return std::span(it, 1);
+    }
+
+    std::span<const Type> BlockType::get_param_types(const WasmFile& wasmFile) const
     {
         if (index == UINT64_MAX)
             return {};
 
-        if (index >= wasmFile->functionTypes.size())
+        if (index >= wasmFile.functionTypes.size())
             throw InvalidWASMException(std::format("Invalid block type index: {}", index));
 
-        const auto& functionType = wasmFile->functionTypes[index];
+        const auto& functionType = wasmFile.functionTypes[index];
         return functionType.params;
     }
 
-    std::vector<Type> BlockType::get_return_types(Ref<WasmFile> wasmFile) const
+    std::span<const Type> BlockType::get_return_types(const WasmFile& wasmFile) const
     {
         if (index == UINT64_MAX)
         {
             if (type.has_value())
-                return { type.value() };
+                return single_type_span(type.value());
             else
                 return {};
         }
 
-        if (index >= wasmFile->functionTypes.size())
+        if (index >= wasmFile.functionTypes.size())
             throw InvalidWASMException(std::format("Invalid block type index: {}", index));
 
-        const auto& functionType = wasmFile->functionTypes[index];
+        const auto& functionType = wasmFile.functionTypes[index];
         return functionType.returns;
     }
 }
@@ -1,16 +1,25 @@
 #pragma once
 
 #include "Stream/Stream.h"
+#include "Util/Arena.h"
 #include "VM/Type.h"
+#include <atomic>
 #include <cstdint>
+#include <mutex>
 #include <optional>
+#include <span>
+#include <unordered_map>
 
 struct Instruction;
+class CallGraph;
+class Validator;
 
 namespace WasmFile
 {
     constexpr uint32_t WASM_SIGNATURE = 0x6d736100;
 
+    struct WasmFile;
+
     enum class Section
     {
         Custom = 0,
@@ -90,11 +99,13 @@ namespace WasmFile
         Variable = 1,
     };
 
+    // Names, locals and data point into WasmFile::arena, data can also point into WasmFile::mapping
+
     struct Import
     {
         ImportType type;
-        std::string environment;
-        std::string name;
+        std::string_view environment;
+        std::string_view name;
 
         // FIXME: Make this a union
         uint32_t functionTypeIndex;
@@ -107,7 +118,7 @@ namespace WasmFile
         Type globalType;
         GlobalMutability globalMutability;
 
-        static Import read_from_stream(Stream& stream);
+        static Import read_from_stream(Stream& stream, WasmFile& wasmFile);
     };
 
     struct Table
@@ -131,16 +142,16 @@ namespace WasmFile
         GlobalMutability mutability;
         std::vector<Instruction> initCode;
 
-        static Global read_from_stream(Stream& stream);
+        static Global read_from_stream(Stream& stream, WasmFile& wasmFile);
     };
 
     struct Export
     {
-        std::string name;
+        std::string_view name;
         ImportType type;
         uint32_t index;
 
-        static Export read_from_stream(Stream& stream);
+        static Export read_from_stream(Stream& stream, WasmFile& wasmFile);
     };
 
     enum class ElementMode
@@ -155,11 +166,16 @@ namespace WasmFile
         uint32_t table;
         std::vector<Instruction> expr;
         std::vector<uint32_t> functionIndexes;
-        std::vector<std::vector<Instruction>> referencesExpr;
+        // The expressions of all references back to back, each one ends where the next one starts
+        std::vector<Instruction> referencesCode;
+        std::vector<uint32_t> referencesEnds;
         ElementMode mode;
         Type valueType;
 
-        static Element read_from_stream(Stream& stream);
+        static Element read_from_stream(Stream& stream, WasmFile& wasmFile);
+
+        size_t reference_count() const { return referencesEnds.size(); }
+        std::span<const Instruction> reference_expression(size_t index) const;
     };
 
     struct Local
@@ -170,12 +186,43 @@ namespace WasmFile
         static Local read_from_stream(Stream& stream);
     };
 
+    // From the metadata.code.branch_hint custom section, the offset is relative to the start of the function body
+    struct BranchHint
+    {
+        uint32_t offset;
+        bool likely;
+    };
+
+    struct CallSite
+    {
+        uint32_t ip;
+        // Operand stack height right before the call, including the arguments
+        uint32_t stackHeight;
+    };
+
+    struct LazyBody
+    {
+        // Offset of the size field of the body in WasmFile::lazyCode
+        uint32_t offset;
+        // Of the body together with its size field
+        uint32_t size;
+        std::vector<BranchHint> branchHints;
+    };
+
     struct Code
     {
-        std::vector<Type> locals;
+        std::span<const Type> locals;
         std::vector<Instruction> instructions;
 
-        static Code read_from_stream(Stream& stream);
+        // Reachable call and call_indirect sites in order, recorded by the validator for the inliner
+        std::vector<CallSite> callSites;
+
+        // Only set until a lazily loaded body is decoded on its first call
+        std::optional<LazyBody> lazyBody;
+
+        static Code read_from_stream(Stream& stream, WasmFile& wasmFile, std::span<const BranchHint> branchHints = {});
+        // Validates the body while decoding it
+        static Code read_from_stream(Stream& stream, WasmFile& wasmFile, Validator& validator, const FunctionType& type, std::span<const BranchHint> branchHints = {});
     };
 
     struct Data
@@ -183,14 +230,32 @@ namespace WasmFile
         uint32_t type;
         uint32_t memoryIndex;
         std::vector<Instruction> expr;
-        std::vector<uint8_t> data;
+        std::span<const uint8_t> data;
         ElementMode mode;
 
-        static Data read_from_stream(Stream& stream);
+        static Data read_from_stream(Stream& stream, WasmFile& wasmFile);
+    };
+
+    struct LoadOptions
+    {
+        bool validate { true };
+        bool optimize { true };
+        // Function bodies are decoded and validated on their first call, which skips the whole module passes
+        bool lazy { false };
+        // Only bodies reachable from the exports, the start function and references are decoded and validated.
+        // Not spec compliant, an invalid body that can never be called doesn't reject the module.
+        bool pruneUnreachable { false };
+        // Data segments of a mapped file are used in place instead of being copied. The file must not change while
+        // the module lives: rewriting it in place changes what later instances and resets start out with, and
+        // truncating it makes them fault. Modes that keep a module around for long should turn this off.
+        bool mapData { true };
     };
 
     struct WasmFile
     {
+        // Declared first, so it outlives everything pointing into it
+        Arena arena;
+
         std::vector<FunctionType> functionTypes;
         std::vector<Import> imports;
         std::vector<uint32_t> functionTypeIndexes;
@@ -204,7 +269,39 @@ namespace WasmFile
         std::vector<Data> dataBlocks;
         std::optional<uint32_t> dataCount;
 
-        static Ref<WasmFile> read_from_stream(Stream& stream, bool runValidator = true);
+        // Keyed by function index, only kept until the code section is parsed
+        std::unordered_map<uint32_t, std::vector<BranchHint>> branchHints;
+
+        // Only available for validated modules
+        Ref<CallGraph> callGraph;
+        // Counts of the module passes, kept apart from the call graph so cached modules have them too
+        uint32_t devirtualizedCallCount { 0 };
+        uint32_t inlinedCallCount { 0 };
+        uint32_t removedInstructionCount { 0 };
+        uint32_t prunedFunctionCount { 0 };
+
+        // FNV-1a over the sections as they were read, used to match profiles to modules
+        uint64_t contentHash { 0 };
+
+        // Bodies are decoded on several threads, each call_indirect site takes the next index
+        std::atomic<uint32_t> indirectCallSiteCount { 0 };
+        // Cache index of a call_indirect site to its most likely target function, seeded from a profile
+        std::unordered_map<uint32_t, uint32_t> indirectCallTargetHints;
+
+        LoadOptions loadOptions;
+        // The file the module was read from, kept while data segments point into it
+        Ref<FileMapping> mapping;
+
+        // Copy of the code section, only kept for lazily loaded modules and ones with pruned bodies
+        std::vector<uint8_t> lazyCode;
+        Ref<Validator> lazyValidator;
+        // Instances of the module can run on different threads, bodies are decoded under this lock
+        std::mutex lazyCodeMutex;
+
+        static Ref<WasmFile> read_from_stream(Stream& stream, LoadOptions options = {});
+
+        // Validation errors of lazily loaded bodies are thrown from here, the body stays undecoded in that case
+        void decode_lazy_code(const FunctionType& type, Code& code);
 
         std::optional<Export> find_export_by_name(std::string_view name);
 
@@ -218,7 +315,8 @@ namespace WasmFile
 
         static BlockType read_from_stream(Stream& stream);
 
-        std::vector<Type> get_param_types(Ref<WasmFile> wasmFile) const;
-        std::vector<Type> get_return_types(Ref<WasmFile> wasmFile) const;
+        // Point into the module or static storage, never into the block type itself
+        std::span<const Type> get_param_types(const WasmFile& wasmFile) const;
+        std::span<const Type> get_return_types(const WasmFile& wasmFile) const;
     };
 }
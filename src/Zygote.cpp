@@ -0,0 +1,148 @@
+#include "Zygote.h"
+#include "Util/LineReader.h"
+#include "Util/UnixSocket.h"
+#include "VM/Trap.h"
+#include "VM/VM.h"
+#include "WasmFile/WasmFile.h"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <print>
+#include <sstream>
+#include <system_error>
+#include <sys/wait.h>
+#include <unistd.h>
+
+Zygote::Zygote(Ref<RealModule> instance)
+    : m_instance(instance)
+{
+}
+
+void Zygote::serve_socket(const std::string& path)
+{
+    const int server = listen_on_unix_socket(path);
+
+    while (true)
+    {
+        const int connection = accept_connection(server);
+
+        // The child reads the job itself, so a slow client never holds up the others
+        fork_job({}, connection, connection);
+        close(connection);
+
+        reap_children(false);
+    }
+}
+
+void Zygote::serve_stdin()
+{
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        fork_job(line, -1, STDOUT_FILENO);
+        reap_children(true);
+    }
+}
+
+pid_t Zygote::fork_job(std::optional<std::string> job, int input, int output)
+{
+    const uint64_t jobId = m_next_job_id++;
+
+    // Buffered output would be written by the child as well
+    fflush(stdout);
+    fflush(stderr);
+
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t child = fork();
+    if (child < 0)
+        throw std::system_error(errno, std::generic_category(), "fork");
+
+    if (child == 0)
+        run_job(std::move(job), input, output);
+
+    const auto forkTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+    std::println(stderr, "Job {}: forked in {:.1f} us", jobId, forkTime.count());
+
+    m_running_jobs[child] = jobId;
+    return child;
+}
+
+void Zygote::run_job(std::optional<std::string> line, int input, int output)
+{
+    int status = 0;
+
+    if (output != STDOUT_FILENO)
+        dup2(output, STDOUT_FILENO);
+
+    try
+    {
+        if (!line)
+            line = LineReader(input).read_line();
+
+        std::istringstream job(line.value_or(""));
+        std::string function;
+        job >> function;
+
+        const auto exported = m_instance->try_import(function, WasmFile::ImportType::Function);
+        if (!exported)
+            throw Trap(std::format("Unknown function: {}", function));
+
+        const auto& type = std::get<Ref<Function>>(*exported)->type();
+
+        std::vector<Value> args;
+        std::string argument;
+        while (job >> argument)
+        {
+            if (args.size() == type.params.size())
+                throw Trap("Too many arguments");
+            args.push_back(value_from_string(argument, type.params[args.size()]));
+        }
+
+        for (const auto& value : VM::run_function(m_instance, function, args))
+            std::println("{}", value);
+    }
+    catch (const Trap& trap)
+    {
+        std::println(stderr, "Trapped ({})", trap.reason());
+        status = 1;
+    }
+    catch (const std::logic_error&)
+    {
+        std::println(stderr, "Invalid argument");
+        status = 1;
+    }
+    catch (...)
+    {
+        // Nothing may unwind out of the child into the accept loop of the parent
+        std::println(stderr, "Job failed");
+        status = 1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+void Zygote::reap_children(bool wait)
+{
+    while (!m_running_jobs.empty())
+    {
+        int status = 0;
+        const pid_t child = waitpid(-1, &status, wait ? 0 : WNOHANG);
+        if (child < 0 && errno == EINTR)
+            continue;
+        if (child <= 0)
+            return;
+
+        const auto job = m_running_jobs.find(child);
+        if (job == m_running_jobs.end())
+            continue;
+
+        if (WIFEXITED(status))
+            std::println(stderr, "Job {}: exited with status {}", job->second, WEXITSTATUS(status));
+        else if (WIFSIGNALED(status))
+            std::println(stderr, "Job {}: killed by signal {}", job->second, WTERMSIG(status));
+
+        m_running_jobs.erase(job);
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "VM/Module.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+// Runs jobs in forked copies of one initialized instance. The children inherit the module and the instance
+// copy-on-write, so every job is isolated in a process of its own without loading or initializing anything again.
+// A job is a line with the name of an exported function followed by its arguments, the results are written back one
+// per line. How long each fork took and how the job exited is reported on stderr.
+class Zygote
+{
+public:
+    Zygote(Ref<RealModule> instance);
+
+    // Every connection to the Unix socket at the given path is one job, the child reads it from and answers on the connection
+    void serve_socket(const std::string& path);
+    // Every line of stdin is one job, they run one after the other and answer on stdout
+    void serve_stdin();
+
+private:
+    // The job is read from the input by the child if it isn't known yet
+    pid_t fork_job(std::optional<std::string> job, int input, int output);
+    [[noreturn]] void run_job(std::optional<std::string> job, int input, int output);
+
+    void reap_children(bool wait);
+
+    Ref<RealModule> m_instance;
+
+    uint64_t m_next_job_id { 0 };
+    std::unordered_map<pid_t, uint64_t> m_running_jobs;
+};
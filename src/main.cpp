@@ -1,15 +1,315 @@
-#include "Stream/FileStream.h"
+#include "Server.h"
+#include "Stream/MappedFileStream.h"
+#include "Stream/PipeStream.h"
 #include "Tests/SpecTestModule.h"
 #include "Tests/TestRunner.h"
+#include "VM/Batch.h"
+#include "VM/Preinitializer.h"
+#include "VM/Profile.h"
+#include "VM/Snapshot.h"
 #include "VM/Trap.h"
 #include "VM/VM.h"
+#include "WasmFile/ModuleCache.h"
 #include "WASI.h"
+#include "Zygote.h"
 #include <argparse/argparse.hpp>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <nlohmann/json.hpp>
 #include <print>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+// Regular files are mapped, pipes and stdin are parsed while the bytes are still arriving
+static Own<Stream> open_module_stream(const std::string& path)
+{
+    std::error_code error;
+    if (path != "-" && std::filesystem::is_regular_file(path, error))
+        return MakeOwn<MappedFileStream>(path);
+    return MakeOwn<PipeStream>(path);
+}
+
+// Parses the arguments of a subcommand and runs it. Every subcommand takes -w, and whatever stops one is reported the
+// same way for all of them.
+static int run_subcommand(argparse::ArgumentParser& parser, int argc, char** argv, const std::function<int()>& run)
+{
+    parser.add_argument("-w", "--enable-wasi")
+        .help("enable support for WASI")
+        .flag();
+
+    try
+    {
+        parser.parse_args(argc, argv);
+    }
+    catch (const std::exception& err)
+    {
+        std::cerr << err.what() << '\n';
+        std::cerr << parser;
+        return 1;
+    }
+
+    if (parser["-w"] == true)
+        VM::register_module("wasi_snapshot_preview1", MakeRef<WASIModule>());
+
+    try
+    {
+        return run();
+    }
+    catch (const Trap& trap)
+    {
+        std::println(std::cerr, "Trapped ({})", trap.reason());
+    }
+    catch (const WasmFile::InvalidWASMException& e)
+    {
+        std::println(std::cerr, "Invalid WASM ({})", e.reason());
+    }
+    catch (const SnapshotException& e)
+    {
+        std::println(std::cerr, "Snapshot failed ({})", e.reason());
+    }
+    catch (const StreamReadException&)
+    {
+        std::println(std::cerr, "Failed to read {}", parser.get("path"));
+    }
+    catch (const std::system_error& e)
+    {
+        std::println(std::cerr, "{}", e.what());
+    }
+    catch (const std::logic_error&)
+    {
+        std::println(std::cerr, "Invalid argument");
+    }
+
+    return 1;
+}
+
+// wasvm preinit in.wasm --init-func wizer.initialize -o out.wasm
+static int run_preinit(int argc, char** argv)
+{
+    argparse::ArgumentParser parser("wasvm preinit");
+
+    parser.add_argument("--init-func")
+        .help("function to run after the start function, before the state is written")
+        .default_value(std::string("wizer.initialize"));
+
+    parser.add_argument("-o")
+        .help("path of the initialized module")
+        .required();
+
+    parser.add_argument("path")
+        .help("path of the module to initialize");
+
+    return run_subcommand(parser, argc, argv, [&]() {
+        // The sections that don't change are copied from the original bytes, so the whole module has to be in memory
+        MappedFileStream stream(parser.get("path"));
+        auto file = WasmFile::WasmFile::read_from_stream(stream);
+
+        const auto instance = VM::load_module(file);
+        const auto initFunction = parser.get("--init-func");
+
+        // Modules without the default export only run their start function, a name that was asked for has to exist
+        if (file->find_export_by_name(initFunction))
+            (void)VM::run_function(initFunction, {});
+        else if (parser.is_used("--init-func"))
+        {
+            std::println(std::cerr, "Unknown function: {}", initFunction);
+            return 1;
+        }
+
+        const auto initialized = preinitialize(stream.buffer(), *instance, initFunction);
+
+        std::ofstream out(parser.get("-o"), std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(initialized.data()), initialized.size());
+        if (!out)
+        {
+            std::println(std::cerr, "Failed to write {}", parser.get("-o"));
+            return 1;
+        }
+
+        return 0;
+    });
+}
+
+// wasvm zygote module.wasm [--socket path]
+static int run_zygote(int argc, char** argv)
+{
+    argparse::ArgumentParser parser("wasvm zygote");
+
+    parser.add_argument("--socket")
+        .help("take jobs from connections to a Unix socket at the given path instead of from the lines of stdin");
+
+    parser.add_argument("path")
+        .help("path of the module to serve");
+
+    return run_subcommand(parser, argc, argv, [&]() {
+        const auto fileStream = open_module_stream(parser.get("path"));
+        // Every job resets from the data segments, so they mustn't depend on the file staying as it is
+        Zygote zygote(VM::load_module(WasmFile::WasmFile::read_from_stream(*fileStream, { .mapData = false })));
+
+        if (const auto path = parser.present("--socket"))
+            zygote.serve_socket(*path);
+        else
+            zygote.serve_stdin();
+
+        return 0;
+    });
+}
+
+// wasvm serve module.wasm [--socket path]
+static int run_server(int argc, char** argv)
+{
+    argparse::ArgumentParser parser("wasvm serve");
+
+    parser.add_argument("--socket")
+        .help("take requests from connections to a Unix socket at the given path instead of from stdin");
+
+    parser.add_argument("--no-optimizer")
+        .help("disable load-time optimization of validated code")
+        .flag();
+
+    parser.add_argument("path")
+        .help("path of the module to serve");
+
+    return run_subcommand(parser, argc, argv, [&]() {
+        // A client going away before reading its response mustn't take the server down with it
+        signal(SIGPIPE, SIG_IGN);
+
+        // Responses on stdout keep a copy of it to themselves, whatever the guest prints goes to stderr instead
+        const auto socketPath = parser.present("--socket");
+        int responses = STDOUT_FILENO;
+        if (!socketPath)
+        {
+            std::cout.flush();
+            responses = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+
+        const auto fileStream = open_module_stream(parser.get("path"));
+        // Resets reapply the data segments for as long as the server runs, so they mustn't depend on the file
+        const WasmFile::LoadOptions loadOptions {
+            .optimize = parser["--no-optimizer"] == false,
+            .mapData = false,
+        };
+
+        Server server(VM::load_module(WasmFile::WasmFile::read_from_stream(*fileStream, loadOptions)));
+
+        if (socketPath)
+            server.serve_socket(*socketPath);
+        else
+            server.serve(STDIN_FILENO, responses);
+
+        return 0;
+    });
+}
+
+static const WasmFile::FunctionType& exported_function_type(WasmFile::WasmFile& file, const std::string& name)
+{
+    const auto exported = file.find_export_by_name(name);
+    if (!exported || exported->type != WasmFile::ImportType::Function)
+        throw Trap(std::format("Unknown function: {}", name));
+
+    uint32_t index = exported->index;
+    for (const auto& import : file.imports)
+    {
+        if (import.type != WasmFile::ImportType::Function)
+            continue;
+        if (index-- == 0)
+            return file.functionTypes[import.functionTypeIndex];
+    }
+
+    return file.functionTypes[file.functionTypeIndexes[index]];
+}
+
+// wasvm batch module.wasm -f score [--input args.txt] [--threads N]
+static int run_batch_command(int argc, char** argv)
+{
+    argparse::ArgumentParser parser("wasvm batch");
+
+    parser.add_argument("-f")
+        .help("which function of the module to run")
+        .required();
+
+    parser.add_argument("--input")
+        .help("file with one line of whitespace separated arguments per call, - for stdin")
+        .default_value(std::string("-"));
+
+    parser.add_argument("--threads")
+        .help("number of threads, each one runs its own instance of the module")
+        .default_value(static_cast<size_t>(std::thread::hardware_concurrency()))
+        .scan<'u', size_t>();
+
+    parser.add_argument("path")
+        .help("path of the module to run");
+
+    return run_subcommand(parser, argc, argv, [&]() {
+        const auto fileStream = open_module_stream(parser.get("path"));
+        auto file = WasmFile::WasmFile::read_from_stream(*fileStream);
+
+        const auto function = parser.get("-f");
+        const auto& type = exported_function_type(*file, function);
+
+        std::ifstream inputFile;
+        const auto inputPath = parser.get("--input");
+        if (inputPath != "-")
+            inputFile.open(inputPath);
+        std::istream& input = inputPath == "-" ? std::cin : inputFile;
+        if (!input)
+        {
+            std::println(std::cerr, "Failed to read {}", inputPath);
+            return 1;
+        }
+
+        std::vector<std::vector<Value>> arguments;
+        std::string line;
+        for (size_t lineNumber = 1; std::getline(input, line); lineNumber++)
+        {
+            std::istringstream tuple(line);
+            auto& args = arguments.emplace_back();
+
+            std::string argument;
+            while (tuple >> argument)
+            {
+                if (args.size() == type.params.size())
+                    throw Trap(std::format("Too many arguments on line {}", lineNumber));
+                args.push_back(value_from_string(argument, type.params[args.size()]));
+            }
+
+            if (args.size() != type.params.size())
+                throw Trap(std::format("Too few arguments on line {}", lineNumber));
+        }
+
+        for (const auto& result : run_batch(file, function, arguments, parser.get<size_t>("--threads")))
+        {
+            if (result.trap)
+            {
+                std::println("Trapped ({})", *result.trap);
+                continue;
+            }
+
+            std::string values;
+            for (const auto& value : result.values)
+                values += std::format("{}{}", values.empty() ? "" : " ", value);
+            std::println("{}", values);
+        }
+
+        return 0;
+    });
+}
 
 int main(int argc, char** argv)
 {
+    if (argc > 1 && std::string_view(argv[1]) == "preinit")
+        return run_preinit(argc - 1, argv + 1);
+    if (argc > 1 && std::string_view(argv[1]) == "zygote")
+        return run_zygote(argc - 1, argv + 1);
+    if (argc > 1 && std::string_view(argv[1]) == "serve")
+        return run_server(argc - 1, argv + 1);
+    if (argc > 1 && std::string_view(argv[1]) == "batch")
+        return run_batch_command(argc - 1, argv + 1);
+
     argparse::ArgumentParser parser("wasvm");
 
     auto& group = parser.add_mutually_exclusive_group();
@@ -26,6 +326,25 @@ int main(int argc, char** argv)
         .help("disable validation of WASM module")
         .flag();
 
+    parser.add_argument("--no-optimizer")
+        .help("disable load-time optimization of validated code")
+        .flag();
+
+    parser.add_argument("--lazy")
+        .help("decode and validate function bodies on their first call")
+        .flag();
+
+    parser.add_argument("--prune-unreachable")
+        .help("skip decoding and validating functions that can't be reached from the exports, not spec compliant")
+        .flag();
+
+    parser.add_argument("--cache-dir")
+        .help("keep validated modules in the given directory to skip loading them again, defaults to $WASVM_CACHE_DIR");
+
+    parser.add_argument("--stats")
+        .help("print what the load-time passes changed")
+        .flag();
+
     parser.add_argument("--load-test-module")
         .help("load the spectest module")
         .flag();
@@ -34,8 +353,23 @@ int main(int argc, char** argv)
         .help("enable support for WASI")
         .flag();
 
+    parser.add_argument("--profile-out")
+        .help("record an execution profile and merge it into the given file");
+
+    parser.add_argument("--profile-in")
+        .help("optimize the module using a previously recorded execution profile");
+
+    parser.add_argument("--snapshot-out")
+        .help("write a snapshot of the initialized instance to the given file instead of running a function");
+
+    parser.add_argument("--snapshot-init")
+        .help("function to run before the snapshot is taken, after the start function");
+
+    parser.add_argument("--snapshot-in")
+        .help("start out from a snapshot instead of initializing the instance");
+
     parser.add_argument("path")
-        .help("path of module/test to run");
+        .help("path of module/test to run, - reads the module from stdin");
 
     try
     {
@@ -69,16 +403,63 @@ int main(int argc, char** argv)
         if (parser["-w"] == true)
             VM::register_module("wasi_snapshot_preview1", MakeRef<WASIModule>());
 
+        Ref<Profile> recordedProfile;
+
         try
         {
-            FileStream fileStream(parser.get("path"));
-            auto file = WasmFile::WasmFile::read_from_stream(fileStream, parser["-n"] == false);
+            if (const auto path = parser.present("--profile-out"))
+            {
+                recordedProfile = Profile::load(*path);
+                VM::set_profile(recordedProfile);
+            }
+
+            const auto fileStream = open_module_stream(parser.get("path"));
+            const WasmFile::LoadOptions loadOptions {
+                .validate = parser["-n"] == false,
+                .optimize = parser["--no-optimizer"] == false,
+                .lazy = parser["--lazy"] == true,
+                .pruneUnreachable = parser["--prune-unreachable"] == true,
+            };
+
+            auto cacheDirectory = ModuleCache::directory_from_environment();
+            if (const auto directory = parser.present("--cache-dir"))
+                cacheDirectory = *directory;
+
+            auto file = cacheDirectory ? ModuleCache(*cacheDirectory).read_from_stream(*fileStream, loadOptions) : WasmFile::WasmFile::read_from_stream(*fileStream, loadOptions);
+
+            if (parser["--stats"] == true)
+            {
+                std::println(std::cerr, "Devirtualized calls: {}", file->devirtualizedCallCount);
+                std::println(std::cerr, "Inlined calls: {}", file->inlinedCallCount);
+                std::println(std::cerr, "Removed instructions: {}", file->removedInstructionCount);
+                std::println(std::cerr, "Pruned functions: {}", file->prunedFunctionCount);
+            }
+
+            if (const auto path = parser.present("--profile-in"))
+            {
+                const auto profile = Profile::load(*path);
+                if (const auto* moduleProfile = profile->find_module(file->contentHash))
+                    moduleProfile->apply_to(*file);
+            }
 
-            VM::load_module(file);
+            if (const auto path = parser.present("--snapshot-in"))
+                VM::load_module(file, *Snapshot::load(*path));
+            else
+                VM::load_module(file);
 
-            std::vector<Value> returnValues = VM::run_function(parser.get("-f"), {});
-            for (const auto value : returnValues)
-                std::println("{}", value);
+            if (const auto path = parser.present("--snapshot-out"))
+            {
+                if (const auto function = parser.present("--snapshot-init"))
+                    (void)VM::run_function(*function, {});
+
+                Snapshot::write(*std::static_pointer_cast<RealModule>(VM::current_module()), *path);
+            }
+            else
+            {
+                std::vector<Value> returnValues = VM::run_function(parser.get("-f"), {});
+                for (const auto value : returnValues)
+                    std::println("{}", value);
+            }
         }
         catch (const Trap& trap)
         {
@@ -88,9 +469,30 @@ int main(int argc, char** argv)
         {
             std::println(std::cerr, "Invalid WASM ({})", e.reason());
         }
+        catch (const ProfileException& e)
+        {
+            std::println(std::cerr, "Invalid profile ({})", e.reason());
+        }
+        catch (const SnapshotException& e)
+        {
+            std::println(std::cerr, "Snapshot failed ({})", e.reason());
+        }
         catch (...)
         {
             std::println("Unknown exception");
         }
+
+        // Traps are saved too, the counts up to that point are still valid
+        if (recordedProfile)
+        {
+            try
+            {
+                recordedProfile->save(parser.get("--profile-out"));
+            }
+            catch (const ProfileException& e)
+            {
+                std::println(std::cerr, "Failed to save profile ({})", e.reason());
+            }
+        }
     }
 }